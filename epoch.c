@@ -0,0 +1,218 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "epoch.h"
+
+/*
+ * how it works
+ * there is one global epoch counter. a reader entering a critical section
+ * announces the epoch it saw in its own per-thread record. the global epoch
+ * may only move forward once every active reader has announced the current
+ * value - so once it has moved forward twice since something was unlinked,
+ * every reader that is still active entered after the unlink and cannot be
+ * holding the old pointer.
+ * the announcement packs the epoch and an "active" bit into one word:
+ * (epoch << 1) | 1 while inside a critical section, 0 outside
+ *
+ * retired memory is tagged with the global epoch at the time it was retired
+ * and kept on the retiring thread's own list (no sharing, so no locking).
+ * an item tagged e is safe to free once the global epoch reaches e + 2.
+ * items go onto the list in epoch order, so the safe ones are always at the
+ * front and one pass frees a whole batch of them
+ */
+typedef struct {
+    void *ptr;                          // the memory to free
+    void (*free_fn)(void *);            // how to free it
+    uint64_t epoch;                     // global epoch when it was retired
+} retired_t;
+
+typedef struct epoch_record {
+    _Atomic uint64_t announce;          // (epoch << 1) | 1 while reading, else 0
+    atomic_int in_use;                  // owned by a live thread?
+    struct epoch_record *next;          // next record in the global list
+    retired_t *retired;                 // retired items waiting to be freed, oldest first
+    size_t retired_count;               // how many items are on the list
+    size_t retired_capacity;            // room in the retired array
+    size_t since_scan;                  // retires since the list was last checked
+} __attribute__((aligned(64))) epoch_record_t;
+
+static _Atomic uint64_t global_epoch = 1;
+
+/*
+ * every record ever created, newest first
+ * records are never freed - when a thread exits its record is marked unused
+ * and handed to the next new thread - so walking the list needs no lock
+ */
+static _Atomic(epoch_record_t *) records = NULL;
+
+static __thread epoch_record_t *my_record = NULL;   // this thread's record
+static pthread_key_t exit_key;                      // runs release_record() at thread exit
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t try_advance(void);
+static void free_old_enough(epoch_record_t *record, uint64_t epoch);
+
+/*
+ * called automatically when a registered thread exits
+ * frees whatever it can from the thread's retire list; anything that still
+ * isn't safe stays on the record and is freed by the next thread to take it
+ */
+static void release_record(void *arg) {
+    epoch_record_t *record = arg;
+    atomic_store(&record->announce, 0);
+    free_old_enough(record, try_advance());
+    atomic_store(&record->in_use, 0);
+}
+
+static void make_key(void) {
+    pthread_key_create(&exit_key, release_record);
+}
+
+/*
+ * find this thread its record: reuse one left behind by a finished thread,
+ * or push a new one onto the front of the list
+ */
+static epoch_record_t *register_thread(void) {
+    pthread_once(&key_once, make_key);
+
+    epoch_record_t *record;
+    for (record = atomic_load(&records); record != NULL; record = record->next) {
+        int unused = 0;
+        if (atomic_load(&record->in_use) == 0 &&
+            atomic_compare_exchange_strong(&record->in_use, &unused, 1)) {
+            break;
+        }
+    }
+
+    if (record == NULL) {
+        record = aligned_alloc(64, sizeof(epoch_record_t));
+        if (record == NULL) {
+            abort();  // nothing sensible to do without a record
+        }
+        atomic_init(&record->announce, 0);
+        atomic_init(&record->in_use, 1);
+        record->retired = NULL;
+        record->retired_count = 0;
+        record->retired_capacity = 0;
+        record->since_scan = 0;
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record)) {
+            // someone else pushed first - record->next was refreshed, try again
+        }
+    }
+
+    pthread_setspecific(exit_key, record);
+    my_record = record;
+    return record;
+}
+
+void epoch_enter(void) {
+    epoch_record_t *record = my_record;
+    if (record == NULL) {
+        record = register_thread();
+    }
+    /*
+     * announce the epoch we saw. the store is sequentially consistent, so
+     * a writer either sees our announcement or we see its unlink - there is
+     * no interleaving where both miss each other
+     */
+    uint64_t epoch = atomic_load(&global_epoch);
+    atomic_store(&record->announce, (epoch << 1) | 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&my_record->announce, 0, memory_order_release);
+}
+
+/*
+ * move the global epoch forward by one if every active reader has caught up
+ * with it. returns the global epoch afterwards
+ */
+static uint64_t try_advance(void) {
+    uint64_t epoch = atomic_load(&global_epoch);
+    for (epoch_record_t *r = atomic_load(&records); r != NULL; r = r->next) {
+        uint64_t announce = atomic_load(&r->announce);
+        if ((announce & 1) && (announce >> 1) != epoch) {
+            return epoch;  // this reader is still in an older epoch
+        }
+    }
+    // if the compare-exchange fails someone else advanced it - just as good
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+    return atomic_load(&global_epoch);
+}
+
+void epoch_synchronize(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t target = atomic_load(&global_epoch) + 2;
+    while (try_advance() < target) {
+        sched_yield();  // give the reader we're waiting for a chance to finish
+    }
+}
+
+/*
+ * free every item on the record's list that was retired at least two epochs
+ * before epoch, and slide the rest to the front
+ */
+static void free_old_enough(epoch_record_t *record, uint64_t epoch) {
+    size_t done = 0;
+    while (done < record->retired_count && record->retired[done].epoch + 2 <= epoch) {
+        record->retired[done].free_fn(record->retired[done].ptr);
+        done++;
+    }
+    record->retired_count -= done;
+    memmove(record->retired, record->retired + done, record->retired_count * sizeof(retired_t));
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    epoch_record_t *record = my_record;
+    if (record == NULL) {
+        record = register_thread();
+    }
+
+    // make room on the list (it only grows while a slow reader holds an epoch back)
+    if (record->retired_count == record->retired_capacity) {
+        size_t capacity = record->retired_capacity ? record->retired_capacity * 2 : EPOCH_RETIRE_BATCH;
+        retired_t *bigger = realloc(record->retired, capacity * sizeof(retired_t));
+        if (bigger == NULL) {
+            // no memory to defer the free: fall back to waiting for the readers now
+            epoch_synchronize();
+            free_fn(ptr);
+            return;
+        }
+        record->retired = bigger;
+        record->retired_capacity = capacity;
+    }
+
+    /*
+     * tag it with the current epoch. the caller unlinked ptr before calling
+     * us, and the fence keeps that unlink ordered before the epoch we read
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    retired_t *item = &record->retired[record->retired_count++];
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+    item->epoch = atomic_load(&global_epoch);
+
+    /*
+     * every EPOCH_RETIRE_BATCH retires, nudge the epoch forward and free
+     * everything that has become safe - one scan of the readers pays for a
+     * whole batch of frees
+     */
+    if (++record->since_scan >= EPOCH_RETIRE_BATCH) {
+        record->since_scan = 0;
+        free_old_enough(record, try_advance());
+    }
+}
+
+void epoch_barrier(void) {
+    // two full grace periods make every item retired so far old enough
+    epoch_synchronize();
+    uint64_t epoch = atomic_load(&global_epoch);
+    for (epoch_record_t *r = atomic_load(&records); r != NULL; r = r->next) {
+        free_old_enough(r, epoch);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * EPOCH-BASED PROTECTION
+ * lets readers walk shared data structures without taking any lock, while
+ * writers still get to free the memory they unlink - just not while a reader
+ * could still be looking at it.
+ * a reader brackets its access with epoch_enter()/epoch_exit(). a writer that
+ * has unlinked something hands it to epoch_retire(), which frees it later,
+ * once no reader can still be holding a pointer to it. retired memory is
+ * collected on a per-thread list and freed in batches, so retiring is cheap
+ * and never waits for readers. (epoch_synchronize() is the blocking
+ * alternative: it waits for the readers right away.)
+ * threads register themselves automatically the first time they enter, and
+ * are forgotten when they exit, so this works with short-lived threads too
+ */
+
+/*
+ * start a read-side critical section
+ * anything reached through shared pointers after this stays valid until
+ * epoch_exit(). sections must not be nested and must not block for long
+ */
+void epoch_enter(void);
+
+// end the read-side critical section started by epoch_enter()
+void epoch_exit(void);
+
+/*
+ * wait until every read-side critical section that was running when this
+ * was called has ended. anything unlinked before the call can be freed
+ * once it returns. must not be called from inside a critical section
+ */
+void epoch_synchronize(void);
+
+/*
+ * free ptr with free_fn(ptr) once no reader can still be using it
+ * ptr must already be unreachable for new readers (unlinked). the calling
+ * thread keeps it on its own retire list; every EPOCH_RETIRE_BATCH retires
+ * the list is checked and whatever is old enough is freed in one go.
+ * must not be called from inside a critical section
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+// retired items collected before a thread's list is checked
+#define EPOCH_RETIRE_BATCH 64
+
+/*
+ * free everything retired so far, by every thread
+ * only for shutdown: no other thread may be inside a critical section or
+ * retiring anything at the same time
+ */
+void epoch_barrier(void);
+
+#endif
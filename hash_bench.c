@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "uthash.h"
+#include "kv_hash.h"
+
+/*
+ * hash function benchmark
+ * times every hash the store can use (plus uthash's HASH_JEN, which the
+ * store used before, as a baseline) on the shapes of key we actually see,
+ * and checks how evenly each one spreads them:
+ *   ./hash_bench                 100000 keys of each shape
+ *   ./hash_bench --keys 1000000
+ */
+
+#define DEFAULT_KEYS 100000
+// each measurement repeats over the keys until at least this long has passed
+#define MIN_SECONDS 0.25
+
+// the old uthash hash, wrapped to look like the others (it has no seed)
+static uint64_t hash_jen(const void *data, size_t len, uint64_t seed) {
+    unsigned hashv;
+    (void)seed;
+    HASH_VALUE(data, len, hashv);
+    return hashv;
+}
+
+typedef struct {
+    const char *name;
+    kv_hash_fn fn;
+} hash_choice_t;
+
+static const hash_choice_t hashes[] = {
+    { "jen (uthash)", hash_jen },
+    { "wyhash", kv_hash_wyhash },
+    { "xxh64", kv_hash_xxh64 },
+    { "crc32c", kv_hash_crc32c },
+};
+
+// the key shapes, each built from a key number
+typedef struct {
+    const char *name;
+    void (*make)(char *key, size_t size, int i);
+} key_shape_t;
+
+static void make_counter(char *key, size_t size, int i) {
+    snprintf(key, size, "key:%d", i);
+}
+
+static void make_hex_id(char *key, size_t size, int i) {
+    snprintf(key, size, "%016llx", (unsigned long long)i * 0x9E3779B97F4A7C15ull);
+}
+
+static void make_uuid(char *key, size_t size, int i) {
+    unsigned long long x = (unsigned long long)i * 0xBF58476D1CE4E5B9ull;
+    snprintf(key, size, "%08llx-%04llx-4%03llx-a%03llx-%012llx",
+             x >> 32, (x >> 16) & 0xFFFF, x & 0xFFF, (x >> 20) & 0xFFF, (unsigned long long)i);
+}
+
+static void make_path(char *key, size_t size, int i) {
+    snprintf(key, size, "tenant:%d:user:%d:session:%d:preferences:notifications:email",
+             i % 97, i / 7, i);
+}
+
+static void make_long(char *key, size_t size, int i) {
+    memset(key, 'x', size - 1);
+    key[size - 1] = '\0';
+    char prefix[32];
+    int len = snprintf(prefix, sizeof(prefix), "blob:%d:", i);
+    memcpy(key, prefix, len);
+}
+
+static const key_shape_t shapes[] = {
+    { "counter (key:N)", make_counter },
+    { "16-char hex id", make_hex_id },
+    { "36-char uuid", make_uuid },
+    { "~60-char path", make_path },
+    { "255-char key", make_long },
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// every hash is added into this, so the compiler can't skip computing them
+volatile uint64_t sink;
+
+// nanoseconds per hash over every key, repeated until MIN_SECONDS have passed
+static double time_hash(kv_hash_fn fn, char **keys, size_t *lengths, int num_keys, uint64_t seed) {
+    uint64_t sum = 0;
+    long hashed = 0;
+    double start = now_seconds(), elapsed;
+    do {
+        for (int i = 0; i < num_keys; i++) {
+            sum += fn(keys[i], lengths[i], seed);
+        }
+        hashed += num_keys;
+        elapsed = now_seconds() - start;
+    } while (elapsed < MIN_SECONDS);
+    sink = sum;
+    return elapsed * 1e9 / hashed;
+}
+
+/*
+ * drop every key into num_keys buckets by the low bits of its hash (like the
+ * swiss table does) and return the fullest bucket - a good hash keeps it
+ * near the balls-into-bins expectation of a handful
+ */
+static int worst_bucket(kv_hash_fn fn, char **keys, size_t *lengths, int num_keys, uint64_t seed) {
+    size_t buckets = 1;
+    while (buckets < (size_t)num_keys) {
+        buckets *= 2;
+    }
+    int *counts = calloc(buckets, sizeof(int));
+    if (counts == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    int worst = 0;
+    for (int i = 0; i < num_keys; i++) {
+        int *count = &counts[fn(keys[i], lengths[i], seed) & (buckets - 1)];
+        if (++*count > worst) {
+            worst = *count;
+        }
+    }
+    free(counts);
+    return worst;
+}
+
+int main(int argc, char *argv[]) {
+    int num_keys = DEFAULT_KEYS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            num_keys = atoi(argv[++i]);
+        } else {
+            num_keys = 0;
+            break;
+        }
+    }
+    if (num_keys <= 0) {
+        fprintf(stderr, "Usage: %s [--keys N]\n", argv[0]);
+        return 1;
+    }
+
+    char **keys = malloc(sizeof(char *) * num_keys);
+    size_t *lengths = malloc(sizeof(size_t) * num_keys);
+    if (keys == NULL || lengths == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    uint64_t seed = kv_hash_random_seed();
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        for (int i = 0; i < num_keys; i++) {
+            char key[256];
+            shapes[s].make(key, sizeof(key), i);
+            keys[i] = strdup(key);
+            lengths[i] = strlen(key);
+        }
+
+        printf("\n%s keys, %d of them\n", shapes[s].name, num_keys);
+        printf("%-14s %10s %14s\n", "hash", "ns/key", "worst bucket");
+        for (size_t h = 0; h < sizeof(hashes) / sizeof(hashes[0]); h++) {
+            double ns = time_hash(hashes[h].fn, keys, lengths, num_keys, seed);
+            int worst = worst_bucket(hashes[h].fn, keys, lengths, num_keys, seed);
+            printf("%-14s %10.2f %14d\n", hashes[h].name, ns, worst);
+            fflush(stdout);
+        }
+
+        for (int i = 0; i < num_keys; i++) {
+            free(keys[i]);
+        }
+    }
+
+    free(keys);
+    free(lengths);
+    return 0;
+}
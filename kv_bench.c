@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "kv_store.h"
+
+/*
+ * store benchmark
+ * calls the store directly (no sockets) from a growing number of threads
+ * and reports operations per second, so the engines and locking modes can
+ * be compared head-to-head:
+ *   ./kv_bench                     mutex vs rwlock vs lock-free, 95% GETs, 1..N threads
+ *   ./kv_bench --shards 1          sharded engine on one lock - shows the most contention
+ *   ./kv_bench --engine lockfree --reads 100 --threads 32
+ *   ./kv_bench --engine sharded --shards 1 --keys 5000000 --rehash both
+ *                                  worst-case SET latency while the table grows
+ *   ./kv_bench --engine sharded --keys 5000000 --batch 32
+ *                                  GETs and SETs 32 keys at a time (MGET / MSET)
+ *   ./kv_bench --engine sharded --reads 0 --wal /tmp/bench.log --fsync always
+ *                                  every SET logged and synced - shows what group commit buys
+ */
+
+// defaults for the command-line options
+#define DEFAULT_KEYS 100000
+#define DEFAULT_SECONDS 2
+#define DEFAULT_READ_PCT 95
+
+// settings shared by every worker thread
+static char **keys;          // pre-built key strings, so the loop doesn't format any
+static int num_keys;
+static int read_pct;         // out of 100 operations, how many are GETs
+static int batch_size;       // keys per call: above 1, GETs and SETs go through kv_mget and kv_mset
+static int stop;             // set by the main thread when time is up
+
+/*
+ * per-thread result, padded to a full cache line so threads bumping their
+ * own counters don't fight over the same line (that would skew the numbers)
+ */
+typedef struct {
+    uint64_t ops;
+    char pad[64 - sizeof(uint64_t)];
+} worker_result_t;
+
+// a tiny per-thread random number generator (xorshift), cheaper than rand()
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void *worker(void *arg) {
+    worker_result_t *result = arg;
+    uint64_t rng = (uint64_t)(uintptr_t)arg * 0x9E3779B97F4A7C15ull | 1;
+    char value[KV_MAX_VALUE + 1];
+    uint64_t ops = 0;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        uint64_t r = next_random(&rng);
+        if (batch_size > 1) {
+            // every key counts as one operation, so the rates compare with one key per call
+            const char *batch[KV_BATCH_MAX], *values[KV_BATCH_MAX];
+            for (int i = 0; i < batch_size; i++) {
+                batch[i] = keys[next_random(&rng) % num_keys];
+                values[i] = "updated";
+            }
+            if ((int)((r >> 32) % 100) < read_pct) {
+                kv_mget(batch, batch_size, values, value, sizeof(value));
+            } else {
+                kv_mset(batch, values, batch_size);
+            }
+            ops += batch_size;
+            continue;
+        }
+        const char *key = keys[r % num_keys];
+        if ((int)((r >> 32) % 100) < read_pct) {
+            kv_get(key, value, sizeof(value));
+        } else {
+            kv_set(key, "updated");
+        }
+        ops++;
+    }
+    result->ops = ops;
+    return NULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * run num_threads workers for the given number of seconds
+ * returns the total operations per second across all of them
+ */
+static double run_round(int num_threads, int seconds) {
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    worker_result_t *results = NULL;
+    if (threads == NULL ||
+        posix_memalign((void**)&results, 64, sizeof(worker_result_t) * num_threads) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+    double start = now_seconds();
+    for (int i = 0; i < num_threads; i++) {
+        results[i].ops = 0;
+        if (pthread_create(&threads[i], NULL, worker, &results[i]) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    sleep(seconds);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    uint64_t total = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        total += results[i].ops;
+    }
+    double elapsed = now_seconds() - start;
+
+    free(threads);
+    free(results);
+    return total / elapsed;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * fill the (empty) store with every key from one thread, timing each SET
+ * the tables grow as they fill, so the slowest SETs show what a growing
+ * table costs whoever happens to trigger it
+ */
+static void fill_store(void) {
+    double *latency = malloc(sizeof(double) * num_keys);
+    if (latency == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_keys; i++) {
+        double start = now_seconds();
+        kv_set(keys[i], "initial");
+        latency[i] = now_seconds() - start;
+    }
+    qsort(latency, num_keys, sizeof(double), compare_doubles);
+    printf("fill: p50 %.2f us, p99 %.2f us, p99.99 %.2f us, max %.2f us\n",
+           latency[num_keys / 2] * 1e6, latency[(int)(num_keys * 0.99)] * 1e6,
+           latency[(int)(num_keys * 0.9999)] * 1e6, latency[num_keys - 1] * 1e6);
+    free(latency);
+}
+
+/*
+ * fill a fresh store with every key, then time it at 1, 2, 4, ... max_threads
+ */
+static void bench_config(const kv_config_t *config, int max_threads, int seconds) {
+    if (config->log_path != NULL) {
+        unlink(config->log_path);   // each configuration starts from an empty log, not the last one's keys
+    }
+    if (kv_store_init(config) < 0) {
+        fprintf(stderr, "failed to set up the store\n");
+        exit(1);
+    }
+
+    if (config->engine == KV_ENGINE_LOCKFREE) {
+        printf("\nlock-free engine, %d keys, %d%% GET", num_keys, read_pct);
+    } else {
+        printf("\nsharded engine with %s, %s rehash, %d shard(s), %d keys, %d%% GET",
+               config->lock_mode == KV_LOCK_RWLOCK ? "rwlock" : "mutex",
+               config->rehash == KV_REHASH_BLOCKING ? "blocking" : "incremental",
+               config->num_shards, num_keys, read_pct);
+    }
+    if (batch_size > 1) {
+        printf(", %d keys per batch", batch_size);
+    }
+    if (config->log_path != NULL) {
+        if (config->log_fsync == WAL_FSYNC_EVERY) {
+            printf(", logged and synced every %d ms", config->log_fsync_ms);
+        } else {
+            printf(", logged and %s", config->log_fsync == WAL_FSYNC_ALWAYS ? "synced on every write" : "never synced");
+        }
+    }
+    printf("\n");
+    fill_store();
+    printf("%8s %14s %10s\n", "threads", "ops/sec", "scaling");
+
+    double single = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double rate = run_round(threads, seconds);
+        if (threads == 1) {
+            single = rate;
+        }
+        printf("%8d %14.0f %9.2fx\n", threads, rate, rate / single);
+        fflush(stdout);
+        // make sure the largest count is always measured, even if it isn't a power of two
+        if (threads < max_threads && threads * 2 > max_threads) {
+            threads = max_threads / 2;
+        }
+    }
+
+    if (config->log_path != NULL) {
+        // records / writes is how many writes each trip to the disk carried
+        char stats[4096];
+        kv_stats(stats, sizeof(stats));
+        char *log = strstr(stats, "log_records="), *end = strstr(stats, " slab_pages=");
+        if (log != NULL && end != NULL) {
+            printf("%.*s\n", (int)(end - log), log);
+        }
+    }
+    kv_store_destroy();
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  --engine sharded|lockfree|both   engine(s) to measure (default both)\n");
+    fprintf(stderr, "  --lock mutex|rwlock|both         sharded engine locking mode(s) to measure (default both)\n");
+    fprintf(stderr, "  --rehash incremental|blocking|both  sharded engine rehash mode(s) to measure (default incremental)\n");
+    fprintf(stderr, "  --threads N                      most threads to run (default: number of cpus, at least 4)\n");
+    fprintf(stderr, "  --shards N                       shards in the store (default %d)\n", KV_DEFAULT_SHARDS);
+    fprintf(stderr, "  --keys N                         keys in the store (default %d)\n", DEFAULT_KEYS);
+    fprintf(stderr, "  --seconds N                      how long each round runs (default %d)\n", DEFAULT_SECONDS);
+    fprintf(stderr, "  --reads PCT                      percentage of operations that are GETs (default %d)\n", DEFAULT_READ_PCT);
+    fprintf(stderr, "  --batch N                        keys per MGET / MSET, 1 for plain GET / SET (default 1, at most %d)\n", KV_BATCH_MAX);
+    fprintf(stderr, "  --wal FILE                       log every change to FILE (sharded engine only, default no log)\n");
+    fprintf(stderr, "  --fsync always|no|MS             when the log is synced (default every %d ms)\n", KV_DEFAULT_FSYNC_MS);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int run_sharded = 1, run_lockfree = 1;
+    int run_mutex = 1, run_rwlock = 1;
+    int run_incremental = 1, run_blocking = 0;
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int num_shards = KV_DEFAULT_SHARDS;
+    int seconds = DEFAULT_SECONDS;
+    const char *log_path = NULL;
+    wal_fsync_t log_fsync = WAL_FSYNC_EVERY;
+    int log_fsync_ms = KV_DEFAULT_FSYNC_MS;
+    num_keys = DEFAULT_KEYS;
+    read_pct = DEFAULT_READ_PCT;
+    batch_size = 1;
+    if (max_threads < 4) {
+        max_threads = 4;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        const char *value = argv[i + 1];
+        if (strcmp(argv[i], "--engine") == 0) {
+            run_sharded = strcmp(value, "sharded") == 0 || strcmp(value, "both") == 0;
+            run_lockfree = strcmp(value, "lockfree") == 0 || strcmp(value, "both") == 0;
+            if (!run_sharded && !run_lockfree) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--lock") == 0) {
+            run_mutex = strcmp(value, "mutex") == 0 || strcmp(value, "both") == 0;
+            run_rwlock = strcmp(value, "rwlock") == 0 || strcmp(value, "both") == 0;
+            if (!run_mutex && !run_rwlock) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--rehash") == 0) {
+            run_incremental = strcmp(value, "incremental") == 0 || strcmp(value, "both") == 0;
+            run_blocking = strcmp(value, "blocking") == 0 || strcmp(value, "both") == 0;
+            if (!run_incremental && !run_blocking) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            max_threads = atoi(value);
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            num_shards = atoi(value);
+        } else if (strcmp(argv[i], "--keys") == 0) {
+            num_keys = atoi(value);
+        } else if (strcmp(argv[i], "--seconds") == 0) {
+            seconds = atoi(value);
+        } else if (strcmp(argv[i], "--reads") == 0) {
+            read_pct = atoi(value);
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch_size = atoi(value);
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            log_path = value;
+        } else if (strcmp(argv[i], "--fsync") == 0) {
+            if (strcmp(value, "always") == 0) {
+                log_fsync = WAL_FSYNC_ALWAYS;
+            } else if (strcmp(value, "no") == 0) {
+                log_fsync = WAL_FSYNC_NO;
+            } else {
+                log_fsync = WAL_FSYNC_EVERY;
+                log_fsync_ms = atoi(value);
+            }
+        } else {
+            usage(argv[0]);
+        }
+        i++;
+    }
+    if (max_threads <= 0 || num_shards <= 0 || num_keys <= 0 || seconds <= 0 ||
+        read_pct < 0 || read_pct > 100 || batch_size <= 0 || batch_size > KV_BATCH_MAX || log_fsync_ms <= 0) {
+        usage(argv[0]);
+    }
+    if (log_path != NULL) {
+        run_lockfree = 0;   // only the sharded engine can keep a log
+    }
+
+    keys = malloc(sizeof(char*) * num_keys);
+    if (keys == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < num_keys; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key:%d", i);
+        keys[i] = strdup(key);
+    }
+
+    kv_config_t config;
+    kv_config_default(&config);
+    config.num_shards = num_shards;
+    config.log_path = log_path;
+    config.log_fsync = log_fsync;
+    config.log_fsync_ms = log_fsync_ms;
+    for (int blocking = 0; blocking <= 1; blocking++) {
+        if (!(blocking ? run_blocking : run_incremental)) {
+            continue;
+        }
+        config.rehash = blocking ? KV_REHASH_BLOCKING : KV_REHASH_INCREMENTAL;
+        if (run_sharded && run_mutex) {
+            config.lock_mode = KV_LOCK_MUTEX;
+            bench_config(&config, max_threads, seconds);
+        }
+        if (run_sharded && run_rwlock) {
+            config.lock_mode = KV_LOCK_RWLOCK;
+            bench_config(&config, max_threads, seconds);
+        }
+    }
+    if (run_lockfree) {
+        config.engine = KV_ENGINE_LOCKFREE;
+        bench_config(&config, max_threads, seconds);
+    }
+
+    for (int i = 0; i < num_keys; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#ifndef KV_ENTRY_H
+#define KV_ENTRY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "kv_store.h"
+
+// keys up to this long are kept zero-padded in two 64-bit words (see below)
+#define KV_SHORT_KEY 16
+
+/*
+ * hash table entry structure
+ * this is what gets stored in our key-value store
+ * each entry keeps its key's full hash, so growing the table never has to
+ * hash the key again, and most non-matching entries are ruled out without
+ * looking at the key at all
+ *
+ * entries are sized to fit: the key is allocated together with the entry
+ * (key_len bytes plus a null), followed by a fixed KV_VALUE_ROOM bytes for
+ * the value
+ *
+ * SHORT KEYS
+ * most keys are KV_SHORT_KEY bytes or less. those get exactly KV_SHORT_KEY
+ * bytes of key, zero-padded, which is two aligned 64-bit words sitting right
+ * after the hash and lengths - so checking one is two integer compares on
+ * the cache line we already loaded to check the hash, with no memcmp call
+ * and no loop over bytes
+ *
+ * INLINE VALUES
+ * most values are counters, flags and short ids. a value of up to
+ * KV_INLINE_VALUE bytes is kept right in the entry's value room, just after
+ * the key, so a GET reads it from the entry it already found instead of
+ * following a pointer to a second allocation (and taking a second cache
+ * miss). a longer value spills into its own allocation and the room holds a
+ * pointer to it. which one it is follows from value_len alone. the room is
+ * the same size either way, so a SET can switch a value between the two
+ * without moving the entry the table points at
+ *
+ * VERSIONS
+ * every value an entry is given comes with a new version, taken from its
+ * shard's counter while the shard is write-locked (see kv_cas)
+ */
+typedef struct {
+    uint64_t hash;                  // full 64-bit hash of key
+    uint64_t expires;               // when it expires, in unix milliseconds (0 = never)
+    uint64_t version;               // bumped by every change to the value (never 0)
+    _Atomic uint32_t access;        // lru clock when it was last used (only kept with a memory limit)
+    uint16_t value_len;             // length of value as text, not counting the null
+    uint8_t key_len;                // length of key, not counting the null
+    uint8_t encoding;               // how the value room holds the value (KV_ENCODING_...)
+    _Alignas(8) char key[];         // the key (like "name"): kv_key_size(key_len) bytes, zero-padded,
+                                    // then the value room (see kv_entry_room)
+} kv_entry_t;
+
+// the lengths are kept as small as the limits allow, so the header stays 32 bytes
+_Static_assert(KV_MAX_KEY <= UINT8_MAX, "key_len is 8 bits");
+_Static_assert(KV_MAX_VALUE <= UINT16_MAX, "value_len is 16 bits");
+
+// values up to this long are stored inline (the null takes the last byte of the room)
+#define KV_INLINE_VALUE 23
+
+/*
+ * INTEGER ENCODING
+ * a value that is the exact text of a 64-bit integer (see kv_parse_int) is
+ * kept as the integer itself, so INCR and DECR add to it directly instead of
+ * parsing and reprinting text; it is only turned back into text for GET.
+ * value_len is still the length of its text
+ */
+#define KV_ENCODING_TEXT 0          // the room holds text (inline, or a pointer to it)
+#define KV_ENCODING_INT 1           // the room holds an int64_t
+
+// the value room: an inline value, a pointer to a spilled one, or an integer
+typedef union {
+    char *spilled;                  // value_len > KV_INLINE_VALUE: value_len bytes plus a null
+    char inline_value[KV_INLINE_VALUE + 1];
+    int64_t integer;                // KV_ENCODING_INT
+} kv_value_room_t;
+
+// an integer's text always fits inline, so an integer never leaves anything spilled behind
+_Static_assert(KV_INT_CHARS - 1 <= KV_INLINE_VALUE, "integers are inline");
+
+#define KV_VALUE_ROOM sizeof(kv_value_room_t)
+
+// bytes of key room an entry needs for a key_len-byte key (null included)
+static inline size_t kv_key_size(size_t key_len) {
+    return key_len < KV_SHORT_KEY ? KV_SHORT_KEY : key_len + 1;
+}
+
+// does a value_len-byte value fit inline?
+static inline int kv_value_inline(size_t value_len) {
+    return value_len <= KV_INLINE_VALUE;
+}
+
+// the entry's value room, after its key room (rounded up so a pointer stays aligned)
+static inline kv_value_room_t *kv_entry_room(const kv_entry_t *entry) {
+    size_t key_room = (kv_key_size(entry->key_len) + 7) & ~(size_t)7;
+    return (kv_value_room_t *)(entry->key + key_room);
+}
+
+// the entry's value as text, wherever it lives (KV_ENCODING_TEXT only)
+static inline const char *kv_entry_value(const kv_entry_t *entry) {
+    kv_value_room_t *room = kv_entry_room(entry);
+    return kv_value_inline(entry->value_len) ? room->inline_value : room->spilled;
+}
+
+// copy the entry's value into buf as text (at most size - 1 characters, always null-terminated)
+static inline void kv_entry_copy_value(const kv_entry_t *entry, char *buf, size_t size) {
+    if (entry->encoding == KV_ENCODING_INT && size >= KV_INT_CHARS) {
+        kv_format_int(kv_entry_room(entry)->integer, buf);
+        return;
+    }
+    char text[KV_INT_CHARS];
+    const char *value = text;
+    if (entry->encoding == KV_ENCODING_INT) {
+        kv_format_int(kv_entry_room(entry)->integer, text);
+    } else {
+        value = kv_entry_value(entry);
+    }
+    size_t copy = entry->value_len < size - 1 ? entry->value_len : size - 1;
+    memcpy(buf, value, copy);
+    buf[copy] = '\0';
+}
+
+// has the entry's time run out by now (unix milliseconds)?
+static inline int kv_entry_expired(const kv_entry_t *entry, uint64_t now) {
+    return entry->expires != 0 && entry->expires <= now;
+}
+
+/*
+ * a key being looked up, prepared once per lookup so that comparing it
+ * against each candidate entry is as cheap as possible
+ */
+typedef struct {
+    const char *key;
+    size_t len;
+    uint64_t words[2];              // short keys only: the key zero-padded to KV_SHORT_KEY bytes
+} kv_key_t;
+
+static inline void kv_key_init(kv_key_t *probe, const char *key, size_t len) {
+    probe->key = key;
+    probe->len = len;
+    if (len <= KV_SHORT_KEY) {
+        char padded[KV_SHORT_KEY] = { 0 };
+        memcpy(padded, key, len);
+        memcpy(probe->words, padded, KV_SHORT_KEY);
+    }
+}
+
+// does the entry hold exactly this key?
+static inline int kv_key_matches(const kv_entry_t *entry, const kv_key_t *probe) {
+    if (entry->key_len != probe->len) {
+        return 0;
+    }
+    if (probe->len <= KV_SHORT_KEY) {
+        uint64_t words[2];
+        memcpy(words, entry->key, KV_SHORT_KEY);   // two aligned 8-byte loads, no call
+        return ((words[0] ^ probe->words[0]) | (words[1] ^ probe->words[1])) == 0;
+    }
+    return memcmp(entry->key, probe->key, probe->len) == 0;
+}
+
+#endif
@@ -0,0 +1,273 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "kv_hash.h"
+
+// unaligned little-endian loads (memcpy compiles down to a single mov)
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * WYHASH
+ * the core step multiplies two 64-bit words into a 128-bit product and
+ * folds the halves together, which mixes every input bit into every
+ * output bit in one instruction
+ */
+static const uint64_t wy_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static inline void wy_mum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+uint64_t kv_hash_wyhash(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    uint64_t a, b;
+    seed ^= wy_mix(seed ^ wy_secret[0], wy_secret[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            // two overlapping pairs of 4-byte reads cover any length from 4 to 16
+            a = (read32(p) << 32) | read32(p + ((len >> 3) << 2));
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i >= 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(read64(p) ^ wy_secret[1], read64(p + 8) ^ seed);
+                see1 = wy_mix(read64(p + 16) ^ wy_secret[2], read64(p + 24) ^ see1);
+                see2 = wy_mix(read64(p + 32) ^ wy_secret[3], read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(read64(p) ^ wy_secret[1], read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        // the last 16 bytes (overlapping what came before if need be)
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    a ^= wy_secret[1];
+    b ^= seed;
+    wy_mum(&a, &b);
+    return wy_mix(a ^ wy_secret[0] ^ len, b ^ wy_secret[1]);
+}
+
+/*
+ * XXH64
+ * keys of 32 bytes or more are run through four independent accumulators
+ * (so the cpu can work on all four at once), then merged; the tail is
+ * folded in 8, 4 and 1 bytes at a time and the result avalanched
+ */
+#define XXH_PRIME1 0x9E3779B185EBCA87ull
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME3 0x165667B19E3779F9ull
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME5 0x27D4EB2F165667C5ull
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t lane) {
+    acc ^= xxh_round(0, lane);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t kv_hash_xxh64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        uint64_t v2 = seed + XXH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME1;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_PRIME5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * CRC32C
+ * the crc itself is only 32 bits, so it is spread over 64 with the
+ * splitmix64 finalizer (together with the seed) before it is handed back
+ */
+static uint32_t crc32c_table[256];
+static int crc32c_hardware = 0;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// build the byte-at-a-time table and check for the instruction, once
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        }
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32c_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// 8 bytes per instruction, then the last few one at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        crc64 = __builtin_ia32_crc32di(crc64, read64(p));
+    }
+    crc = (uint32_t)crc64;
+    for (; len > 0; p++, len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+static inline uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+uint64_t kv_hash_crc32c(const void *data, size_t len, uint64_t seed) {
+    pthread_once(&crc32c_once, crc32c_init);
+    uint32_t crc = ~(uint32_t)seed;
+#if defined(__x86_64__)
+    if (crc32c_hardware) {
+        crc = crc32c_sse42(crc, data, len);
+    } else
+#endif
+    {
+        crc = crc32c_software(crc, data, len);
+    }
+    return mix64((uint64_t)~crc ^ seed);
+}
+
+kv_hash_fn kv_hash_function(kv_hash_t hash) {
+    switch (hash) {
+    case KV_HASH_XXH64:
+        return kv_hash_xxh64;
+    case KV_HASH_CRC32C:
+        return kv_hash_crc32c;
+    case KV_HASH_WYHASH:
+    default:
+        return kv_hash_wyhash;
+    }
+}
+
+const char *kv_hash_name(kv_hash_t hash) {
+    switch (hash) {
+    case KV_HASH_XXH64:
+        return "xxh64";
+    case KV_HASH_CRC32C:
+        return "crc32c";
+    case KV_HASH_WYHASH:
+    default:
+        return "wyhash";
+    }
+}
+
+int kv_hash_parse(const char *name, kv_hash_t *hash) {
+    static const kv_hash_t all[] = { KV_HASH_WYHASH, KV_HASH_XXH64, KV_HASH_CRC32C };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(name, kv_hash_name(all[i])) == 0) {
+            *hash = all[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+uint64_t kv_hash_random_seed(void) {
+    uint64_t seed = 0;
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        // no entropy from the kernel: the clock and pid are a poor second best
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = mix64((uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)getpid());
+    }
+    return seed != 0 ? seed : 1;
+}
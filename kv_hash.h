@@ -0,0 +1,59 @@
+#ifndef KV_HASH_H
+#define KV_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * KEY HASH FUNCTIONS
+ * every key is hashed to 64 bits once per operation; the high bits pick the
+ * shard and the low bits drive the probing inside it, so all 64 need to be
+ * well mixed. each function takes a seed, and the store picks a random one
+ * per process: without it, anyone who knows the hash function can work out
+ * keys that all land in the same place and turn every lookup into a long
+ * linear scan (collision flooding)
+ *
+ * KV_HASH_WYHASH: wyhash (final version 4) - multiply-and-fold over 8-byte words,
+ *                 the fastest of the seeded ones on short keys
+ * KV_HASH_XXH64:  xxHash's 64-bit hash - four independent lanes, strong on
+ *                 long keys
+ * KV_HASH_CRC32C: the CRC32C instruction (SSE4.2), with a table-driven
+ *                 fallback on cpus without it, mixed up to 64 bits. very
+ *                 fast, but a CRC is linear, so the seed does NOT stop
+ *                 deliberately chosen collisions - only use it for trusted
+ *                 clients
+ */
+typedef enum {
+    KV_HASH_WYHASH,
+    KV_HASH_XXH64,
+    KV_HASH_CRC32C
+} kv_hash_t;
+
+// the hash used unless another one is picked at startup (override with -DKV_DEFAULT_HASH=...)
+#ifndef KV_DEFAULT_HASH
+#define KV_DEFAULT_HASH KV_HASH_WYHASH
+#endif
+
+// every hash function has this shape: len bytes of data, mixed with seed
+typedef uint64_t (*kv_hash_fn)(const void *data, size_t len, uint64_t seed);
+
+uint64_t kv_hash_wyhash(const void *data, size_t len, uint64_t seed);
+uint64_t kv_hash_xxh64(const void *data, size_t len, uint64_t seed);
+uint64_t kv_hash_crc32c(const void *data, size_t len, uint64_t seed);
+
+// the function for a kv_hash_t
+kv_hash_fn kv_hash_function(kv_hash_t hash);
+
+// the name a kv_hash_t goes by on the command line ("wyhash", "xxh64", "crc32c")
+const char *kv_hash_name(kv_hash_t hash);
+
+/*
+ * look up a hash by its command-line name
+ * returns 0 and fills *hash on success, -1 if the name is unknown
+ */
+int kv_hash_parse(const char *name, kv_hash_t *hash);
+
+// a fresh random seed from the kernel (never 0)
+uint64_t kv_hash_random_seed(void);
+
+#endif
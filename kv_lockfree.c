@@ -0,0 +1,415 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "epoch.h"
+#include "slab.h"
+#include "kv_store.h"
+#include "kv_lockfree.h"
+
+/*
+ * HOW READS AVOID LOCKS
+ * the table is an array of buckets, each the head of a singly linked chain.
+ * a node's key and value never change once it is in a chain - a SET on an
+ * existing key builds a whole new node and swaps it into the chain with one
+ * atomic pointer store, and a DELETE unlinks a node with one store. so a
+ * reader following the chain (with acquire loads) always sees complete nodes.
+ * nodes that were swapped out or unlinked can't be freed straight away
+ * because a reader may still be standing on one; the writer retires them
+ * (epoch_retire) and they are freed in a later batch, once no reader can
+ * still see them. writers never wait for readers.
+ *
+ * writers lock one of LF_STRIPES mutexes (chosen by bucket) so that two
+ * writers never edit the same chain at once, and take resize_lock for
+ * reading so the table isn't swapped out from under them. growing the table
+ * takes resize_lock for writing, copies every node into a bigger table and
+ * publishes it with one pointer store - readers on the old table carry on
+ * undisturbed until they're done.
+ */
+
+// number of writer locks (a power of two)
+#define LF_STRIPES 256
+// grow the table once there are this many keys per bucket on average
+#define LF_MAX_LOAD 2
+
+/*
+ * a node is one allocation sized to fit: the key (plus a null) followed by
+ * the value (plus a null) in data. nodes never change once published, so
+ * there is no reason to keep the value in an allocation of its own.
+ * every node gets a new version from its stripe's counter just before it is
+ * published, so replacing a node is also what changes the key's version
+ */
+typedef struct lf_node {
+    _Atomic(struct lf_node *) next;   // next node in the bucket's chain
+    uint64_t hash;                    // full hash of key, checked before comparing keys
+    uint64_t version;                 // see kv_cas (never 0)
+    uint16_t key_len;                 // length of the key, not counting the null
+    uint32_t value_len;               // length of the value, not counting the null
+    char data[];                      // key, null, value, null
+} lf_node_t;
+
+// bytes allocated for a node, data included
+static size_t node_size(const lf_node_t *node) {
+    return sizeof(lf_node_t) + node->key_len + 1 + node->value_len + 1;
+}
+
+// the value stored after the key in data
+static const char *node_value(const lf_node_t *node) {
+    return node->data + node->key_len + 1;
+}
+
+// does the node hold exactly this key?
+static int node_has_key(const lf_node_t *node, const char *key, size_t key_len, uint64_t hash) {
+    return node->hash == hash && node->key_len == key_len &&
+           memcmp(node->data, key, key_len) == 0;
+}
+
+typedef struct {
+    size_t mask;                          // number of buckets - 1 (a power of two minus one)
+    _Atomic(lf_node_t *) buckets[];       // chain heads
+} lf_table_t;
+
+static _Atomic(lf_table_t *) current_table = NULL;
+static _Atomic size_t key_count = 0;
+static pthread_mutex_t stripes[LF_STRIPES];
+static uint64_t stripe_versions[LF_STRIPES];     // the last version each stripe handed out (guarded by its lock)
+static pthread_rwlock_t resize_lock = PTHREAD_RWLOCK_INITIALIZER;
+static kv_hash_fn hash_fn;
+static uint64_t hash_seed;
+
+// allocate an empty table with num_buckets buckets (a power of two)
+static lf_table_t *table_alloc(size_t num_buckets) {
+    lf_table_t *table = malloc(sizeof(lf_table_t) + sizeof(_Atomic(lf_node_t *)) * num_buckets);
+    if (table == NULL) {
+        return NULL;
+    }
+    table->mask = num_buckets - 1;
+    for (size_t i = 0; i < num_buckets; i++) {
+        atomic_init(&table->buckets[i], NULL);
+    }
+    return table;
+}
+
+// free a table and every node still chained in it
+static void table_free(lf_table_t *table) {
+    for (size_t i = 0; i <= table->mask; i++) {
+        lf_node_t *node = atomic_load_explicit(&table->buckets[i], memory_order_relaxed);
+        while (node != NULL) {
+            lf_node_t *next = atomic_load_explicit(&node->next, memory_order_relaxed);
+            slab_free(node, node_size(node));
+            node = next;
+        }
+    }
+    free(table);
+}
+
+// epoch_retire callback for a node that was replaced or deleted
+static void retire_node(void *node) {
+    slab_free(node, node_size(node));
+}
+
+// epoch_retire callback for a whole table that was replaced by a bigger one
+static void retire_table(void *table) {
+    table_free(table);
+}
+
+static lf_node_t *node_new(const char *key, size_t key_len, const char *value,
+                           size_t value_len, uint64_t hash) {
+    lf_node_t *node = slab_alloc(sizeof(lf_node_t) + key_len + 1 + value_len + 1);
+    if (node == NULL) {
+        return NULL;
+    }
+    atomic_init(&node->next, NULL);
+    node->hash = hash;
+    node->key_len = (uint16_t)key_len;
+    node->value_len = (uint32_t)value_len;
+    memcpy(node->data, key, key_len);
+    node->data[key_len] = '\0';
+    memcpy(node->data + key_len + 1, value, value_len);
+    node->data[key_len + 1 + value_len] = '\0';
+    return node;
+}
+
+int lf_init(size_t initial_buckets, kv_hash_fn hash, uint64_t seed) {
+    size_t num_buckets = LF_STRIPES;
+    while (num_buckets < initial_buckets) {
+        num_buckets *= 2;
+    }
+    lf_table_t *table = table_alloc(num_buckets);
+    if (table == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < LF_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i], NULL);
+        stripe_versions[i] = 0;
+    }
+    hash_fn = hash;
+    hash_seed = seed;
+    atomic_store(&key_count, 0);
+    atomic_store(&current_table, table);
+    return 0;
+}
+
+void lf_destroy(void) {
+    // free everything still waiting on the retire lists first
+    epoch_barrier();
+    table_free(atomic_load(&current_table));
+    atomic_store(&current_table, NULL);
+    for (int i = 0; i < LF_STRIPES; i++) {
+        pthread_mutex_destroy(&stripes[i]);
+    }
+}
+
+/*
+ * double the table once it is too full
+ * every writer is shut out (resize_lock held for writing) while the nodes are
+ * copied - readers aren't, they keep using the old table. nodes are copied
+ * rather than moved because readers are still following the old nodes' next
+ * pointers
+ */
+static void grow_table(void) {
+    pthread_rwlock_wrlock(&resize_lock);
+    lf_table_t *old = atomic_load(&current_table);
+    size_t old_buckets = old->mask + 1;
+    if (atomic_load(&key_count) <= old_buckets * LF_MAX_LOAD) {
+        pthread_rwlock_unlock(&resize_lock);
+        return;  // another writer already grew it
+    }
+
+    lf_table_t *bigger = table_alloc(old_buckets * 2);
+    if (bigger == NULL) {
+        pthread_rwlock_unlock(&resize_lock);
+        return;  // stay at this size; chains just get longer
+    }
+    for (size_t i = 0; i < old_buckets; i++) {
+        lf_node_t *node = atomic_load_explicit(&old->buckets[i], memory_order_relaxed);
+        for (; node != NULL; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+            lf_node_t *copy = slab_alloc(node_size(node));
+            if (copy == NULL) {
+                table_free(bigger);
+                pthread_rwlock_unlock(&resize_lock);
+                return;
+            }
+            memcpy(copy, node, node_size(node));
+            size_t bucket = node->hash & bigger->mask;
+            atomic_init(&copy->next, atomic_load_explicit(&bigger->buckets[bucket], memory_order_relaxed));
+            atomic_init(&bigger->buckets[bucket], copy);
+        }
+    }
+    // the release store makes every copied node visible before the table itself
+    atomic_store_explicit(&current_table, bigger, memory_order_release);
+    pthread_rwlock_unlock(&resize_lock);
+
+    // readers may still be walking the old table - it is freed once they're done
+    epoch_retire(old, retire_table);
+}
+
+/*
+ * find the link (bucket head or a node's next field) that points at key
+ * in its chain, or at the null that ends the chain if key isn't there.
+ * caller holds the stripe lock, so the chain can't change underneath us
+ */
+static _Atomic(lf_node_t *) *find_link(lf_table_t *table, const char *key, size_t key_len,
+                                       uint64_t hash) {
+    _Atomic(lf_node_t *) *link = &table->buckets[hash & table->mask];
+    lf_node_t *node;
+    while ((node = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+        if (node_has_key(node, key, key_len, hash)) {
+            break;
+        }
+        link = &node->next;
+    }
+    return link;
+}
+
+int lf_set(const char *key, const char *value) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = hash_fn(key, key_len, hash_seed);
+
+    // build the new node before taking any lock
+    lf_node_t *node = node_new(key, key_len, value, strnlen(value, KV_MAX_VALUE), hash);
+    if (node == NULL) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&resize_lock);
+    lf_table_t *table = atomic_load(&current_table);
+    size_t stripe_id = hash & (LF_STRIPES - 1);
+    pthread_mutex_t *stripe = &stripes[stripe_id];
+    pthread_mutex_lock(stripe);
+
+    _Atomic(lf_node_t *) *link = find_link(table, key, key_len, hash);
+    lf_node_t *old = atomic_load_explicit(link, memory_order_relaxed);
+    node->version = ++stripe_versions[stripe_id];
+    if (old != NULL) {
+        // replace: the new node takes over the old one's place in the chain
+        atomic_init(&node->next, atomic_load_explicit(&old->next, memory_order_relaxed));
+    }
+    // publish - after this store readers find the new node, fully built
+    atomic_store_explicit(link, node, memory_order_release);
+
+    pthread_mutex_unlock(stripe);
+    size_t count = old == NULL ? atomic_fetch_add(&key_count, 1) + 1 : atomic_load(&key_count);
+    pthread_rwlock_unlock(&resize_lock);
+
+    if (old != NULL) {
+        epoch_retire(old, retire_node);
+    } else if (count > (table->mask + 1) * LF_MAX_LOAD) {
+        grow_table();
+    }
+    return 0;
+}
+
+/*
+ * nodes never change, so a counter is bumped like any other update: a new
+ * node with the new number replaces the old one. the old value has to be
+ * read under the stripe lock, so unlike lf_set the node is built there too
+ * (it's a small one)
+ */
+int lf_incr(const char *key, int64_t delta, int64_t *value) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = hash_fn(key, key_len, hash_seed);
+    int result = 0;
+
+    pthread_rwlock_rdlock(&resize_lock);
+    lf_table_t *table = atomic_load(&current_table);
+    size_t stripe_id = hash & (LF_STRIPES - 1);
+    pthread_mutex_t *stripe = &stripes[stripe_id];
+    pthread_mutex_lock(stripe);
+
+    _Atomic(lf_node_t *) *link = find_link(table, key, key_len, hash);
+    lf_node_t *old = atomic_load_explicit(link, memory_order_relaxed);
+    lf_node_t *node = NULL;
+    int64_t current = 0;
+    if (old != NULL && !kv_parse_int(node_value(old), old->value_len, &current)) {
+        result = KV_NOT_INTEGER;
+    } else if (__builtin_add_overflow(current, delta, &current)) {
+        result = KV_OVERFLOW;
+    } else {
+        char text[KV_INT_CHARS];
+        node = node_new(key, key_len, text, kv_format_int(current, text), hash);
+        if (node == NULL) {
+            result = -1;
+        }
+    }
+    if (node != NULL) {
+        node->version = ++stripe_versions[stripe_id];
+        if (old != NULL) {
+            atomic_init(&node->next, atomic_load_explicit(&old->next, memory_order_relaxed));
+        }
+        atomic_store_explicit(link, node, memory_order_release);
+        *value = current;
+    }
+
+    pthread_mutex_unlock(stripe);
+    size_t count = node != NULL && old == NULL ? atomic_fetch_add(&key_count, 1) + 1 : atomic_load(&key_count);
+    pthread_rwlock_unlock(&resize_lock);
+
+    if (node != NULL && old != NULL) {
+        epoch_retire(old, retire_node);
+    } else if (node != NULL && count > (table->mask + 1) * LF_MAX_LOAD) {
+        grow_table();
+    }
+    return result;
+}
+
+/*
+ * like lf_set, but the new node is only swapped in if the one it replaces
+ * still has the expected version (and thrown away if not)
+ */
+int lf_cas(const char *key, const char *value, uint64_t version) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = hash_fn(key, key_len, hash_seed);
+    int result = 0;
+
+    lf_node_t *node = node_new(key, key_len, value, strnlen(value, KV_MAX_VALUE), hash);
+    if (node == NULL) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&resize_lock);
+    lf_table_t *table = atomic_load(&current_table);
+    size_t stripe_id = hash & (LF_STRIPES - 1);
+    pthread_mutex_t *stripe = &stripes[stripe_id];
+    pthread_mutex_lock(stripe);
+
+    _Atomic(lf_node_t *) *link = find_link(table, key, key_len, hash);
+    lf_node_t *old = atomic_load_explicit(link, memory_order_relaxed);
+    if (old == NULL) {
+        result = KV_NOT_FOUND;
+    } else if (old->version != version) {
+        result = KV_CHANGED;
+    } else {
+        node->version = ++stripe_versions[stripe_id];
+        atomic_init(&node->next, atomic_load_explicit(&old->next, memory_order_relaxed));
+        atomic_store_explicit(link, node, memory_order_release);
+    }
+
+    pthread_mutex_unlock(stripe);
+    pthread_rwlock_unlock(&resize_lock);
+
+    if (result != 0) {
+        // never published, so nobody else can have seen it
+        slab_free(node, node_size(node));
+    } else {
+        epoch_retire(old, retire_node);
+    }
+    return result;
+}
+
+int lf_get(const char *key, char *value, size_t size, uint64_t *version, size_t *value_len) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = hash_fn(key, key_len, hash_seed);
+    int found = 0;
+
+    // no lock at all: just announce that we're reading
+    epoch_enter();
+    lf_table_t *table = atomic_load_explicit(&current_table, memory_order_acquire);
+    lf_node_t *node = atomic_load_explicit(&table->buckets[hash & table->mask], memory_order_acquire);
+    for (; node != NULL; node = atomic_load_explicit(&node->next, memory_order_acquire)) {
+        if (node_has_key(node, key, key_len, hash)) {
+            size_t copy = node->value_len < size - 1 ? node->value_len : size - 1;
+            memcpy(value, node_value(node), copy);
+            value[copy] = '\0';
+            if (version != NULL) {
+                *version = node->version;
+            }
+            if (value_len != NULL) {
+                *value_len = node->value_len;
+            }
+            found = 1;
+            break;
+        }
+    }
+    epoch_exit();
+    return found;
+}
+
+int lf_delete(const char *key) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = hash_fn(key, key_len, hash_seed);
+
+    pthread_rwlock_rdlock(&resize_lock);
+    lf_table_t *table = atomic_load(&current_table);
+    pthread_mutex_t *stripe = &stripes[hash & (LF_STRIPES - 1)];
+    pthread_mutex_lock(stripe);
+
+    _Atomic(lf_node_t *) *link = find_link(table, key, key_len, hash);
+    lf_node_t *old = atomic_load_explicit(link, memory_order_relaxed);
+    if (old != NULL) {
+        // unlink: point the link past the node; readers already on it can still move on
+        atomic_store_explicit(link, atomic_load_explicit(&old->next, memory_order_relaxed),
+                              memory_order_release);
+        atomic_fetch_sub(&key_count, 1);
+    }
+
+    pthread_mutex_unlock(stripe);
+    pthread_rwlock_unlock(&resize_lock);
+
+    if (old == NULL) {
+        return 0;
+    }
+    epoch_retire(old, retire_node);
+    return 1;
+}
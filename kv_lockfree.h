@@ -0,0 +1,35 @@
+#ifndef KV_LOCKFREE_H
+#define KV_LOCKFREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kv_hash.h"
+
+/*
+ * LOCK-FREE READ ENGINE
+ * an alternative to the sharded store in kv_store.c. GETs never take
+ * a lock and never wait for a writer: they walk the table under epoch
+ * protection (see epoch.h) and see either the old or the new version of a
+ * key, never a half-written one. writers still serialize per bucket stripe.
+ * kv_store.c calls these when the store is started with KV_ENGINE_LOCKFREE;
+ * the arguments and return values mean the same as the matching kv_ functions
+ * (lf_get serves both kv_get and kv_gets: version is null for kv_get.
+ * value_len, if not null, gets the value's whole length, so a caller can
+ * tell a value that was cut short to fit size from one that just fits)
+ */
+
+/*
+ * set up an empty table with room for about initial_buckets keys before it grows
+ * keys are hashed with hash(key, length, seed)
+ */
+int lf_init(size_t initial_buckets, kv_hash_fn hash, uint64_t seed);
+// free the whole table (nothing else may be using it)
+void lf_destroy(void);
+
+int lf_set(const char *key, const char *value);
+int lf_get(const char *key, char *value, size_t size, uint64_t *version, size_t *value_len);
+int lf_delete(const char *key);
+int lf_incr(const char *key, int64_t delta, int64_t *value);
+int lf_cas(const char *key, const char *value, uint64_t version);
+
+#endif
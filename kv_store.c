@@ -0,0 +1,2164 @@
+#define _GNU_SOURCE  // for pthread_rwlockattr_setkind_np() and pipe2()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "kv_store.h"
+#include "kv_entry.h"
+#include "swisstable.h"
+#include "slab.h"
+#include "sketch.h"
+#include "wheel.h"
+#include "snapshot.h"
+#include "kv_lockfree.h"
+
+// buckets the lock-free engine starts with (it doubles as it fills up)
+#define KV_LOCKFREE_INITIAL_BUCKETS 4096
+// groups of slots the background helper moves each time it holds a shard's lock
+#define KV_REHASH_HELPER_GROUPS 256
+// timers the expiry thread fires each time it holds a shard's lock
+#define KV_EXPIRE_BATCH 256
+// how many keys ahead of the one being looked up a batch fetches entries (and twice that, groups)
+#define KV_PREFETCH_AHEAD 4
+// bytes of log records dealt out to the recovery threads per round of replay
+#define KV_REPLAY_ROUND (8 * 1024 * 1024)
+// the most threads recovery uses, however many cpus there are
+#define KV_RECOVERY_MAX_THREADS 64
+
+/*
+ * SHARDS (striped locking)
+ * instead of one big hash table behind one big lock, the keyspace is split
+ * into shards. every key belongs to exactly one shard (picked from the key's
+ * hash), and each shard is its own swiss table (swisstable.c) with its own
+ * lock. two threads only wait for each other when their keys land in the
+ * same shard, so with enough shards many cores can work on the store at once.
+ * each shard is aligned to its own 64-byte cache line so that locking one
+ * shard doesn't slow down a neighbour that happens to sit next to it in memory.
+ * a shard is locked with either a mutex or a reader-writer lock (see
+ * kv_lock_mode_t); every shard uses the same kind
+ */
+typedef struct {
+    union {
+        pthread_mutex_t mutex;     // used in KV_LOCK_MUTEX mode
+        pthread_rwlock_t rwlock;   // used in KV_LOCK_RWLOCK mode
+    } lock;                        // protects table
+    swiss_table_t table;           // this shard's keys
+    atomic_int rehashing;          // handed to the rehash helper, which hasn't finished it yet
+    sketch_t sketch;               // KV_EVICT_LFU: how often this shard's keys are asked for (own locking)
+    wheel_t wheel;                 // when this shard's keys with a time to live expire (guarded by lock)
+    uint64_t version;              // the last version given to one of this shard's values (guarded by lock)
+} __attribute__((aligned(64))) kv_shard_t;
+
+static kv_engine_t engine = KV_ENGINE_SHARDED;
+static kv_hash_fn hash_fn = kv_hash_wyhash;   // how keys are hashed (both engines)
+static kv_hash_t hash_kind = KV_DEFAULT_HASH; // which one hash_fn is (snapshots record it)
+static uint64_t hash_seed = 0;                // this process's seed for hash_fn
+
+static kv_shard_t *shards = NULL;   // array of num_shards shards
+static int num_shards = 0;
+static kv_lock_mode_t lock_mode = KV_LOCK_MUTEX;
+
+/*
+ * MEMORY LIMIT (see kv_store.h)
+ * used_memory is a single counter every shard adds to, but only when an
+ * entry comes or goes or a value changes size - GETs never touch it.
+ * eviction happens before a SET takes its own shard's lock, and locks one
+ * shard at a time, so it can never deadlock against another SET
+ */
+static size_t max_memory = 0;                   // 0 = no limit
+static _Atomic size_t used_memory = 0;          // entries and spilled values, at their slab sizes
+static kv_eviction_t eviction = KV_EVICT_LRU;   // which entries go first
+static _Atomic size_t evictions = 0;            // entries evicted to make room
+static _Atomic size_t rejections = 0;           // new keys the admission filter turned away
+static _Atomic size_t expired = 0;              // keys removed because their time ran out
+static __thread uint64_t evict_random = 0;      // this thread's xorshift state for sampling
+
+/*
+ * REHASH HELPER
+ * with incremental rehashing a shard's table only moves a couple of groups
+ * across per SET or DELETE, so a shard that stops getting writes would stay
+ * half-moved (and every lookup would keep checking both arrays). a
+ * background thread finishes the job: a SET that starts a rehash flags its
+ * shard and wakes the helper, which then moves KV_REHASH_HELPER_GROUPS
+ * groups at a time, letting go of the shard's lock in between so clients
+ * only ever wait for one short step
+ */
+static pthread_t rehash_thread;
+static int rehash_running = 0;                  // was the helper started?
+static pthread_mutex_t rehash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rehash_wake = PTHREAD_COND_INITIALIZER;
+static int rehash_pending = 0;                  // shards flagged since the helper last looked (guarded by rehash_lock)
+static int rehash_stop = 0;                     // set to shut the helper down (guarded by rehash_lock)
+
+/*
+ * EXPIRY THREAD
+ * every WHEEL_TICK_MS it runs each shard's timer wheel up to the present,
+ * removing the keys whose timers come due, KV_EXPIRE_BATCH timers at a
+ * time so no shard is held for long
+ */
+static pthread_t expire_thread;
+static int expire_running = 0;                  // was the thread started?
+static pthread_mutex_t expire_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t expire_wake = PTHREAD_COND_INITIALIZER;
+static int expire_stop = 0;                     // set to shut the thread down (guarded by expire_lock)
+
+/*
+ * WRITE-AHEAD LOG (see DURABILITY in kv_store.h)
+ * every change is logged under its shard's write lock, after it has been
+ * made, with the lsn it got kept per thread. the public write calls then
+ * wait on that lsn (WAL_FSYNC_ALWAYS) once every lock has been let go, so
+ * no shard is ever held while the disk is
+ */
+static wal_t wal;
+static int logging = 0;                         // is every change being logged? (not while the log is replayed)
+static __thread uint64_t logged_lsn = 0;        // where this thread's last record ends
+
+/*
+ * SNAPSHOTS (see kv_store.h)
+ * one at a time. once the child is forked, a waiter thread reads the
+ * child's report from a pipe, reaps it and fills in the stats below
+ */
+typedef struct {
+    int ok;                     // was the file written, synced and renamed into place?
+    uint64_t keys;
+    uint64_t bytes;
+    uint64_t cow_bytes;         // the child's private dirty memory when it finished: pages copied since the fork
+} snapshot_report_t;
+
+static const char *snapshot_path = NULL;        // where snapshots go, null = nowhere
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;   // guards everything below
+static pthread_t snapshot_thread;               // the waiter
+static int snapshot_started = 0;                // has a waiter been started (and not joined yet)?
+static int snapshot_running = 0;                // is a child still writing?
+static pid_t snapshot_pid;
+static int snapshot_pipe;                       // the read end of the child's report
+static uint64_t snapshot_start_us;
+static size_t snapshots = 0;                    // snapshots written
+static size_t snapshot_failures = 0;
+static uint64_t snapshot_fork_us = 0;           // the last snapshot's: how long the fork held every shard
+static size_t snapshot_cow_pages = 0;           // pages copied on write while it ran
+static uint64_t snapshot_keys = 0;
+static uint64_t snapshot_bytes = 0;
+static uint64_t snapshot_us = 0;                // from the fork until the child was reaped
+
+/*
+ * MAPPED SNAPSHOT (see SNAPSHOTS in kv_store.h)
+ * a store that starts from a snapshot doesn't copy its keys in: the file
+ * is mapped and sits underneath the shards' tables as a read-only layer.
+ * a lookup that misses its table goes on to the file's index, and the
+ * first write to a key found there promotes it - copies it into the table
+ * - before changing it, unless the write replaces it outright (a plain SET
+ * or DELETE), which never reads it. a record that has been promoted,
+ * replaced, deleted or found expired is consumed: its bit in base_consumed is set, under its key's
+ * shard's write lock, and it is never looked at again. so a key is either
+ * in its table or live in the file, never both, and a bit only ever goes
+ * from 0 to 1
+ */
+static snapshot_t base;                         // the mapped snapshot, if base_mapped
+static int base_mapped = 0;
+static _Atomic uint64_t *base_consumed = NULL;  // one bit per record
+static _Atomic uint64_t base_remaining = 0;     // records not consumed yet
+
+// RECOVERY (see kv_store.h): how many threads rebuild the store at startup
+static int recovery_threads = 1;
+
+/*
+ * lock a shard for reading: in rwlock mode other readers may hold it too,
+ * in mutex mode this is the same as a write lock
+ */
+static void shard_read_lock(kv_shard_t *shard) {
+    if (lock_mode == KV_LOCK_RWLOCK) {
+        pthread_rwlock_rdlock(&shard->lock.rwlock);
+    } else {
+        pthread_mutex_lock(&shard->lock.mutex);
+    }
+}
+
+// lock a shard for changing it: nobody else may hold it at the same time
+static void shard_write_lock(kv_shard_t *shard) {
+    if (lock_mode == KV_LOCK_RWLOCK) {
+        pthread_rwlock_wrlock(&shard->lock.rwlock);
+    } else {
+        pthread_mutex_lock(&shard->lock.mutex);
+    }
+}
+
+// release either kind of lock
+static void shard_unlock(kv_shard_t *shard) {
+    if (lock_mode == KV_LOCK_RWLOCK) {
+        pthread_rwlock_unlock(&shard->lock.rwlock);
+    } else {
+        pthread_mutex_unlock(&shard->lock.mutex);
+    }
+}
+
+// bytes allocated for an entry with a key_len-byte key
+static size_t entry_size(size_t key_len) {
+    return sizeof(kv_entry_t) + ((kv_key_size(key_len) + 7) & ~(size_t)7) + KV_VALUE_ROOM;
+}
+
+// give an entry and any value it spilled back to the slab allocator
+static void entry_free(kv_entry_t *entry) {
+    if (entry != NULL) {
+        if (!kv_value_inline(entry->value_len)) {
+            slab_free(kv_entry_room(entry)->spilled, entry->value_len + 1);
+        }
+        slab_free(entry, entry_size(entry->key_len));
+    }
+}
+
+// what a value_len-byte value adds to its entry's cost (nothing if it fits inline)
+static size_t value_cost(size_t value_len) {
+    return kv_value_inline(value_len) ? 0 : slab_item_size(value_len + 1);
+}
+
+// what an entry and its value count against the memory limit
+static size_t entry_cost(const kv_entry_t *entry) {
+    return slab_item_size(entry_size(entry->key_len)) + value_cost(entry->value_len);
+}
+
+/*
+ * the lru clock, in milliseconds
+ * read from the coarse clock, which costs next to nothing. it wraps every
+ * 49 days, which is harmless: ages are worked out as now - access, and the
+ * unsigned subtraction wraps the same way
+ */
+static uint32_t lru_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// a clock for timing things, in microseconds
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the time keys expire by: unix milliseconds
+static uint64_t unix_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// note that an entry was just used (only eviction looks at it, so without a limit it's skipped)
+static inline void entry_touch(kv_entry_t *entry) {
+    if (max_memory != 0) {
+        atomic_store_explicit(&entry->access, lru_clock(), memory_order_relaxed);
+    }
+}
+
+/*
+ * note that a key was just asked for, found or not (KV_EVICT_LFU only)
+ * misses count too: a key that keeps being asked for should get in once
+ * something finally SETs it
+ */
+static inline void key_seen(kv_shard_t *shard, uint64_t hash) {
+    if (shard->sketch.table != NULL) {
+        sketch_increment(&shard->sketch, hash);
+    }
+}
+
+/*
+ * put a value into an entry's value room
+ * an integer is stored as one (see KV_ENCODING_INT), other inline values
+ * are copied in, and a spilled one must already be copied into spill
+ * (value_len bytes plus a null) so the room just points at it
+ */
+static void entry_store_value(kv_entry_t *entry, const char *value, size_t value_len, char *spill) {
+    kv_value_room_t *room = kv_entry_room(entry);
+    int64_t integer;
+    if (kv_value_inline(value_len) && kv_parse_int(value, value_len, &integer)) {
+        room->integer = integer;
+        entry->encoding = KV_ENCODING_INT;
+    } else if (kv_value_inline(value_len)) {
+        memcpy(room->inline_value, value, value_len);
+        room->inline_value[value_len] = '\0';
+        entry->encoding = KV_ENCODING_TEXT;
+    } else {
+        room->spilled = spill;
+        entry->encoding = KV_ENCODING_TEXT;
+    }
+    entry->value_len = (uint16_t)value_len;
+}
+
+// put an integer into an entry's value room (whatever was there must have been inline)
+static void entry_store_int(kv_entry_t *entry, int64_t integer) {
+    char text[KV_INT_CHARS];
+    kv_entry_room(entry)->integer = integer;
+    entry->encoding = KV_ENCODING_INT;
+    entry->value_len = (uint16_t)kv_format_int(integer, text);
+}
+
+/*
+ * an entry's value as text, however it is stored: text (KV_INT_CHARS bytes)
+ * is where an integer is written out
+ */
+static const char *entry_text(const kv_entry_t *entry, char *text) {
+    if (entry->encoding == KV_ENCODING_INT) {
+        kv_format_int(kv_entry_room(entry)->integer, text);
+        return text;
+    }
+    return kv_entry_value(entry);
+}
+
+// log the state an entry is in now (its shard must be write-locked)
+static void log_entry(const kv_entry_t *entry) {
+    if (!logging) {
+        return;
+    }
+    char text[KV_INT_CHARS];
+    const char *value = entry_text(entry, text);
+    // a failure is remembered by the log itself, and reported by log_commit
+    wal_log(&wal, WAL_SET, entry->key, entry->key_len, value, entry->value_len, entry->expires, &logged_lsn);
+}
+
+// log that a key is gone (its shard must be write-locked)
+static void log_delete(const char *key, size_t key_len) {
+    if (logging) {
+        wal_log(&wal, WAL_DELETE, key, key_len, NULL, 0, 0, &logged_lsn);
+    }
+}
+
+/*
+ * finish a public write: wait for what it logged to be on disk, if the
+ * policy says to. result is what the write returned
+ * returns result, or KV_LOG_ERROR if the log has failed
+ */
+static int log_commit(int result) {
+    if (logging && wal_sync(&wal, logged_lsn) < 0) {
+        return KV_LOG_ERROR;
+    }
+    return result;
+}
+
+// finish the flagged shards' rehashes, one short locked step at a time
+static void rehash_flagged_shards(void) {
+    for (int i = 0; i < num_shards; i++) {
+        kv_shard_t *shard = &shards[i];
+        int more = atomic_load(&shard->rehashing);
+        while (more) {
+            shard_write_lock(shard);
+            more = swiss_rehash_step(&shard->table, KV_REHASH_HELPER_GROUPS);
+            if (!more) {
+                atomic_store(&shard->rehashing, 0);
+            }
+            shard_unlock(shard);
+            sched_yield();  // give the clients queued on this shard their turn
+        }
+    }
+}
+
+static void *rehash_helper(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&rehash_lock);
+    while (!rehash_stop) {
+        if (rehash_pending == 0) {
+            pthread_cond_wait(&rehash_wake, &rehash_lock);
+            continue;
+        }
+        rehash_pending = 0;
+        pthread_mutex_unlock(&rehash_lock);
+        rehash_flagged_shards();
+        pthread_mutex_lock(&rehash_lock);
+    }
+    pthread_mutex_unlock(&rehash_lock);
+    return NULL;
+}
+
+// tell the helper a shard has a rehash for it to finish
+static void wake_rehash_helper(void) {
+    pthread_mutex_lock(&rehash_lock);
+    rehash_pending++;
+    pthread_cond_signal(&rehash_wake);
+    pthread_mutex_unlock(&rehash_lock);
+}
+
+// take an expired entry out of its write-locked shard and free it
+static void remove_expired(kv_shard_t *shard, kv_entry_t *entry) {
+    swiss_remove(&shard->table, entry->hash, entry->key, entry->key_len);
+    atomic_fetch_sub(&used_memory, entry_cost(entry));
+    atomic_fetch_add(&expired, 1);
+    entry_free(entry);
+}
+
+// swiss_find_hash() filter: has the entry expired by *(uint64_t *)now?
+static int expired_by(const kv_entry_t *entry, void *now) {
+    return kv_entry_expired(entry, *(uint64_t *)now);
+}
+
+typedef struct {
+    kv_shard_t *shard;
+    uint64_t now;
+} expire_run_t;
+
+/*
+ * a timer came due: remove whatever has expired under its hash
+ * (nothing, if the key was deleted or given a later expiry since)
+ */
+static void expire_fired(uint64_t hash, void *arg) {
+    expire_run_t *run = arg;
+    kv_entry_t *entry;
+    while ((entry = swiss_find_hash(&run->shard->table, hash, expired_by, &run->now)) != NULL) {
+        remove_expired(run->shard, entry);
+    }
+}
+
+// run every shard's wheel up to now
+static void expire_due_keys(void) {
+    for (int i = 0; i < num_shards; i++) {
+        expire_run_t run = { &shards[i], unix_ms() };
+        int more;
+        do {
+            shard_write_lock(run.shard);
+            more = wheel_advance(&run.shard->wheel, run.now, KV_EXPIRE_BATCH, expire_fired, &run);
+            shard_unlock(run.shard);
+            if (more) {
+                sched_yield();  // give the clients queued on this shard their turn
+            }
+        } while (more);
+    }
+}
+
+static void *expire_helper(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&expire_lock);
+    while (!expire_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += WHEEL_TICK_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&expire_wake, &expire_lock, &until);
+        if (expire_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&expire_lock);
+        expire_due_keys();
+        pthread_mutex_lock(&expire_lock);
+    }
+    pthread_mutex_unlock(&expire_lock);
+    return NULL;
+}
+
+// a cheap per-thread random number (xorshift64), for picking what to sample
+static uint64_t next_random(void) {
+    uint64_t x = evict_random != 0 ? evict_random : kv_hash_random_seed();
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    evict_random = x;
+    return x;
+}
+
+/*
+ * evict one entry: of KV_EVICTION_SAMPLES sampled from a random shard
+ * (moving on to the next shard if that one is empty), the least recently
+ * used - or with KV_EVICT_LFU the least frequently used, oldest first.
+ * candidate is the frequency of the new key the room is for, or -1 for no
+ * admission check: a candidate rarer than the victim is turned away and the
+ * victim stays
+ * returns 1 if an entry was evicted, 0 if there was nothing to evict, -1 if
+ * the candidate was turned away
+ */
+static int evict_one(int candidate) {
+    int first = (int)(next_random() % (uint64_t)num_shards);
+    for (int n = 0; n < num_shards; n++) {
+        kv_shard_t *shard = &shards[(first + n) % num_shards];
+        kv_entry_t *victim = NULL;
+        uint32_t oldest = 0;
+        int rarest = 0;
+
+        shard_write_lock(shard);
+        uint32_t now = lru_clock();   // read under the lock, so no sampled entry can be newer
+        for (int i = 0; i < KV_EVICTION_SAMPLES; i++) {
+            kv_entry_t *entry = swiss_sample(&shard->table, next_random());
+            if (entry == NULL) {
+                break;
+            }
+            uint32_t age = now - atomic_load_explicit(&entry->access, memory_order_relaxed);
+            // with LRU every frequency is 0, so only the age counts
+            int frequency = eviction == KV_EVICT_LFU ? sketch_frequency(&shard->sketch, entry->hash) : 0;
+            if (victim == NULL || frequency < rarest || (frequency == rarest && age > oldest)) {
+                victim = entry;
+                oldest = age;
+                rarest = frequency;
+            }
+        }
+        if (victim != NULL && candidate >= 0 && candidate < rarest) {
+            shard_unlock(shard);
+            return -1;
+        }
+        if (victim != NULL) {
+            swiss_remove(&shard->table, victim->hash, victim->key, victim->key_len);
+            log_delete(victim->key, victim->key_len);
+        }
+        shard_unlock(shard);
+
+        if (victim != NULL) {
+            atomic_fetch_sub(&used_memory, entry_cost(victim));
+            atomic_fetch_add(&evictions, 1);
+            entry_free(victim);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// would cost more bytes take the store past its memory limit?
+static inline int over_limit(size_t cost) {
+    return atomic_load_explicit(&used_memory, memory_order_relaxed) + cost > max_memory;
+}
+
+/*
+ * evict until cost more bytes fit under the memory limit
+ * candidate is passed on to evict_one() (-1 for no admission check)
+ * returns 0 once they fit, 1 if the candidate was turned away, -1 if they
+ * never can fit (bigger than the whole limit, or nothing left to evict)
+ */
+static int make_room(size_t cost, int candidate) {
+    if (cost > max_memory) {
+        return -1;
+    }
+    while (over_limit(cost)) {
+        int evicted = evict_one(candidate);
+        if (evicted < 0) {
+            atomic_fetch_add(&rejections, 1);
+            return 1;
+        }
+        if (evicted == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * set up count shards, each with an empty table
+ * sketch_words > 0 gives each shard a frequency sketch of that many words (KV_EVICT_LFU)
+ */
+static int sharded_init(int count, kv_lock_mode_t mode, kv_rehash_mode_t rehash, size_t sketch_words) {
+    // aligned allocation so every shard really starts on its own cache line
+    void *memory;
+    if (count <= 0 || posix_memalign(&memory, 64, sizeof(kv_shard_t) * count) != 0) {
+        return -1;
+    }
+    shards = memory;
+    num_shards = count;
+    lock_mode = mode;
+
+    /*
+     * with a read-heavy mix, glibc's default reader-preferring rwlock can keep
+     * a writer waiting for as long as readers keep arriving, so writers get
+     * priority: once one is waiting, new readers queue up behind it
+     */
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < count; i++) {
+        if (mode == KV_LOCK_RWLOCK) {
+            pthread_rwlock_init(&shards[i].lock.rwlock, &attr);
+        } else {
+            pthread_mutex_init(&shards[i].lock.mutex, NULL);
+        }
+        atomic_init(&shards[i].rehashing, 0);
+        shards[i].version = 0;
+        if (swiss_init(&shards[i].table, 0, rehash == KV_REHASH_INCREMENTAL) < 0) {
+            return -1;
+        }
+        wheel_init(&shards[i].wheel, unix_ms());
+        shards[i].sketch.table = NULL;
+        if (sketch_words > 0 && sketch_init(&shards[i].sketch, sketch_words) < 0) {
+            return -1;
+        }
+    }
+    pthread_rwlockattr_destroy(&attr);
+
+    if (rehash == KV_REHASH_INCREMENTAL) {
+        rehash_stop = 0;
+        rehash_pending = 0;
+        if (pthread_create(&rehash_thread, NULL, rehash_helper, NULL) != 0) {
+            return -1;
+        }
+        rehash_running = 1;
+    }
+
+    expire_stop = 0;
+    if (pthread_create(&expire_thread, NULL, expire_helper, NULL) != 0) {
+        return -1;
+    }
+    expire_running = 1;
+    return 0;
+}
+
+static void sharded_destroy(void) {
+    if (expire_running) {
+        pthread_mutex_lock(&expire_lock);
+        expire_stop = 1;
+        pthread_cond_signal(&expire_wake);
+        pthread_mutex_unlock(&expire_lock);
+        pthread_join(expire_thread, NULL);
+        expire_running = 0;
+    }
+    if (rehash_running) {
+        pthread_mutex_lock(&rehash_lock);
+        rehash_stop = 1;
+        pthread_cond_signal(&rehash_wake);
+        pthread_mutex_unlock(&rehash_lock);
+        pthread_join(rehash_thread, NULL);
+        rehash_running = 0;
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        swiss_table_t *table = &shards[i].table;
+        swiss_rehash_step(table, SIZE_MAX);  // so every entry is in the arrays walked below
+        for (size_t slot = 0; slot < table->capacity; slot++) {
+            entry_free(swiss_slot(table, slot));
+        }
+        swiss_destroy(table);
+        sketch_destroy(&shards[i].sketch);
+        wheel_destroy(&shards[i].wheel);
+        if (lock_mode == KV_LOCK_RWLOCK) {
+            pthread_rwlock_destroy(&shards[i].lock.rwlock);
+        } else {
+            pthread_mutex_destroy(&shards[i].lock.mutex);
+        }
+    }
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+    if (base_mapped) {
+        snapshot_unmap(&base);
+        free((void *)base_consumed);
+        base_consumed = NULL;
+        base_mapped = 0;
+        atomic_store(&base_remaining, 0);
+    }
+    atomic_store(&used_memory, 0);
+    atomic_store(&evictions, 0);
+    atomic_store(&rejections, 0);
+    atomic_store(&expired, 0);
+    snapshots = snapshot_failures = snapshot_cow_pages = 0;
+    snapshot_fork_us = snapshot_keys = snapshot_bytes = snapshot_us = 0;
+}
+
+void kv_config_default(kv_config_t *config) {
+    config->engine = KV_ENGINE_SHARDED;
+    config->num_shards = KV_DEFAULT_SHARDS;
+    config->lock_mode = KV_LOCK_MUTEX;
+    config->rehash = KV_REHASH_INCREMENTAL;
+    config->hash = KV_DEFAULT_HASH;
+    config->hash_seed = 0;
+    config->max_memory = 0;
+    config->eviction = KV_EVICT_LRU;
+    config->log_path = NULL;
+    config->log_fsync = WAL_FSYNC_EVERY;
+    config->log_fsync_ms = KV_DEFAULT_FSYNC_MS;
+    config->snapshot_path = NULL;
+    config->snapshot_copy = 0;
+    config->recovery_threads = 0;
+}
+
+/*
+ * hash a key to 64 bits with the hash function and seed picked at startup
+ * the swiss table takes its 7 control bits and starting group from the low
+ * end of the hash and the shard is picked from the high end
+ */
+static uint64_t key_hash(const char *key, size_t key_len) {
+    return hash_fn(key, key_len, hash_seed);
+}
+
+/*
+ * find the shard a key lives in, from the top 32 bits of its hash
+ * (multiply-and-shift maps them evenly onto 0 .. num_shards - 1)
+ * the same hash is reused for the lookup inside the shard, so a key is
+ * only ever hashed once per operation
+ */
+static kv_shard_t *shard_for(uint64_t hash) {
+    return &shards[((hash >> 32) * (uint64_t)num_shards) >> 32];
+}
+
+static int sharded_set(const char *key, const char *value, uint64_t expires, const uint64_t *expected);
+static int sharded_delete(const char *key);
+
+/*
+ * redo one logged change (now is when recovery started, so keys that have
+ * expired since are left out)
+ */
+static void replay_record(const wal_record_t *record, uint64_t now) {
+    if (record->type == WAL_SET && (record->expires == 0 || record->expires > now)) {
+        sharded_set(record->key, record->value, record->expires, NULL);
+    } else {
+        sharded_delete(record->key);
+    }
+}
+
+// run fn on threads threads at once, this one included, and wait for them all
+static void recovery_run(int threads, void *(*fn)(void *), void *arg) {
+    pthread_t ids[KV_RECOVERY_MAX_THREADS];
+    int started = 0;
+    // if a thread can't be started the others just do its share: fn takes its work from arg as it goes
+    while (started < threads - 1 && pthread_create(&ids[started], NULL, fn, arg) == 0) {
+        started++;
+    }
+    fn(arg);
+    for (int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+}
+
+/*
+ * size every shard's (still empty) table for its share of count keys, so
+ * they can be added without a single rehash
+ */
+static void shards_reserve(uint64_t count) {
+    size_t share = (size_t)(count / (uint64_t)num_shards);
+    share += share / 8 + SWISS_GROUP_WIDTH;   // keys never spread quite evenly
+    for (int i = 0; i < num_shards; i++) {
+        swiss_table_t table;
+        shard_write_lock(&shards[i]);
+        if (shards[i].table.size == 0 && swiss_init(&table, share, shards[i].table.incremental) == 0) {
+            swiss_destroy(&shards[i].table);
+            shards[i].table = table;
+        }
+        shard_unlock(&shards[i]);
+    }
+}
+
+// copying a snapshot in: the chunks handed out so far, shared by the recovery threads
+typedef struct {
+    _Atomic uint64_t next_chunk;
+    uint64_t now;
+    atomic_int failed;          // a chunk was damaged, or a key couldn't be stored
+} copy_job_t;
+
+/*
+ * a recovery thread: copy chunks of the snapshot in until there are none
+ * left. keys go in through sharded_set, so threads whose chunks hold keys
+ * of the same shard take turns at its lock, and each key gets a new version
+ */
+static void *copy_chunks(void *arg) {
+    copy_job_t *job = arg;
+    uint64_t chunks = snapshot_chunk_count(&base), chunk;
+    while ((chunk = atomic_fetch_add(&job->next_chunk, 1)) < chunks) {
+        uint64_t number = chunk == 0 ? 0 : snapshot_chunk_end(&base, chunk - 1);
+        uint64_t end = snapshot_chunk_end(&base, chunk);
+        const snapshot_record_t *record = snapshot_chunk(&base, chunk);
+        for (; number < end; number++, record = snapshot_next(&base, record)) {
+            if (record == NULL || record->number != number) {
+                atomic_store(&job->failed, 1);   // the walk ended early at a damaged record
+                break;
+            }
+            // a key that can't be stored (memory ran out, or max_memory turned it away) fails startup, not just itself
+            if ((record->expires == 0 || record->expires > job->now) &&
+                sharded_set(snapshot_record_key(record), snapshot_record_value(record), record->expires, NULL) != 0) {
+                atomic_store(&job->failed, 1);
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * start from the snapshot at snapshot_path: mapped, if its keys were
+ * hashed the way this store hashes them (a random seed is swapped for the
+ * file's), or else copied into the tables - as they are with a memory
+ * limit, which the mapped keys couldn't be counted against or evicted from
+ * returns 0 (with *log_offset set, if there was a snapshot), or -1 if the
+ * file is damaged or a key in it couldn't be stored
+ */
+static int base_open(const kv_config_t *config, uint64_t now, uint64_t *log_offset) {
+    int result = snapshot_map(&base, snapshot_path);
+    if (result != 0) {
+        return result > 0 ? 0 : -1;
+    }
+    *log_offset = base.log_offset;
+    if (!config->snapshot_copy && max_memory == 0 && base.hash == hash_kind &&
+        (config->hash_seed == 0 || config->hash_seed == base.hash_seed)) {
+        base_consumed = calloc(base.count / 64 + 1, sizeof(*base_consumed));
+        if (base_consumed != NULL) {
+            hash_seed = base.hash_seed;
+            for (int i = 0; i < num_shards; i++) {
+                shards[i].version = base.count;   // the mapped keys' versions are 1 .. count
+            }
+            atomic_store(&base_remaining, base.count);
+            base_mapped = 1;
+            return 0;
+        }
+    }
+
+    // copied in, a chunk at a time by every recovery thread, into tables already big enough
+    shards_reserve(base.count);
+    copy_job_t job;
+    atomic_init(&job.next_chunk, 0);
+    job.now = now;
+    atomic_init(&job.failed, 0);
+    recovery_run(recovery_threads, copy_chunks, &job);
+    snapshot_unmap(&base);
+    return atomic_load(&job.failed) ? -1 : 0;
+}
+
+/*
+ * replaying the log: the records of the round being read, dealt out to the
+ * recovery threads by shard. each queue holds replay_item_t headers, each
+ * followed by its key and value (both null-terminated), 8-byte aligned
+ */
+typedef struct {
+    uint64_t expires;
+    uint16_t value_len;
+    uint8_t key_len;
+    uint8_t type;
+} replay_item_t;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} replay_queue_t;
+
+typedef struct {
+    uint64_t now;
+    int threads;
+    replay_queue_t queues[KV_RECOVERY_MAX_THREADS];   // one per thread
+    size_t queued;              // bytes in all the queues
+    atomic_int next_queue;      // the next queue for a thread to claim this round
+} replay_t;
+
+static size_t replay_item_size(size_t key_len, size_t value_len) {
+    return (sizeof(replay_item_t) + key_len + 1 + value_len + 1 + 7) & ~(size_t)7;
+}
+
+// a recovery thread: redo the records of queues until every queue of the round is claimed
+static void *replay_queues(void *arg) {
+    replay_t *replay = arg;
+    int i;
+    while ((i = atomic_fetch_add(&replay->next_queue, 1)) < replay->threads) {
+        replay_queue_t *queue = &replay->queues[i];
+        for (size_t pos = 0; pos < queue->len;) {
+            const replay_item_t *item = (const replay_item_t *)(queue->buf + pos);
+            const char *key = (const char *)(item + 1);
+            wal_record_t record = { item->type, key, item->key_len, key + item->key_len + 1, item->value_len,
+                                    item->expires };
+            replay_record(&record, replay->now);
+            pos += replay_item_size(item->key_len, item->value_len);
+        }
+        queue->len = 0;
+    }
+    return NULL;
+}
+
+// redo everything queued, every thread at once
+static void replay_round(replay_t *replay) {
+    atomic_store(&replay->next_queue, 0);
+    recovery_run(replay->threads, replay_queues, replay);
+    replay->queued = 0;
+}
+
+/*
+ * wal_replay() callback: queue a record for the thread that owns its
+ * key's shard, and redo the round once enough has been queued
+ */
+static void replay_deal(const wal_record_t *record, void *arg) {
+    replay_t *replay = arg;
+    if (replay->threads == 1) {
+        replay_record(record, replay->now);
+        return;
+    }
+    int owner = (int)(shard_for(key_hash(record->key, record->key_len)) - shards) % replay->threads;
+    replay_queue_t *queue = &replay->queues[owner];
+    size_t size = replay_item_size(record->key_len, record->value_len);
+    if (queue->len + size > queue->cap) {
+        size_t cap = queue->cap != 0 ? queue->cap * 2 : 64 * 1024;
+        while (cap < queue->len + size) {
+            cap *= 2;
+        }
+        char *buf = realloc(queue->buf, cap);
+        if (buf == NULL) {
+            // out of memory for queuing: redo what's queued, so this record can go straight in after it
+            replay_round(replay);
+            replay_record(record, replay->now);
+            return;
+        }
+        queue->buf = buf;
+        queue->cap = cap;
+    }
+
+    replay_item_t *item = (replay_item_t *)(queue->buf + queue->len);
+    item->expires = record->expires;
+    item->value_len = (uint16_t)record->value_len;
+    item->key_len = (uint8_t)record->key_len;
+    item->type = (uint8_t)record->type;
+    char *key = (char *)(item + 1);
+    memcpy(key, record->key, record->key_len + 1);
+    memcpy(key + record->key_len + 1, record->value, record->value_len + 1);
+    queue->len += size;
+    replay->queued += size;
+    if (replay->queued >= KV_REPLAY_ROUND) {
+        replay_round(replay);
+    }
+}
+
+/*
+ * replay the log at path from offset on, with every recovery thread
+ * returns how many records were replayed, or -1 as wal_replay
+ */
+static long log_recover(const char *path, uint64_t offset, uint64_t now) {
+    replay_t replay;
+    memset(&replay, 0, sizeof(replay));
+    replay.now = now;
+    replay.threads = recovery_threads;
+    long replayed = wal_replay(path, offset, replay_deal, &replay);
+    if (replay.queued > 0) {
+        replay_round(&replay);   // the last round, cut short by the end of the log
+    }
+    for (int i = 0; i < replay.threads; i++) {
+        free(replay.queues[i].buf);
+    }
+    return replayed;
+}
+
+int kv_store_init(const kv_config_t *config) {
+    engine = config->engine;
+    hash_kind = config->hash;
+    hash_fn = kv_hash_function(config->hash);
+    hash_seed = config->hash_seed != 0 ? config->hash_seed : kv_hash_random_seed();
+    max_memory = config->max_memory;
+    if (engine == KV_ENGINE_LOCKFREE) {
+        if (max_memory != 0) {
+            return -1;   // lock-free buckets can't be sampled and evicted from safely
+        }
+        if (config->log_path != NULL || config->snapshot_path != NULL) {
+            // with no lock to log under, two writes to a key could be logged out of order (or forked half-made)
+            return -1;
+        }
+        return lf_init(KV_LOCKFREE_INITIAL_BUCKETS, hash_fn, hash_seed);
+    }
+    eviction = config->eviction;
+    size_t sketch_words = 0;
+    if (max_memory != 0 && eviction == KV_EVICT_LFU && config->num_shards > 0) {
+        sketch_words = max_memory / KV_SKETCH_BYTES_PER_WORD / (size_t)config->num_shards;
+        if (sketch_words < SKETCH_MIN_WORDS) {
+            sketch_words = SKETCH_MIN_WORDS;
+        }
+    }
+    if (sharded_init(config->num_shards, config->lock_mode, config->rehash, sketch_words) < 0) {
+        return -1;
+    }
+    long cpus = config->recovery_threads > 0 ? config->recovery_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    recovery_threads = (int)(cpus < 1 ? 1 : cpus < KV_RECOVERY_MAX_THREADS ? cpus : KV_RECOVERY_MAX_THREADS);
+    if (recovery_threads > num_shards) {
+        recovery_threads = num_shards;   // a thread per shard at most: replay deals records out by shard
+    }
+
+    // start from the snapshot, replay the rest of the log on top of it, and carry on appending to the log
+    uint64_t now = unix_ms(), log_offset = 0;
+    snapshot_path = config->snapshot_path;
+    if (snapshot_path != NULL && base_open(config, now, &log_offset) < 0) {
+        return -1;
+    }
+    if (config->log_path == NULL) {
+        return 0;
+    }
+    if (log_recover(config->log_path, log_offset, now) < 0 ||
+        wal_open(&wal, config->log_path, config->log_fsync, config->log_fsync_ms) < 0) {
+        return -1;
+    }
+    logging = 1;
+    return 0;
+}
+
+void kv_store_destroy(void) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        lf_destroy();
+    } else {
+        if (snapshot_started) {
+            pthread_join(snapshot_thread, NULL);   // waits for the child to finish
+            snapshot_started = 0;
+        }
+        if (logging) {
+            wal_close(&wal);
+            logging = 0;
+        }
+        sharded_destroy();
+    }
+}
+
+// a new entry for key, with no value in it yet (null if memory ran out)
+static kv_entry_t *entry_new(uint64_t hash, const char *key, size_t key_len, uint64_t expires) {
+    kv_entry_t *entry = slab_alloc(entry_size(key_len));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->expires = expires;
+    entry->key_len = (uint8_t)key_len;
+    memset(entry->key, 0, kv_key_size(key_len));   // short keys must be zero-padded
+    memcpy(entry->key, key, key_len);
+    atomic_init(&entry->access, max_memory != 0 ? lru_clock() : 0);
+    return entry;
+}
+
+// has a record of the mapped snapshot been promoted, deleted or found expired?
+static int base_is_consumed(const snapshot_record_t *record) {
+    uint64_t word = atomic_load_explicit(&base_consumed[record->number / 64], memory_order_relaxed);
+    return (word >> (record->number % 64)) & 1;
+}
+
+// mark a record consumed (its key's shard must be write-locked)
+static void base_consume(const snapshot_record_t *record) {
+    uint64_t bit = UINT64_C(1) << (record->number % 64);
+    if (!(atomic_fetch_or_explicit(&base_consumed[record->number / 64], bit, memory_order_relaxed) & bit)) {
+        atomic_fetch_sub_explicit(&base_remaining, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * key's record in the mapped snapshot, if it has one that hasn't been
+ * consumed - expired or not (its shard must be locked)
+ */
+static const snapshot_record_t *base_find(uint64_t hash, const char *key, size_t key_len) {
+    if (!base_mapped || atomic_load_explicit(&base_remaining, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+    const snapshot_record_t *record = snapshot_find(&base, hash, key, key_len);
+    return record != NULL && !base_is_consumed(record) ? record : NULL;
+}
+
+/*
+ * add a new entry to its shard, which the caller has write-locked, and
+ * unlock it. replaced (may be null) is the key's record in the mapped
+ * snapshot, consumed only once the entry is in - if the insert fails, the
+ * key is left as it was
+ * returns 0 on success, -1 (with the entry freed) if the table couldn't grow
+ */
+static int shard_insert_unlock(kv_shard_t *shard, kv_entry_t *entry, const snapshot_record_t *replaced) {
+    if (swiss_insert(&shard->table, entry) < 0) {
+        shard_unlock(shard);
+        entry_free(entry);
+        return -1;
+    }
+    if (replaced != NULL) {
+        base_consume(replaced);
+    }
+    log_entry(entry);
+    // this insert may have started a rehash: hand it to the helper to finish
+    int started = swiss_rehashing(&shard->table) && !atomic_load(&shard->rehashing);
+    if (started) {
+        atomic_store(&shard->rehashing, 1);
+    }
+    size_t cost = entry_cost(entry);   // worked out while locked: once unlocked the entry may be deleted
+    shard_unlock(shard);
+    atomic_fetch_add(&used_memory, cost);
+    if (started) {
+        wake_rehash_helper();
+    }
+    return 0;
+}
+
+// key's record in the mapped snapshot, if the key is live there (its shard must be locked)
+static const snapshot_record_t *base_live(uint64_t hash, const char *key, size_t key_len) {
+    const snapshot_record_t *record = base_find(hash, key, key_len);
+    if (record != NULL && record->expires != 0 && record->expires <= unix_ms()) {
+        return NULL;
+    }
+    return record;
+}
+
+// copy a record's value into buf, as kv_entry_copy_value does an entry's
+static void base_copy_value(const snapshot_record_t *record, char *buf, size_t size) {
+    size_t copy = record->value_len < size - 1 ? record->value_len : size - 1;
+    memcpy(buf, snapshot_record_value(record), copy);
+    buf[copy] = '\0';
+}
+
+/*
+ * a write is about to change a key its table (write-locked) doesn't have:
+ * if the key is live in the mapped snapshot, promote it into the table
+ * first, with the version it had there, so the write finds it like any
+ * other entry. an expired record is just consumed
+ * returns 1 with *promoted set, 0 if the key isn't live in the snapshot,
+ * or -1 if memory ran out
+ */
+static int base_promote(kv_shard_t *shard, uint64_t hash, const char *key, size_t key_len,
+                        kv_entry_t **promoted) {
+    const snapshot_record_t *record = base_find(hash, key, key_len);
+    if (record == NULL) {
+        return 0;
+    }
+    if (record->expires != 0 && record->expires <= unix_ms()) {
+        base_consume(record);
+        return 0;
+    }
+
+    size_t value_len = record->value_len;
+    char *spill = NULL;
+    if (!kv_value_inline(value_len)) {
+        spill = slab_alloc(value_len + 1);
+        if (spill == NULL) {
+            return -1;
+        }
+        memcpy(spill, snapshot_record_value(record), value_len + 1);
+    }
+    kv_entry_t *entry = entry_new(hash, key, key_len, record->expires);
+    if (entry == NULL) {
+        slab_free(spill, value_len + 1);
+        return -1;
+    }
+    entry_store_value(entry, snapshot_record_value(record), value_len, spill);
+    entry->version = (uint64_t)record->number + 1;   // below every version the shards give out
+    if ((record->expires != 0 && wheel_add(&shard->wheel, hash, record->expires) < 0) ||
+        swiss_insert(&shard->table, entry) < 0) {
+        entry_free(entry);
+        return -1;
+    }
+    base_consume(record);
+    atomic_fetch_add(&used_memory, entry_cost(entry));
+    // the helper never takes rehash_lock and a shard's lock together, so it can be woken from here
+    if (swiss_rehashing(&shard->table) && !atomic_load(&shard->rehashing)) {
+        atomic_store(&shard->rehashing, 1);
+        wake_rehash_helper();
+    }
+    *promoted = entry;
+    return 1;
+}
+
+/*
+ * a delete found nothing in key's table (write-locked): consume its
+ * record in the mapped snapshot, if it has one
+ * returns 1 if the key was live there, else 0
+ */
+static int base_remove(uint64_t hash, const char *key, size_t key_len) {
+    const snapshot_record_t *record = base_find(hash, key, key_len);
+    if (record == NULL) {
+        return 0;
+    }
+    base_consume(record);
+    return !(record->expires != 0 && record->expires <= unix_ms());
+}
+
+/*
+ * store value under key, to expire at expires (unix milliseconds, 0 = never)
+ * with expected set it is a compare-and-swap instead: the key must already
+ * be there with that version, and it keeps its own expiry
+ * returns 0, or 1 / -1 as kv_set describes, or KV_NOT_FOUND / KV_CHANGED
+ */
+static int sharded_set(const char *key, const char *value, uint64_t expires, const uint64_t *expected) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    size_t value_len = strnlen(value, KV_MAX_VALUE);
+    uint64_t hash = key_hash(key, key_len);
+    kv_shard_t *shard = shard_for(hash);
+    kv_entry_t *entry;
+
+    key_seen(shard, hash);
+
+    /*
+     * with a memory limit, make room before locking anything (assuming the
+     * key is new, unless this is a compare-and-swap, which only ever
+     * replaces a value)
+     */
+    if (max_memory != 0) {
+        size_t cost = value_cost(value_len) + (expected == NULL ? slab_item_size(entry_size(key_len)) : 0);
+        int candidate = -1;
+        if (expected == NULL && eviction == KV_EVICT_LFU && over_limit(cost)) {
+            // only a new key has to earn its place: an existing one is just being updated
+            shard_read_lock(shard);
+            int exists = swiss_find(&shard->table, hash, key, key_len) != NULL;
+            shard_unlock(shard);
+            if (!exists) {
+                candidate = sketch_frequency(&shard->sketch, hash);
+            }
+        }
+        int room = make_room(cost, candidate);
+        if (room != 0) {
+            return room;
+        }
+    }
+
+    // copy a value too long to go inline before locking, so the shard isn't held while it is allocated
+    char *spill = NULL;
+    if (!kv_value_inline(value_len)) {
+        spill = slab_alloc(value_len + 1);
+        if (spill == NULL) {
+            return -1;
+        }
+        memcpy(spill, value, value_len);
+        spill[value_len] = '\0';
+    }
+
+    shard_write_lock(shard);
+    // search this shard to see if the key already exists (if it has expired, a SET simply reuses it)
+    entry = swiss_find(&shard->table, hash, key, key_len);
+    const snapshot_record_t *replaced = NULL;
+    if (entry == NULL && expected == NULL) {
+        // replaced outright: the snapshot's value is never read, and its record goes once the entry is in
+        replaced = base_find(hash, key, key_len);
+    } else if (entry == NULL && base_promote(shard, hash, key, key_len, &entry) < 0) {
+        shard_unlock(shard);
+        slab_free(spill, value_len + 1);
+        return -1;
+    }
+    if (expected != NULL) {
+        int result = 0;
+        if (entry == NULL || (entry->expires != 0 && kv_entry_expired(entry, unix_ms()))) {
+            result = KV_NOT_FOUND;
+        } else if (entry->version != *expected) {
+            result = KV_CHANGED;
+        }
+        if (result != 0) {
+            shard_unlock(shard);
+            slab_free(spill, value_len + 1);
+            return result;
+        }
+        expires = entry->expires;
+    } else if (expires != 0 && wheel_add(&shard->wheel, hash, expires) < 0) {
+        // a key with a time to live needs a timer, and that's the one thing here that can fail
+        shard_unlock(shard);
+        slab_free(spill, value_len + 1);
+        return -1;
+    }
+    if (entry) {
+        // key already exists, so store the new value and free any old spilled one once unlocked
+        char *old = kv_value_inline(entry->value_len) ? NULL : kv_entry_room(entry)->spilled;
+        size_t old_len = entry->value_len;
+        entry_store_value(entry, value, value_len, spill);
+        entry->expires = expires;
+        entry->version = ++shard->version;
+        entry_touch(entry);
+        log_entry(entry);
+        shard_unlock(shard);
+        slab_free(old, old_len + 1);
+        atomic_fetch_add(&used_memory, value_cost(value_len));
+        atomic_fetch_sub(&used_memory, value_cost(old_len));
+        return 0;
+    }
+
+    // key doesn't exist, so create a new entry just big enough for its key
+    entry = entry_new(hash, key, key_len, expires);
+    if (entry == NULL) {
+        shard_unlock(shard);
+        slab_free(spill, value_len + 1);
+        return -1;
+    }
+    entry_store_value(entry, value, value_len, spill);
+    entry->version = ++shard->version;
+    return shard_insert_unlock(shard, entry, replaced);
+}
+
+// version may be null (a plain GET)
+static int sharded_get(const char *key, char *value, size_t size, uint64_t *version) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = key_hash(key, key_len);
+    kv_shard_t *shard = shard_for(hash);
+    kv_entry_t *entry;
+    int found = 0;
+
+    /*
+     * only the copy happens under the lock
+     * building the reply from the copy is left to the caller, so the shard
+     * is held for as short a time as possible. a GET only reads, so in
+     * rwlock mode it shares the shard with every other GET
+     */
+    key_seen(shard, hash);
+    shard_read_lock(shard);
+    entry = swiss_find(&shard->table, hash, key, key_len);
+    int stale = entry != NULL && entry->expires != 0 && kv_entry_expired(entry, unix_ms());
+    if (entry && !stale) {
+        kv_entry_copy_value(entry, value, size);
+        if (version != NULL) {
+            *version = entry->version;
+        }
+        entry_touch(entry);
+        found = 1;
+    } else if (entry == NULL) {
+        const snapshot_record_t *record = base_live(hash, key, key_len);
+        if (record != NULL) {
+            base_copy_value(record, value, size);
+            if (version != NULL) {
+                *version = (uint64_t)record->number + 1;
+            }
+            found = 1;
+        }
+    }
+    shard_unlock(shard);
+    if (stale) {
+        // a GET may only hold the read lock, so the expired key is removed separately
+        shard_write_lock(shard);
+        entry = swiss_find(&shard->table, hash, key, key_len);
+        if (entry && kv_entry_expired(entry, unix_ms())) {
+            remove_expired(shard, entry);
+        }
+        shard_unlock(shard);
+    }
+    return found;
+}
+
+static int sharded_delete(const char *key) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = key_hash(key, key_len);
+    kv_shard_t *shard = shard_for(hash);
+    kv_entry_t *entry;
+
+    // unlink it from the table while locked, free the memory afterwards
+    shard_write_lock(shard);
+    entry = swiss_remove(&shard->table, hash, key, key_len);
+    int mapped = entry == NULL && base_remove(hash, key, key_len);
+    if (entry || mapped) {
+        log_delete(key, key_len);
+    }
+    shard_unlock(shard);
+
+    // an expired key is removed all the same, but it wasn't really there any more
+    int found = mapped || (entry != NULL && !(entry->expires != 0 && kv_entry_expired(entry, unix_ms())));
+    if (entry) {
+        atomic_fetch_sub(&used_memory, entry_cost(entry));
+        if (!found) {
+            atomic_fetch_add(&expired, 1);
+        }
+    }
+    entry_free(entry);
+    return found;
+}
+
+static int sharded_incr(const char *key, int64_t delta, int64_t *value) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = key_hash(key, key_len);
+    kv_shard_t *shard = shard_for(hash);
+
+    key_seen(shard, hash);
+    // a missing key is created, so there has to be room for it (no admission check for counters)
+    if (max_memory != 0 && make_room(slab_item_size(entry_size(key_len)), -1) != 0) {
+        return -1;
+    }
+
+    shard_write_lock(shard);
+    kv_entry_t *entry = swiss_find(&shard->table, hash, key, key_len);
+    if (entry && entry->expires != 0 && kv_entry_expired(entry, unix_ms())) {
+        remove_expired(shard, entry);
+        entry = NULL;
+    }
+    if (entry == NULL && base_promote(shard, hash, key, key_len, &entry) < 0) {
+        shard_unlock(shard);
+        return -1;
+    }
+    if (entry == NULL) {
+        entry = entry_new(hash, key, key_len, 0);
+        if (entry == NULL) {
+            shard_unlock(shard);
+            return -1;
+        }
+        entry_store_int(entry, delta);
+        entry->version = ++shard->version;
+        *value = delta;
+        return shard_insert_unlock(shard, entry, NULL);
+    }
+
+    // integers are already stored as integers; any other text can't be one (SET would have spotted it)
+    int64_t current;
+    if (entry->encoding != KV_ENCODING_INT) {
+        shard_unlock(shard);
+        return KV_NOT_INTEGER;
+    }
+    if (__builtin_add_overflow(kv_entry_room(entry)->integer, delta, &current)) {
+        shard_unlock(shard);
+        return KV_OVERFLOW;
+    }
+    entry_store_int(entry, current);
+    entry->version = ++shard->version;
+    entry_touch(entry);
+    log_entry(entry);
+    shard_unlock(shard);
+    *value = current;
+    return 0;
+}
+
+static int sharded_expire(const char *key, long seconds) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = key_hash(key, key_len);
+    kv_shard_t *shard = shard_for(hash);
+    uint64_t now = unix_ms();
+
+    shard_write_lock(shard);
+    kv_entry_t *entry = swiss_find(&shard->table, hash, key, key_len);
+    if (entry && kv_entry_expired(entry, now)) {
+        remove_expired(shard, entry);
+        entry = NULL;
+    }
+    int promoted = entry == NULL ? base_promote(shard, hash, key, key_len, &entry) : 0;
+    if (entry == NULL) {
+        shard_unlock(shard);
+        return promoted < 0 ? -1 : 0;
+    }
+    if (seconds <= 0) {
+        // no time left: gone right away, like a DELETE
+        swiss_remove(&shard->table, hash, key, key_len);
+        log_delete(key, key_len);
+        shard_unlock(shard);
+        atomic_fetch_sub(&used_memory, entry_cost(entry));
+        entry_free(entry);
+        return 1;
+    }
+    if (seconds > KV_MAX_TTL) {
+        seconds = KV_MAX_TTL;
+    }
+    uint64_t expires = now + (uint64_t)seconds * 1000;
+    if (wheel_add(&shard->wheel, hash, expires) < 0) {
+        shard_unlock(shard);
+        return -1;
+    }
+    entry->expires = expires;
+    log_entry(entry);
+    shard_unlock(shard);
+    return 1;
+}
+
+static int sharded_ttl(const char *key, long *seconds) {
+    size_t key_len = strnlen(key, KV_MAX_KEY);
+    uint64_t hash = key_hash(key, key_len);
+    kv_shard_t *shard = shard_for(hash);
+    uint64_t now = unix_ms();
+    int found = 0;
+
+    // an expired key is only reported missing here; GET or the expiry thread removes it
+    shard_read_lock(shard);
+    kv_entry_t *entry = swiss_find(&shard->table, hash, key, key_len);
+    const snapshot_record_t *record = NULL;
+    if (entry && !kv_entry_expired(entry, now)) {
+        *seconds = entry->expires == 0 ? -1 : (long)((entry->expires - now + 500) / 1000);
+        found = 1;
+    } else if (entry == NULL && (record = base_live(hash, key, key_len)) != NULL) {
+        *seconds = record->expires == 0 ? -1 : (long)((record->expires - now + 500) / 1000);
+        found = 1;
+    }
+    shard_unlock(shard);
+    return found;
+}
+
+/*
+ * BATCHES (see kv_store.h)
+ * a batch's keys are hashed up front and sorted by shard, keeping their
+ * order within each shard, so each shard's keys form one run that is
+ * handled under a single lock. while the run is being worked through, the
+ * entry of the key KV_PREFETCH_AHEAD places on is fetched, and the group
+ * of the key twice as far on - by the time a key's turn comes, both its
+ * group and its entry should already be in the cache
+ */
+typedef struct {
+    uint64_t hash;
+    kv_shard_t *shard;
+    size_t key_len;
+    size_t index;                   // where the key is in the caller's arrays
+} batch_key_t;
+
+// by shard, then by where the key is in the batch
+static int batch_key_order(const void *a, const void *b) {
+    const batch_key_t *x = a, *y = b;
+    if (x->shard != y->shard) {
+        return x->shard < y->shard ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// fill batch with keys[0 .. count - 1] (at most KV_BATCH_MAX), sorted into runs by shard
+static void batch_prepare(batch_key_t *batch, const char *const *keys, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        batch[i].key_len = strnlen(keys[i], KV_MAX_KEY);
+        batch[i].hash = key_hash(keys[i], batch[i].key_len);
+        batch[i].shard = shard_for(batch[i].hash);
+        batch[i].index = i;
+    }
+    qsort(batch, count, sizeof(batch_key_t), batch_key_order);
+}
+
+// where the run of keys that starts at batch[start] ends
+static size_t batch_run_end(const batch_key_t *batch, size_t start, size_t count) {
+    size_t end = start + 1;
+    while (end < count && batch[end].shard == batch[start].shard) {
+        end++;
+    }
+    return end;
+}
+
+/*
+ * before looking up batch[i] (of the run that ends at end), start fetching
+ * for the keys ahead of it. the first few keys of a run have nobody before
+ * them to have fetched their groups, so i == start also does that
+ */
+static inline void batch_prefetch(const swiss_table_t *table, const batch_key_t *batch,
+                                  size_t start, size_t i, size_t end) {
+    if (i == start) {
+        for (size_t j = start; j < end && j < start + 2 * KV_PREFETCH_AHEAD; j++) {
+            swiss_prefetch(table, batch[j].hash);
+        }
+    } else if (i + 2 * KV_PREFETCH_AHEAD < end) {
+        swiss_prefetch(table, batch[i + 2 * KV_PREFETCH_AHEAD].hash);
+    }
+    if (i + KV_PREFETCH_AHEAD < end) {
+        swiss_prefetch_entry(table, batch[i + KV_PREFETCH_AHEAD].hash);
+    }
+}
+
+/*
+ * copy the values of keys[0 .. count - 1] into buf, starting *used bytes in
+ * returns how many were found, or -1 if buf ran out
+ */
+static int sharded_mget(const char *const *keys, size_t count, const char **values,
+                        char *buf, size_t size, size_t *used) {
+    batch_key_t batch[KV_BATCH_MAX];
+    uint64_t now = unix_ms();
+    int found = 0;
+
+    batch_prepare(batch, keys, count);
+    for (size_t start = 0, end; start < count; start = end) {
+        end = batch_run_end(batch, start, count);
+        kv_shard_t *shard = batch[start].shard;
+        for (size_t i = start; i < end; i++) {
+            key_seen(shard, batch[i].hash);
+        }
+
+        shard_read_lock(shard);
+        for (size_t i = start; i < end; i++) {
+            batch_prefetch(&shard->table, batch, start, i, end);
+            size_t index = batch[i].index;
+            kv_entry_t *entry = swiss_find(&shard->table, batch[i].hash, keys[index], batch[i].key_len);
+            values[index] = NULL;
+            if (entry == NULL) {
+                const snapshot_record_t *record = base_live(batch[i].hash, keys[index], batch[i].key_len);
+                if (record == NULL) {
+                    continue;
+                }
+                if ((size_t)record->value_len + 1 > size - *used) {
+                    shard_unlock(shard);
+                    return -1;
+                }
+                base_copy_value(record, buf + *used, size - *used);
+                values[index] = buf + *used;
+                *used += record->value_len + 1;
+                found++;
+                continue;
+            }
+            // an expired key is only reported missing here; GET or the expiry thread removes it
+            if (kv_entry_expired(entry, now)) {
+                continue;
+            }
+            if ((size_t)entry->value_len + 1 > size - *used) {
+                shard_unlock(shard);
+                return -1;
+            }
+            kv_entry_copy_value(entry, buf + *used, size - *used);
+            values[index] = buf + *used;
+            *used += entry->value_len + 1;
+            entry_touch(entry);
+            found++;
+        }
+        shard_unlock(shard);
+    }
+    return found;
+}
+
+/*
+ * the keys of one run of an MSET, under one lock. spills[i] is keys[i]'s
+ * value already copied out if it is too long to go inline; it is set to
+ * null once the entry owns it
+ * returns 0, or -1 if memory ran out (the keys before it were stored)
+ */
+static int mset_run(const batch_key_t *batch, size_t start, size_t end, const char *const *keys,
+                    const char *const *values, const size_t *value_lens, char **spills) {
+    kv_shard_t *shard = batch[start].shard;
+    char *old[KV_BATCH_MAX];        // spilled values replaced, freed once unlocked
+    size_t old_lens[KV_BATCH_MAX];
+    size_t replaced = 0, added = 0, removed = 0;
+    int result = 0;
+
+    shard_write_lock(shard);
+    for (size_t i = start; i < end; i++) {
+        batch_prefetch(&shard->table, batch, start, i, end);
+        size_t index = batch[i].index;
+        size_t value_len = value_lens[index];
+        kv_entry_t *entry = swiss_find(&shard->table, batch[i].hash, keys[index], batch[i].key_len);
+        if (entry) {
+            if (!kv_value_inline(entry->value_len)) {
+                old[replaced] = kv_entry_room(entry)->spilled;
+                old_lens[replaced++] = entry->value_len;
+            }
+            removed += value_cost(entry->value_len);
+            entry_store_value(entry, values[index], value_len, spills[index]);
+            spills[index] = NULL;
+            entry->expires = 0;
+            entry->version = ++shard->version;
+            entry_touch(entry);
+            log_entry(entry);
+            added += value_cost(value_len);
+            continue;
+        }
+
+        entry = entry_new(batch[i].hash, keys[index], batch[i].key_len, 0);
+        if (entry == NULL) {
+            result = -1;
+            break;
+        }
+        entry_store_value(entry, values[index], value_len, spills[index]);
+        spills[index] = NULL;
+        entry->version = ++shard->version;
+        if (swiss_insert(&shard->table, entry) < 0) {
+            entry_free(entry);
+            result = -1;
+            break;
+        }
+        // as in sharded_set: a record in the mapped snapshot goes only once the new entry is in
+        const snapshot_record_t *replaced = base_find(batch[i].hash, keys[index], batch[i].key_len);
+        if (replaced != NULL) {
+            base_consume(replaced);
+        }
+        log_entry(entry);
+        added += entry_cost(entry);
+    }
+    int started = swiss_rehashing(&shard->table) && !atomic_load(&shard->rehashing);
+    if (started) {
+        atomic_store(&shard->rehashing, 1);
+    }
+    shard_unlock(shard);
+
+    for (size_t i = 0; i < replaced; i++) {
+        slab_free(old[i], old_lens[i] + 1);
+    }
+    atomic_fetch_add(&used_memory, added);
+    atomic_fetch_sub(&used_memory, removed);
+    if (started) {
+        wake_rehash_helper();
+    }
+    return result;
+}
+
+static int sharded_mset(const char *const *keys, const char *const *values, size_t count) {
+    if (max_memory != 0) {
+        // each key has to make room for itself (and, with LFU, earn its place), so they go one at a time
+        int result = 0;
+        for (size_t i = 0; i < count; i++) {
+            int stored = sharded_set(keys[i], values[i], 0, NULL);
+            if (stored < 0) {
+                return -1;
+            }
+            if (stored > 0) {
+                result = 1;
+            }
+        }
+        return result;
+    }
+
+    batch_key_t batch[KV_BATCH_MAX];
+    size_t value_lens[KV_BATCH_MAX];
+    char *spills[KV_BATCH_MAX];
+    int result = 0;
+
+    // copy the values too long to go inline before locking anything, as sharded_set does
+    for (size_t i = 0; i < count; i++) {
+        value_lens[i] = strnlen(values[i], KV_MAX_VALUE);
+        spills[i] = NULL;
+        if (!kv_value_inline(value_lens[i])) {
+            spills[i] = slab_alloc(value_lens[i] + 1);
+            if (spills[i] == NULL) {
+                count = i;
+                result = -1;
+                break;
+            }
+            memcpy(spills[i], values[i], value_lens[i]);
+            spills[i][value_lens[i]] = '\0';
+        }
+    }
+
+    if (result == 0) {
+        batch_prepare(batch, keys, count);
+        for (size_t start = 0, end; start < count && result == 0; start = end) {
+            end = batch_run_end(batch, start, count);
+            result = mset_run(batch, start, end, keys, values, value_lens, spills);
+        }
+    }
+
+    // whatever wasn't stored still owns its copy
+    for (size_t i = 0; i < count; i++) {
+        slab_free(spills[i], value_lens[i] + 1);
+    }
+    return result;
+}
+
+static int sharded_mdel(const char *const *keys, size_t count) {
+    batch_key_t batch[KV_BATCH_MAX];
+    kv_entry_t *removed[KV_BATCH_MAX];
+    size_t removed_count = 0;
+    int found = 0;
+
+    batch_prepare(batch, keys, count);
+    for (size_t start = 0, end; start < count; start = end) {
+        end = batch_run_end(batch, start, count);
+        kv_shard_t *shard = batch[start].shard;
+        shard_write_lock(shard);
+        for (size_t i = start; i < end; i++) {
+            batch_prefetch(&shard->table, batch, start, i, end);
+            kv_entry_t *entry = swiss_remove(&shard->table, batch[i].hash, keys[batch[i].index],
+                                             batch[i].key_len);
+            if (entry) {
+                log_delete(entry->key, entry->key_len);
+                removed[removed_count++] = entry;
+            } else if (base_remove(batch[i].hash, keys[batch[i].index], batch[i].key_len)) {
+                log_delete(keys[batch[i].index], batch[i].key_len);
+                found++;
+            }
+        }
+        shard_unlock(shard);
+    }
+
+    // as in sharded_delete, the memory is freed once nothing is locked
+    uint64_t now = unix_ms();
+    for (size_t i = 0; i < removed_count; i++) {
+        atomic_fetch_sub(&used_memory, entry_cost(removed[i]));
+        if (kv_entry_expired(removed[i], now)) {
+            atomic_fetch_add(&expired, 1);
+        } else {
+            found++;
+        }
+        entry_free(removed[i]);
+    }
+    return found;
+}
+
+/*
+ * the public operations just hand off to whichever engine is running
+ * (the sharded engine's writes finish with log_commit, which does nothing
+ * without a log)
+ */
+int kv_set(const char *key, const char *value) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return lf_set(key, value);
+    }
+    return log_commit(sharded_set(key, value, 0, NULL));
+}
+
+int kv_set_expire(const char *key, const char *value, long seconds) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return KV_UNSUPPORTED;
+    }
+    if (seconds > KV_MAX_TTL) {
+        seconds = KV_MAX_TTL;
+    }
+    return log_commit(sharded_set(key, value, unix_ms() + (uint64_t)(seconds > 0 ? seconds : 0) * 1000, NULL));
+}
+
+int kv_incr(const char *key, int64_t delta, int64_t *value) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return lf_incr(key, delta, value);
+    }
+    return log_commit(sharded_incr(key, delta, value));
+}
+
+int kv_parse_int(const char *text, size_t len, int64_t *value) {
+    if (len == 0 || len > KV_INT_CHARS - 1) {
+        return 0;
+    }
+    int negative = text[0] == '-';
+    size_t i = negative ? 1 : 0;
+    if (i == len) {
+        return 0;   // just a "-"
+    }
+    // no leading zeros, and no "-0": those print back differently
+    if (text[i] == '0' && (len > i + 1 || negative)) {
+        return 0;
+    }
+    uint64_t magnitude = 0;
+    for (; i < len; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return 0;
+        }
+        uint64_t digit = (uint64_t)(text[i] - '0');
+        if (magnitude > (UINT64_MAX - digit) / 10) {
+            return 0;
+        }
+        magnitude = magnitude * 10 + digit;
+    }
+    if (negative) {
+        if (magnitude > (uint64_t)INT64_MAX + 1) {
+            return 0;
+        }
+        *value = magnitude == (uint64_t)INT64_MAX + 1 ? INT64_MIN : -(int64_t)magnitude;
+    } else {
+        if (magnitude > (uint64_t)INT64_MAX) {
+            return 0;
+        }
+        *value = (int64_t)magnitude;
+    }
+    return 1;
+}
+
+size_t kv_format_int(int64_t value, char *buf) {
+    char digits[KV_INT_CHARS];
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    size_t len = 0;
+    if (value < 0) {
+        buf[len++] = '-';
+    }
+    while (count > 0) {
+        buf[len++] = digits[--count];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+int kv_expire(const char *key, long seconds) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return KV_UNSUPPORTED;
+    }
+    return log_commit(sharded_expire(key, seconds));
+}
+
+int kv_ttl(const char *key, long *seconds) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return KV_UNSUPPORTED;
+    }
+    return sharded_ttl(key, seconds);
+}
+
+int kv_get(const char *key, char *value, size_t size) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return lf_get(key, value, size, NULL, NULL);
+    }
+    return sharded_get(key, value, size, NULL);
+}
+
+int kv_gets(const char *key, char *value, size_t size, uint64_t *version) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return lf_get(key, value, size, version, NULL);
+    }
+    return sharded_get(key, value, size, version);
+}
+
+int kv_cas(const char *key, const char *value, uint64_t version) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return lf_cas(key, value, version);
+    }
+    return log_commit(sharded_set(key, value, 0, &version));
+}
+
+int kv_delete(const char *key) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return lf_delete(key);
+    }
+    return log_commit(sharded_delete(key));
+}
+
+/*
+ * batches are handed to the engine KV_BATCH_MAX keys at a time. the
+ * lock-free engine has no shard locks to take once per batch (and GETs take
+ * none at all), so it just runs the keys one by one
+ */
+int kv_mget(const char *const *keys, size_t count, const char **values, char *buf, size_t size) {
+    size_t used = 0;
+    int found = 0;
+    for (size_t start = 0; start < count; start += KV_BATCH_MAX) {
+        size_t chunk = count - start < KV_BATCH_MAX ? count - start : KV_BATCH_MAX;
+        if (engine != KV_ENGINE_LOCKFREE) {
+            int got = sharded_mget(keys + start, chunk, values + start, buf, size, &used);
+            if (got < 0) {
+                return -1;
+            }
+            found += got;
+            continue;
+        }
+        for (size_t i = start; i < start + chunk; i++) {
+            values[i] = NULL;
+            // a full buffer still looks the key up (into spare), so a key found then fails as in sharded_mget
+            size_t room = size - used, len;
+            char spare;
+            if (lf_get(keys[i], room > 0 ? buf + used : &spare, room > 0 ? room : 1, NULL, &len)) {
+                if (len + 1 > room) {
+                    return -1;   // it was cut short (the same test as sharded_mget's)
+                }
+                values[i] = buf + used;
+                used += len + 1;
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+int kv_mset(const char *const *keys, const char *const *values, size_t count) {
+    int result = 0;
+    for (size_t start = 0; start < count && result >= 0; start += KV_BATCH_MAX) {
+        size_t chunk = count - start < KV_BATCH_MAX ? count - start : KV_BATCH_MAX;
+        if (engine != KV_ENGINE_LOCKFREE) {
+            int stored = sharded_mset(keys + start, values + start, chunk);
+            result = stored != 0 ? stored : result;
+            continue;
+        }
+        for (size_t i = start; i < start + chunk && result >= 0; i++) {
+            result = lf_set(keys[i], values[i]);
+        }
+    }
+    return log_commit(result);
+}
+
+int kv_mdel(const char *const *keys, size_t count) {
+    int found = 0;
+    for (size_t start = 0; start < count; start += KV_BATCH_MAX) {
+        size_t chunk = count - start < KV_BATCH_MAX ? count - start : KV_BATCH_MAX;
+        if (engine != KV_ENGINE_LOCKFREE) {
+            found += sharded_mdel(keys + start, chunk);
+            continue;
+        }
+        for (size_t i = start; i < start + chunk; i++) {
+            found += lf_delete(keys[i]);
+        }
+    }
+    return log_commit(found);
+}
+
+// the child: add one entry to the snapshot, unless it had expired by the fork
+static void snapshot_entry(snapshot_writer_t *writer, const kv_entry_t *entry, uint64_t now) {
+    if (entry != NULL && !kv_entry_expired(entry, now)) {
+        char text[KV_INT_CHARS];
+        snapshot_add(writer, entry->hash, entry->key, entry->key_len, entry_text(entry, text), entry->value_len,
+                     entry->expires);
+    }
+}
+
+// the child: how much of its memory it no longer shares with the parent (Private_Dirty, in bytes)
+static uint64_t private_dirty_bytes(void) {
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    uint64_t total = 0;
+    if (file != NULL) {
+        char line[256];
+        unsigned long long kb;
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "Private_Dirty: %llu kB", &kb) == 1) {
+                total += kb * 1024;
+            }
+        }
+        fclose(file);
+    }
+    return total;
+}
+
+/*
+ * the child: write every shard out, and the keys still live in the mapped
+ * snapshot, and report back through fd
+ * it is the only thread in its process, and its copy of the store can
+ * never change, so it reads the tables without locking them - including
+ * both arrays of any rehash that was under way
+ */
+static void snapshot_child(int fd, uint64_t log_offset) {
+    snapshot_report_t report = { 0, 0, 0, 0 };
+    snapshot_writer_t writer;
+    uint64_t now = unix_ms();
+    uint64_t keys = atomic_load(&base_remaining);
+    for (int i = 0; i < num_shards; i++) {
+        keys += shards[i].table.size;
+    }
+    if (snapshot_begin(&writer, snapshot_path, keys) == 0) {
+        for (const snapshot_record_t *record = base_mapped ? snapshot_next(&base, NULL) : NULL; record != NULL;
+             record = snapshot_next(&base, record)) {
+            if (!base_is_consumed(record) && (record->expires == 0 || record->expires > now)) {
+                snapshot_add(&writer, record->hash, snapshot_record_key(record), record->key_len,
+                             snapshot_record_value(record), record->value_len, record->expires);
+            }
+        }
+        for (int i = 0; i < num_shards; i++) {
+            const swiss_table_t *table = &shards[i].table;
+            for (size_t slot = 0; slot < table->capacity; slot++) {
+                snapshot_entry(&writer, swiss_slot(table, slot), now);
+            }
+            for (size_t slot = 0; slot < table->old_capacity; slot++) {
+                snapshot_entry(&writer, swiss_old_slot(table, slot), now);
+            }
+        }
+        report.keys = writer.count;
+        report.ok = snapshot_commit(&writer, snapshot_path, hash_kind, hash_seed, log_offset) == 0;
+        report.bytes = writer.bytes;
+    }
+    report.cow_bytes = private_dirty_bytes();
+    int written = write(fd, &report, sizeof(report)) == sizeof(report);
+    // no exit handlers: they belong to the parent
+    _exit(report.ok && written ? 0 : 1);
+}
+
+// the waiter: collect the child's report, reap it, and record how it went
+static void *snapshot_waiter(void *arg) {
+    (void)arg;
+    snapshot_report_t report;
+    size_t got = 0;
+    while (got < sizeof(report)) {
+        ssize_t n = read(snapshot_pipe, (char *)&report + got, sizeof(report) - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;   // the child died without reporting
+        }
+        got += (size_t)n;
+    }
+    int status = 0;
+    while (waitpid(snapshot_pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    close(snapshot_pipe);
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (got == sizeof(report) && report.ok && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        snapshots++;
+        snapshot_keys = report.keys;
+        snapshot_bytes = report.bytes;
+        snapshot_cow_pages = (size_t)(report.cow_bytes / (uint64_t)sysconf(_SC_PAGESIZE));
+        snapshot_us = monotonic_us() - snapshot_start_us;
+    } else {
+        snapshot_failures++;
+    }
+    snapshot_running = 0;
+    pthread_mutex_unlock(&snapshot_lock);
+    return NULL;
+}
+
+int kv_snapshot(void) {
+    if (engine == KV_ENGINE_LOCKFREE) {
+        return KV_UNSUPPORTED;
+    }
+    if (snapshot_path == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&snapshot_lock);
+    if (snapshot_running) {
+        pthread_mutex_unlock(&snapshot_lock);
+        return 1;
+    }
+    if (snapshot_started) {
+        pthread_join(snapshot_thread, NULL);   // the last one's waiter is finished, or about to be
+        snapshot_started = 0;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        snapshot_failures++;
+        pthread_mutex_unlock(&snapshot_lock);
+        return -1;
+    }
+
+    /*
+     * hold every shard while forking, so no change is half made in the
+     * child's copy and every change is either in the snapshot or logged
+     * after its log offset
+     */
+    for (int i = 0; i < num_shards; i++) {
+        shard_write_lock(&shards[i]);
+    }
+    uint64_t log_offset = logging ? wal_position(&wal) : 0;
+    uint64_t start = monotonic_us();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        snapshot_child(fds[1], log_offset);
+    }
+    uint64_t fork_us = monotonic_us() - start;
+    for (int i = 0; i < num_shards; i++) {
+        shard_unlock(&shards[i]);
+    }
+    close(fds[1]);
+
+    if (pid < 0) {
+        close(fds[0]);
+        snapshot_failures++;
+        pthread_mutex_unlock(&snapshot_lock);
+        return -1;
+    }
+    snapshot_pid = pid;
+    snapshot_pipe = fds[0];
+    snapshot_start_us = start;
+    snapshot_fork_us = fork_us;
+    snapshot_running = 1;
+    if (pthread_create(&snapshot_thread, NULL, snapshot_waiter, NULL) != 0) {
+        // no waiter: wait here instead (the snapshot itself is still taken)
+        pthread_mutex_unlock(&snapshot_lock);
+        snapshot_waiter(NULL);
+        return 0;
+    }
+    snapshot_started = 1;
+    pthread_mutex_unlock(&snapshot_lock);
+    return 0;
+}
+
+/*
+ * memory stats, one line of space-separated name=value fields
+ * first what counts against the memory limit (used_memory, max_memory - 0
+ * for none - how many entries have been evicted, and how many new keys the
+ * admission filter has turned away), then how many keys have expired, then
+ * what the log has done (records logged, write() rounds they went out in,
+ * syncs, bytes - all 0 without a log), then how many snapshots have been
+ * written or have failed, whether one is running, and for the last one
+ * written: how long its fork held the store, how many pages were copied on
+ * write while it ran, what it wrote and how fast, then how many keys are
+ * still served from the mapped snapshot and how big its file is (0 for
+ * none), then the slab totals, then one field per size class that owns any pages:
+ *   classN=size:S,pages:P,used:U/I,requested:R
+ * (U of the I items carved so far are in use, holding R bytes of data)
+ * slab_bytes - requested_bytes is everything the allocator costs on top of
+ * the data itself: rounding up to a class, plus items not in use
+ */
+void kv_stats(char *buf, size_t size) {
+    size_t pages = 0, item_bytes = 0, requested = 0;
+    int classes = slab_class_count();
+    slab_class_stats_t stats[SLAB_MAX_CLASSES];
+
+    for (int i = 0; i < classes; i++) {
+        slab_class_stats(i, &stats[i]);
+        pages += stats[i].pages;
+        item_bytes += stats[i].used * stats[i].item_size;
+        requested += stats[i].requested;
+    }
+
+    wal_stats_t log = { 0, 0, 0, 0 };
+    if (logging) {
+        wal_stats(&wal, &log);
+    }
+    pthread_mutex_lock(&snapshot_lock);
+    char snapshot[256];
+    snprintf(snapshot, sizeof(snapshot),
+             "snapshots=%zu snapshot_failures=%zu snapshot_running=%d snapshot_fork_us=%llu "
+             "snapshot_cow_pages=%zu snapshot_keys=%llu snapshot_bytes=%llu snapshot_ms=%llu snapshot_mb_per_sec=%.1f",
+             snapshots, snapshot_failures, snapshot_running, (unsigned long long)snapshot_fork_us,
+             snapshot_cow_pages, (unsigned long long)snapshot_keys, (unsigned long long)snapshot_bytes,
+             (unsigned long long)(snapshot_us / 1000), snapshot_us ? (double)snapshot_bytes / snapshot_us : 0.0);
+    pthread_mutex_unlock(&snapshot_lock);
+
+    size_t slab_bytes = pages * SLAB_PAGE_SIZE;
+    int len = snprintf(buf, size,
+                       "used_memory=%zu max_memory=%zu evictions=%zu rejections=%zu expired=%zu "
+                       "log_records=%zu log_writes=%zu log_syncs=%zu log_bytes=%llu %s mapped_keys=%llu mapped_bytes=%zu "
+                       "slab_pages=%zu slab_bytes=%zu item_bytes=%zu requested_bytes=%zu fragmentation=%.2f",
+                       atomic_load(&used_memory), max_memory, atomic_load(&evictions), atomic_load(&rejections),
+                       atomic_load(&expired),
+                       log.records, log.writes, log.syncs, (unsigned long long)log.bytes, snapshot,
+                       (unsigned long long)atomic_load(&base_remaining), base.size,
+                       pages, slab_bytes, item_bytes, requested,
+                       slab_bytes ? 1.0 - (double)requested / slab_bytes : 0.0);
+    for (int i = 0; i < classes && len >= 0 && (size_t)len < size; i++) {
+        if (stats[i].pages == 0) {
+            continue;
+        }
+        len += snprintf(buf + len, size - len, " class%d=size:%zu,pages:%zu,used:%zu/%zu,requested:%zu",
+                        i, stats[i].item_size, stats[i].pages, stats[i].used, stats[i].items,
+                        stats[i].requested);
+    }
+}
@@ -0,0 +1,367 @@
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kv_hash.h"
+#include "wal.h"
+
+/*
+ * longest key and value we store (anything longer is cut short)
+ * every entry is allocated to fit what it holds, so these only bound a
+ * single command - a 3-byte key doesn't pay for 255 bytes of room
+ */
+#define KV_MAX_KEY 255
+#define KV_MAX_VALUE (8 * 1024)
+
+// longest time to live a key can be given (10 years)
+#define KV_MAX_TTL (10L * 365 * 24 * 60 * 60)
+
+// returned by operations the running engine doesn't support
+#define KV_UNSUPPORTED (-2)
+// returned by kv_incr when the value isn't an integer, or adding to it would overflow
+#define KV_NOT_INTEGER (-3)
+#define KV_OVERFLOW (-4)
+// returned by kv_cas when the key isn't there, or has been changed since its version was read
+#define KV_NOT_FOUND (-5)
+#define KV_CHANGED (-6)
+// returned by a write when the log (see DURABILITY) could not be written or synced
+#define KV_LOG_ERROR (-7)
+
+// room for the text of any int64_t, null included ("-9223372036854775808")
+#define KV_INT_CHARS 21
+
+// default number of independently locked shards the keyspace is split into
+#define KV_DEFAULT_SHARDS 64
+
+/*
+ * how each shard is locked
+ * KV_LOCK_MUTEX: every operation takes the shard exclusively
+ * KV_LOCK_RWLOCK: reader-writer lock - any number of GETs can look at a shard
+ *                 at the same time, only SET and DELETE need it to themselves
+ */
+typedef enum {
+    KV_LOCK_MUTEX,
+    KV_LOCK_RWLOCK
+} kv_lock_mode_t;
+
+/*
+ * how a shard's table grows once it fills up
+ * KV_REHASH_INCREMENTAL: bigger arrays are allocated and the entries move
+ *                        across a few at a time, on every SET and DELETE and
+ *                        from a background thread - no operation ever waits
+ *                        for the whole table to be copied
+ * KV_REHASH_BLOCKING: every entry moves across at once, inside the SET that
+ *                     found the table full
+ */
+typedef enum {
+    KV_REHASH_INCREMENTAL,
+    KV_REHASH_BLOCKING
+} kv_rehash_mode_t;
+
+/*
+ * which implementation holds the keys
+ * KV_ENGINE_SHARDED: swiss tables split into locked shards (kv_store.c)
+ * KV_ENGINE_LOCKFREE: one table whose GETs never take a lock (kv_lockfree.c)
+ */
+typedef enum {
+    KV_ENGINE_SHARDED,
+    KV_ENGINE_LOCKFREE
+} kv_engine_t;
+
+/*
+ * which entries a full store gives up first (only used with a memory limit)
+ * KV_EVICT_LRU: the least recently used of each sample
+ * KV_EVICT_LFU: the least frequently used of each sample, going by a
+ *               count-min sketch (sketch.h) of recent GETs and SETs. on top
+ *               of that, a new key is only let in if it has been asked for
+ *               at least as often as the entry it would push out (TinyLFU
+ *               admission), so a scan over lots of keys that are never
+ *               asked for again can't flush the ones that are
+ */
+typedef enum {
+    KV_EVICT_LRU,
+    KV_EVICT_LFU
+} kv_eviction_t;
+
+/*
+ * everything kv_store_init needs to know
+ * fill it with kv_config_default() and then change what you need
+ */
+typedef struct {
+    kv_engine_t engine;          // which implementation to use
+    int num_shards;              // sharded engine: how many shards
+    kv_lock_mode_t lock_mode;    // sharded engine: how each shard is locked
+    kv_rehash_mode_t rehash;     // sharded engine: how each shard's table grows
+    kv_hash_t hash;              // how keys are hashed (see kv_hash.h)
+    uint64_t hash_seed;          // seed for the hash, 0 = pick a random one at startup
+    size_t max_memory;           // sharded engine: bytes of entries and values to hold, 0 = no limit
+    kv_eviction_t eviction;      // with max_memory: which entries are evicted first
+    const char *log_path;        // sharded engine: write-ahead log file, null = no log
+    wal_fsync_t log_fsync;       // with log_path: when the log is synced to disk
+    int log_fsync_ms;            // with WAL_FSYNC_EVERY: how often, in milliseconds
+    const char *snapshot_path;   // sharded engine: snapshot file to start from and for kv_snapshot, null = none
+    int snapshot_copy;           // with snapshot_path: copy every key in at startup rather than mapping the file
+    int recovery_threads;        // threads that rebuild the store at startup, 0 = one per cpu
+} kv_config_t;
+
+/*
+ * MEMORY LIMIT
+ * with max_memory set the store works as a bounded cache. every entry and
+ * spilled value is counted at the size the slab allocator really gives it,
+ * and a SET that would take the total past max_memory first evicts entries
+ * until it fits. the victim is picked by sampled, approximate LRU: every
+ * entry records when it was last read or written, and each eviction looks
+ * at KV_EVICTION_SAMPLES entries of a random shard and drops the one that
+ * has gone unused the longest (or, with KV_EVICT_LFU, the one used least
+ * often). the tables' own slot arrays are not counted
+ */
+#define KV_EVICTION_SAMPLES 5
+// KV_EVICT_LFU: one word of frequency sketch per this many bytes of limit (so the sketch costs 1/32 of it)
+#define KV_SKETCH_BYTES_PER_WORD 256
+
+/*
+ * DURABILITY
+ * with log_path set, every change is appended to a write-ahead log (wal.h)
+ * as the state it left its key in, and kv_store_init replays the log
+ * before anything else runs, so the keys survive a restart. each change is
+ * logged while its shard is still locked, so two changes to the same key
+ * are logged in the order they were made. the keys a memory limit evicts
+ * are logged as deleted; keys that expire are not - their records carry
+ * the time they expire, and replay leaves out the ones that have.
+ * how much a crash can lose depends on log_fsync: with WAL_FSYNC_ALWAYS a
+ * write only returns once its record is on disk (writes from many clients
+ * share each sync); with WAL_FSYNC_EVERY up to about log_fsync_ms; with
+ * WAL_FSYNC_NO whatever the os hadn't written back yet.
+ * if the log can't be written, every call that changes the store (kv_set,
+ * kv_set_expire, kv_expire, kv_incr, kv_cas, kv_delete, kv_mset, kv_mdel)
+ * returns KV_LOG_ERROR from then on - the change may have been made in
+ * memory, but it won't survive a restart.
+ * the log is never rewritten, so it grows by every change made.
+ * only the sharded engine can keep a log
+ */
+// default for log_fsync_ms
+#define KV_DEFAULT_FSYNC_MS 1000
+
+/*
+ * fill config with the defaults (sharded engine, KV_DEFAULT_SHARDS mutex-locked
+ * shards, incremental rehashing, KV_DEFAULT_HASH with a random seed, no
+ * memory limit, LRU eviction once one is set, no log, synced every
+ * KV_DEFAULT_FSYNC_MS once there is one, no snapshot file)
+ */
+void kv_config_default(kv_config_t *config);
+
+/*
+ * set up the store as config describes
+ * must be called once, before any other kv_ function
+ * with snapshot_path set, the snapshot there is loaded first, and then the
+ * log (if there is one) is replayed from where the snapshot left off
+ * returns 0 on success, -1 if memory could not be allocated, the snapshot
+ * or the log could not be read (or the log opened), or the config asks for
+ * something the engine can't do (a memory limit, a log or a snapshot on
+ * the lock-free engine)
+ */
+int kv_store_init(const kv_config_t *config);
+
+/*
+ * free every entry and the shards themselves (and sync and close the log)
+ * no other kv_ function may be running; kv_store_init can be called again after
+ */
+void kv_store_destroy(void);
+
+/*
+ * store value under key, replacing any value that was there
+ * with a memory limit, entries are evicted first to make room
+ * returns 0 on success, 1 if the key was new and the admission filter
+ * turned it away (KV_EVICT_LFU), -1 if memory could not be allocated (or
+ * nothing is left to evict and it still doesn't fit)
+ */
+int kv_set(const char *key, const char *value);
+
+/*
+ * EXPIRY
+ * a key can be given a time to live, after which it is gone as if it had
+ * been deleted. an expired key is removed lazily by the first GET, SET or
+ * DELETE that comes across it, and actively by a background thread that
+ * runs each shard's timer wheel (wheel.h) every WHEEL_TICK_MS, so keys
+ * nobody asks for again don't sit there using memory. a plain SET clears
+ * any time to live the key had. only the sharded engine can expire keys;
+ * on the lock-free engine these return KV_UNSUPPORTED
+ */
+
+/*
+ * store value under key, to expire seconds (1 to KV_MAX_TTL) from now
+ * returns what kv_set returns, or KV_UNSUPPORTED
+ */
+int kv_set_expire(const char *key, const char *value, long seconds);
+
+/*
+ * give an existing key a time to live of seconds from now (0 or less
+ * deletes it right away, at most KV_MAX_TTL)
+ * returns 1 if the key was there, 0 if it wasn't, -1 if memory could not
+ * be allocated, or KV_UNSUPPORTED
+ */
+int kv_expire(const char *key, long seconds);
+
+/*
+ * how long key has left to live, in whole seconds (rounded), or -1 if it
+ * never expires
+ * returns 1 and fills *seconds if the key was there, 0 if it wasn't, or
+ * KV_UNSUPPORTED
+ */
+int kv_ttl(const char *key, long *seconds);
+
+/*
+ * COUNTERS
+ * add delta to the integer stored under key, in one step inside the store,
+ * so no other client can slip in between reading the value and writing it
+ * back. a missing (or expired) key counts as 0 and is created without an
+ * expiry; an existing key keeps its expiry.
+ * returns 0 and fills *value with the new value on success, KV_NOT_INTEGER
+ * if the key holds something other than an integer, KV_OVERFLOW if the
+ * result wouldn't fit in 64 bits (the value is left alone either way), or
+ * -1 if memory could not be allocated
+ */
+int kv_incr(const char *key, int64_t delta, int64_t *value);
+
+/*
+ * is text (len bytes) exactly how a 64-bit integer is written: an optional
+ * minus, then digits with no leading zeros ("0", "42", "-7", but not "+7",
+ * "007", "-0" or " 7")? only then does printing the integer give back the
+ * same text, which is what lets such values be stored as integers
+ * returns 1 and fills *value if so, 0 if not
+ */
+int kv_parse_int(const char *text, size_t len, int64_t *value);
+
+/*
+ * write value as decimal text into buf (KV_INT_CHARS bytes, null-terminated)
+ * returns the length of the text
+ */
+size_t kv_format_int(int64_t value, char *buf);
+
+/*
+ * look up key and copy its value into value (at most size - 1 characters,
+ * always null-terminated)
+ * returns 1 if the key was found, 0 if it wasn't
+ */
+int kv_get(const char *key, char *value, size_t size);
+
+/*
+ * VERSIONS (compare-and-swap)
+ * every value a key is given (by SET, INCR or CAS) comes with a new version
+ * number, higher than any other its shard has handed out. a client can read
+ * a key with kv_gets, work out a new value without holding anything in the
+ * store, and write it back with kv_cas, which only stores it if the key
+ * still has the version that was read - so two clients updating the same
+ * key at once can't lose either update; one of them just gets KV_CHANGED
+ * and tries again. a key that is deleted and set again gets a new version
+ * too, so an old one can never match it by accident. versions are never 0
+ */
+
+// like kv_get, and also fills *version with the version of the value copied
+int kv_gets(const char *key, char *value, size_t size, uint64_t *version);
+
+/*
+ * store value under key, but only if its version is still version
+ * the key keeps any time to live it had (like kv_incr)
+ * returns 0 on success, KV_CHANGED if the key has been given another value
+ * since, KV_NOT_FOUND if it isn't there (or has expired), or -1 if memory
+ * could not be allocated
+ */
+int kv_cas(const char *key, const char *value, uint64_t version);
+
+/*
+ * remove key from the store
+ * returns 1 if the key was there, 0 if it wasn't
+ */
+int kv_delete(const char *key);
+
+/*
+ * BATCHES
+ * kv_mget, kv_mset and kv_mdel work on many keys in one call, taken
+ * KV_BATCH_MAX at a time. each batch is sorted by shard, and each shard is
+ * locked once for all of its keys in the batch instead of once per key. while one key is being
+ * looked up, the next few in the same shard are already being fetched into
+ * the cache (see swiss_prefetch), so a batch's cache misses overlap instead
+ * of being waited for one after another. a batch is not one atomic step:
+ * each shard's part of it is, but another client may see one shard's keys
+ * change before another's. the lock-free engine runs the keys one by one
+ */
+#define KV_BATCH_MAX 256
+
+/*
+ * look up count keys, copying the values found into buf (size bytes) one
+ * after another, each null-terminated. values[i] is set to where keys[i]'s
+ * value was copied, or null if it isn't there
+ * returns how many keys were found, or -1 if buf is too small for them all
+ */
+int kv_mget(const char *const *keys, size_t count, const char **values, char *buf, size_t size);
+
+/*
+ * store values[i] under keys[i] for each of count keys, as kv_set would (a
+ * key listed twice ends up with the later value)
+ * returns 0 if they were all stored, 1 if the admission filter turned any
+ * away, or -1 if memory ran out (some of the keys may have been stored)
+ */
+int kv_mset(const char *const *keys, const char *const *values, size_t count);
+
+/*
+ * remove count keys from the store
+ * returns how many of them were there
+ */
+int kv_mdel(const char *const *keys, size_t count);
+
+/*
+ * SNAPSHOTS
+ * kv_snapshot writes every key to config's snapshot_path without stopping
+ * the store for more than a moment. it write-locks every shard, forks, and
+ * lets go again: the child process sees the store exactly as it was at
+ * the fork, and writes it out (snapshot.h) while the parent carries on.
+ * the two share their memory copy-on-write, so a page is only copied when
+ * the parent changes it while the child still needs the old one - the
+ * cost of a snapshot is the fork itself (copying the page tables, which
+ * grows with the store; every write waits for it) plus one copy of every
+ * page written to while the child runs. kv_stats reports both, and how
+ * fast the file was written, for the last snapshot taken.
+ * the file is laid out to be used where it lies (see snapshot.h): at
+ * startup kv_store_init maps it rather than reading it, so the store can
+ * serve straight away, and only the parts of it that are asked for are
+ * ever read from disk. a lookup that misses its table looks the key up in
+ * the file, and the first write to a key found there copies it into the
+ * table (a SET that replaces it, or a DELETE, just marks the record as
+ * gone). this needs the keys hashed as the file's were - the same hash,
+ * and a hash_seed of 0 (the file's is then used) or the file's own - and
+ * no max_memory, since mapped keys can't be counted or evicted; otherwise
+ * (or with snapshot_copy) every key is copied into the tables at startup
+ * instead
+ *
+ * RECOVERY
+ * startup splits its work across recovery_threads threads. copying a
+ * snapshot in, each thread takes chunks of the file (see snapshot.h) in
+ * turn and adds their keys to the shards, whose tables are sized for them
+ * up front (a key that can't be stored - memory ran out, or LFU turned it
+ * away under max_memory - fails kv_store_init). replaying the log, one thread reads it and deals each record
+ * out to the thread that owns its key's shard, a round of records at a
+ * time; since a key always goes to the same thread, the changes to it are
+ * redone in the order they were logged, and keys in different shards
+ * never depended on each other's order to begin with
+ */
+
+/*
+ * start a snapshot in the background
+ * returns 0 once the child is running, 1 if a snapshot is already being
+ * taken, -1 if there is no snapshot_path or the fork failed, or
+ * KV_UNSUPPORTED on the lock-free engine
+ */
+int kv_snapshot(void);
+
+/*
+ * write a one-line summary of the store's memory use into buf (at most
+ * size - 1 characters, always null-terminated): what counts against the
+ * memory limit, what the log has written, how the last snapshot went,
+ * how much the slab allocator holds, and how full and how wasteful each
+ * size class is
+ */
+void kv_stats(char *buf, size_t size);
+
+#endif
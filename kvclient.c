@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "kvclient.h"
+
+int kv_client_connect(kv_client_t *client, const char *host, int port) {
+    struct sockaddr_in server_addr;   // structure to hold the server's network address
+
+    client->len = 0;
+    client->discard = 0;
+    client->out_len = 0;
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->fd < 0) {
+        return -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));  // zero out the structure
+    server_addr.sin_family = AF_INET;               // use ipv4
+    server_addr.sin_port = htons(port);             // convert port number to network byte order
+
+    // convert the text address to binary, then open the tcp connection
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        close(client->fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (connect(client->fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        int saved = errno;
+        close(client->fd);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * write len bytes to the socket, however many write() calls it takes
+ * returns 0 on success, -1 on failure
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int kv_client_send(kv_client_t *client, const char *command) {
+    size_t len = strlen(command);
+
+    // no room left for this command (and its newline)? send what's queued first
+    if (client->out_len + len + 1 > sizeof(client->out)) {
+        if (kv_client_flush(client) < 0) {
+            return -1;
+        }
+    }
+
+    // a command bigger than the whole queue just goes straight out
+    if (len + 1 > sizeof(client->out)) {
+        if (write_all(client->fd, command, len) < 0) {
+            return -1;
+        }
+        return write_all(client->fd, "\n", 1);
+    }
+
+    memcpy(client->out + client->out_len, command, len);
+    client->out[client->out_len + len] = '\n';
+    client->out_len += len + 1;
+    return 0;
+}
+
+int kv_client_flush(kv_client_t *client) {
+    if (client->out_len == 0) {
+        return 0;
+    }
+    int result = write_all(client->fd, client->out, client->out_len);
+    client->out_len = 0;
+    return result;
+}
+
+int kv_client_read_reply(kv_client_t *client, char *reply, size_t size) {
+    // the server can't answer commands that are still sitting in our queue
+    if (kv_client_flush(client) < 0) {
+        return -1;
+    }
+
+    while (1) {
+        // a full reply already buffered? hand it back and keep the rest for next time
+        char *newline = memchr(client->buffer, '\n', client->len);
+        if (newline != NULL && client->discard) {
+            // tail end of an over-long reply that was already returned
+            client->len -= newline - client->buffer + 1;
+            memmove(client->buffer, newline + 1, client->len);
+            client->discard = 0;
+            continue;
+        }
+        if (newline == NULL && client->discard) {
+            client->len = 0;
+        }
+        if (newline != NULL) {
+            size_t line_len = newline - client->buffer;
+            size_t copy = line_len < size - 1 ? line_len : size - 1;
+            memcpy(reply, client->buffer, copy);
+            reply[copy] = '\0';
+            client->len -= line_len + 1;
+            memmove(client->buffer, newline + 1, client->len);
+            return 0;
+        }
+
+        /*
+         * a reply too long for our buffer: return the part we have and
+         * throw away the rest of that line as it arrives
+         */
+        if (client->len == sizeof(client->buffer)) {
+            size_t copy = client->len < size - 1 ? client->len : size - 1;
+            memcpy(reply, client->buffer, copy);
+            reply[copy] = '\0';
+            client->len = 0;
+            client->discard = 1;
+            return 0;
+        }
+
+        ssize_t n = read(client->fd, client->buffer + client->len,
+                         sizeof(client->buffer) - client->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;  // error, or the server closed the connection
+        }
+        client->len += n;
+    }
+}
+
+int kv_client_command(kv_client_t *client, const char *command, char *reply, size_t size) {
+    if (kv_client_send(client, command) < 0) {
+        return -1;
+    }
+    return kv_client_read_reply(client, reply, size);
+}
+
+void kv_client_close(kv_client_t *client) {
+    close(client->fd);
+    client->fd = -1;
+}
@@ -0,0 +1,65 @@
+#ifndef KVCLIENT_H
+#define KVCLIENT_H
+
+#include <stddef.h>
+
+// size of the buffer used to collect replies from the server (big enough for the longest value)
+#define KV_CLIENT_BUFFER_SIZE (16 * 1024)
+// size of the buffer that queues up commands before they are sent
+#define KV_CLIENT_OUT_SIZE (16 * 1024)
+
+/*
+ * a connection to the key-value server
+ * the same connection is reused for every command, so we only pay for the
+ * tcp handshake once. replies are newline-terminated lines and may arrive
+ * in pieces (or several at once), so bytes that have been received but not
+ * handed back yet are kept in buffer.
+ * commands are queued in out and sent together, so many commands can be
+ * pipelined (sent back-to-back before reading any replies) in one write()
+ */
+typedef struct {
+    int fd;                               // the connected socket
+    char buffer[KV_CLIENT_BUFFER_SIZE];   // received bytes not yet returned as replies
+    size_t len;                           // how many bytes are in buffer
+    int discard;                          // skipping the rest of a reply that was too long
+    char out[KV_CLIENT_OUT_SIZE];         // queued commands that haven't been sent yet
+    size_t out_len;                       // how many bytes are queued in out
+} kv_client_t;
+
+/*
+ * connect to the server at host:port (host is a dotted ip like "127.0.0.1")
+ * returns 0 on success, -1 on failure (errno says why)
+ */
+int kv_client_connect(kv_client_t *client, const char *host, int port);
+
+/*
+ * queue one command (like "SET name Hong") without waiting for the reply
+ * the newline that ends the command is added for you. queued commands are
+ * sent when the queue fills up, on kv_client_flush(), or when a reply is read
+ * returns 0 on success, -1 on failure
+ */
+int kv_client_send(kv_client_t *client, const char *command);
+
+/*
+ * send every queued command to the server now
+ * returns 0 on success, -1 on failure
+ */
+int kv_client_flush(kv_client_t *client);
+
+/*
+ * wait for the next reply (in the order the commands were sent) and copy it (without the newline) into reply
+ * replies longer than size - 1 are cut short
+ * returns 0 on success, -1 on failure or if the server closed the connection
+ */
+int kv_client_read_reply(kv_client_t *client, char *reply, size_t size);
+
+/*
+ * send a command and wait for its reply - the usual one-at-a-time round trip
+ * returns 0 on success, -1 on failure
+ */
+int kv_client_command(kv_client_t *client, const char *command, char *reply, size_t size);
+
+// close the connection
+void kv_client_close(kv_client_t *client);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "kv_store.h"
+
+/*
+ * recovery benchmark
+ * builds a store of --keys keys with a write-ahead log, snapshots it, and
+ * changes --tail keys after the snapshot so the log has a tail to replay.
+ * then it restarts the store over and over and times each start: with the
+ * snapshot mapped, and with it copied in, on 1, 2, 4 ... --threads recovery
+ * threads - and, after each start, how long the first random GETs take,
+ * since a mapped snapshot pays for its keys then instead. before each start
+ * the files are dropped from the page cache, so they are read from disk:
+ *   ./recovery_bench                         10 million keys
+ *   ./recovery_bench --keys 100000000 --dir /data
+ *                                            100 million: a 10 GB snapshot, and more memory than that
+ */
+
+#define DEFAULT_KEYS 10000000
+// GETs timed after each start
+#define READS 1000000
+
+static int num_keys;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void store_init(const kv_config_t *config) {
+    if (kv_store_init(config) < 0) {
+        fprintf(stderr, "failed to set up the store\n");
+        exit(1);
+    }
+}
+
+// the value key i is given: "v<i>" at first, "t<i>" once the tail has changed it
+static void make_value(char *value, size_t size, char kind, int i) {
+    snprintf(value, size, "%c%d-%s", kind, i, "abcdefghijklmnopqrstuvwxyz");
+}
+
+// a key the tail changes: every (num_keys / tail)th one
+static int in_tail(int i, int tail) {
+    return tail > 0 && i % (num_keys / tail) == 0 && i / (num_keys / tail) < tail;
+}
+
+static int snapshot_running(void) {
+    char stats[4096];
+    kv_stats(stats, sizeof(stats));
+    return strstr(stats, "snapshot_running=1") != NULL;
+}
+
+// fill the store, snapshot it, change the tail after the snapshot, and shut it down
+static void build(const kv_config_t *config, int tail) {
+    unlink(config->log_path);
+    unlink(config->snapshot_path);
+    store_init(config);
+    char key[32], value[64];
+    double start = now_seconds();
+    for (int i = 0; i < num_keys; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        make_value(value, sizeof(value), 'v', i);
+        kv_set(key, value);
+    }
+    printf("filled %d keys in %.1f s\n", num_keys, now_seconds() - start);
+
+    start = now_seconds();
+    if (kv_snapshot() != 0) {
+        fprintf(stderr, "snapshot failed to start\n");
+        exit(1);
+    }
+    while (snapshot_running()) {
+        usleep(10000);
+    }
+    printf("snapshot written in %.1f s\n", now_seconds() - start);
+
+    for (int i = 0; i < num_keys; i++) {
+        if (in_tail(i, tail)) {
+            snprintf(key, sizeof(key), "key:%d", i);
+            make_value(value, sizeof(value), 't', i);
+            kv_set(key, value);
+        }
+    }
+    kv_store_destroy();
+}
+
+// drop a file from the page cache (it has been synced, so its pages are clean)
+static void drop_cached(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/*
+ * GET READS random keys, checking each one's value
+ * returns how long they took, in seconds
+ */
+static double time_reads(int tail) {
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    char key[32], expected[64], value[KV_MAX_VALUE + 1];
+    double start = now_seconds();
+    for (int n = 0; n < READS; n++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        int i = (int)(rng % (uint64_t)num_keys);
+        snprintf(key, sizeof(key), "key:%d", i);
+        make_value(expected, sizeof(expected), in_tail(i, tail) ? 't' : 'v', i);
+        if (!kv_get(key, value, sizeof(value)) || strcmp(value, expected) != 0) {
+            fprintf(stderr, "%s came back wrong after recovery\n", key);
+            exit(1);
+        }
+    }
+    return now_seconds() - start;
+}
+
+// the thread counts tried: 1, 2, 4 ... and then max_threads itself, even if it isn't a power of two
+static int next_threads(int threads, int max_threads) {
+    if (threads < max_threads && threads * 2 > max_threads) {
+        return max_threads;
+    }
+    return threads * 2;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  --keys N      keys in the store (default %d)\n", DEFAULT_KEYS);
+    fprintf(stderr, "  --tail N      keys changed after the snapshot, for the log to replay (default keys / 10)\n");
+    fprintf(stderr, "  --threads N   most recovery threads to try (default: number of cpus)\n");
+    fprintf(stderr, "  --dir DIR     where the log and snapshot go (default /tmp)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int tail = -1;
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *dir = "/tmp";
+    num_keys = DEFAULT_KEYS;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        if (strcmp(argv[i], "--keys") == 0) {
+            num_keys = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tail") == 0) {
+            tail = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            max_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dir") == 0) {
+            dir = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (tail < 0) {
+        tail = num_keys / 10;
+    }
+    if (num_keys <= 0 || tail > num_keys || max_threads <= 0) {
+        usage(argv[0]);
+    }
+
+    char log_path[4096], snapshot_path[4096];
+    snprintf(log_path, sizeof(log_path), "%s/recovery_bench.log", dir);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/recovery_bench.snap", dir);
+    kv_config_t config;
+    kv_config_default(&config);
+    config.log_path = log_path;
+    config.log_fsync = WAL_FSYNC_NO;   // building the store isn't what's being measured
+    config.snapshot_path = snapshot_path;
+    build(&config, tail);
+
+    printf("\n%d keys in the snapshot, %d changed in the log after it\n", num_keys, tail);
+    printf("%8s %8s %12s %14s\n", "load", "threads", "startup ms", "first GETs ms");
+    for (int copy = 0; copy <= 1; copy++) {
+        for (int threads = 1; threads <= max_threads; threads = next_threads(threads, max_threads)) {
+            config.snapshot_copy = copy;
+            config.recovery_threads = threads;
+            drop_cached(snapshot_path);
+            drop_cached(log_path);
+
+            double start = now_seconds();
+            store_init(&config);
+            double startup = now_seconds() - start;
+            double reads = time_reads(tail);
+            kv_store_destroy();
+
+            printf("%8s %8d %12.1f %14.1f\n", copy ? "copy" : "map", threads, startup * 1e3, reads * 1e3);
+            fflush(stdout);
+        }
+    }
+
+    unlink(log_path);
+    unlink(snapshot_path);
+    return 0;
+}
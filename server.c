@@ -1,87 +1,230 @@
+#define _GNU_SOURCE  // for accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
 #include <pthread.h>
-#include "uthash.h"
+#include "kv_store.h"
+#include "threadpool.h"
 
 // port number the server will listen on
 #define PORT 8888
-// size of buffer for reading/writing data
-#define BUFFER_SIZE 1024
+// longest command line (and reply) we handle: a SET of the longest key and value, plus the command and spaces
+#define BUFFER_SIZE (KV_MAX_KEY + KV_MAX_VALUE + 64)
+// size of each connection's input buffer (room for a burst of pipelined commands)
+#define READ_BUFFER_SIZE (2 * BUFFER_SIZE)
+// reply space for one writev() batch of pipelined commands
+#define BATCH_BYTES (16 * BUFFER_SIZE)
+// most replies in one batch (each uses 2 iovecs, well under the kernel's IOV_MAX)
+#define BATCH_REPLIES 256
+// how many ready events a single epoll_wait() call can hand back
+#define MAX_EVENTS 1024
+// default number of worker threads and queued connections in pool mode
+#define DEFAULT_WORKERS 32
+#define DEFAULT_QUEUE_SIZE 1024
+
+// the ways the server can hand out connections (picked with --mode)
+typedef enum {
+    MODE_THREADS,   // a new thread for every connection
+    MODE_EPOLL,     // one thread, an epoll event loop over every connection
+    MODE_POOL       // a fixed pool of worker threads fed by a bounded queue
+} server_mode_t;
+
+// the --snapshot file (null if there isn't one), for SNAPSHOT's error reply
+static const char *store_snapshot = NULL;
 
 /*
- * hash table entry structure
- * this is what gets stored in our key-value store
- * each entry has a key, a value, and a special field (hh) that uthash needs
+ * split the next word off the front of *rest
+ * words are separated by spaces or tabs. the word is null-terminated in
+ * place, its length goes in *len, and *rest moves on past it
+ * returns NULL once there are no words left
  */
-typedef struct {
-    char key[256];        // the key (like "name")
-    char value[256];      // the value (like "Hong")
-    UT_hash_handle hh;    // special field required by uthash library to make this hashable
-} kv_entry_t;
+char *next_word(char **rest, size_t *len) {
+    char *word = *rest + strspn(*rest, " \t");
+    if (*word == '\0') {
+        return NULL;
+    }
+    *len = strcspn(word, " \t");
+    *rest = word + *len;
+    if (**rest != '\0') {
+        *(*rest)++ = '\0';
+    }
+    return word;
+}
 
-// global hash table - this is where all key-value pairs are stored
-// starts as null (empty) and gets entries added as clients send SET commands
-kv_entry_t *kv_store = NULL;
+/*
+ * read the seconds of a "SET key value EX seconds"
+ * returns them (1 to KV_MAX_TTL), or 0 if they aren't a number in that range
+ */
+long parse_ttl(const char *text) {
+    char *end;
+    long seconds = strtol(text, &end, 10);
+    if (*end != '\0' || seconds <= 0 || seconds > KV_MAX_TTL) {
+        return 0;
+    }
+    return seconds;
+}
+
+// run an INCR-style command and write its reply
+void counter_command(const char *key, int64_t delta, char *response) {
+    int64_t value;
+    int result = kv_incr(key, delta, &value);
+    if (result == 0) {
+        kv_format_int(value, response);
+    } else if (result == KV_NOT_INTEGER) {
+        strcpy(response, "ERROR value is not an integer");
+    } else if (result == KV_OVERFLOW) {
+        strcpy(response, "ERROR increment or decrement would overflow");
+    } else if (result == KV_LOG_ERROR) {
+        strcpy(response, "ERROR log write failed");
+    } else {
+        strcpy(response, "ERROR out of memory");
+    }
+}
 
 /*
- * mutex (mutual exclusion lock)
- * this protects the hash table from race conditions when multiple threads
- * try to access it at the same time. think of it like a bathroom key -
- * only one thread can "have the key" (be locked) at a time, so only one
- * thread can modify the hash table at a time. this prevents data corruption.
+ * run an MGET, MSET or MDEL and write its reply
+ * rest is everything after the command word: up to KV_BATCH_MAX keys (for
+ * MSET, key value pairs), which the store handles as one batch
  */
-pthread_mutex_t kv_mutex = PTHREAD_MUTEX_INITIALIZER;
+void batch_command(const char *cmd, char *rest, char *response) {
+    int pairs = strcmp(cmd, "MSET") == 0;
+    const char *keys[KV_BATCH_MAX], *values[KV_BATCH_MAX];
+    size_t count = 0, len;
+    char *word;
+    while ((word = next_word(&rest, &len)) != NULL) {
+        if (count == KV_BATCH_MAX) {
+            strcpy(response, "ERROR too many keys");
+            return;
+        }
+        if (len > KV_MAX_KEY) {
+            strcpy(response, "ERROR key too long");
+            return;
+        }
+        keys[count] = word;
+        if (pairs) {
+            if ((word = next_word(&rest, &len)) == NULL) {
+                strcpy(response, "ERROR");   // a key with no value
+                return;
+            }
+            if (len > KV_MAX_VALUE) {
+                strcpy(response, "ERROR value too long");
+                return;
+            }
+            values[count] = word;
+        }
+        count++;
+    }
+    if (count == 0) {
+        strcpy(response, "ERROR");
+        return;
+    }
+
+    if (strcmp(cmd, "MGET") == 0) {
+        /*
+         * the store copies the values out in whatever order it visits the
+         * shards, so they are joined up in key order afterwards, one space
+         * apart, with NOT_FOUND for a missing key (what GET would reply)
+         */
+        char found[BUFFER_SIZE];
+        size_t used = 0;
+        if (kv_mget(keys, count, values, found, sizeof(found)) < 0) {
+            strcpy(response, "ERROR reply too long");
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            const char *value = values[i] != NULL ? values[i] : "NOT_FOUND";
+            size_t value_len = strlen(value);
+            if (used + 1 + value_len >= BUFFER_SIZE) {
+                strcpy(response, "ERROR reply too long");
+                return;
+            }
+            if (i > 0) {
+                response[used++] = ' ';
+            }
+            memcpy(response + used, value, value_len);
+            used += value_len;
+        }
+        response[used] = '\0';
+    } else if (pairs) {
+        int stored = kv_mset(keys, values, count);
+        if (stored == 0) {
+            strcpy(response, "OK");
+        } else if (stored > 0) {
+            strcpy(response, "NOT_STORED");   // some of the keys were turned away, see SET
+        } else if (stored == KV_LOG_ERROR) {
+            strcpy(response, "ERROR log write failed");
+        } else {
+            strcpy(response, "ERROR out of memory");
+        }
+    } else {
+        // how many of the keys were there
+        int found = kv_mdel(keys, count);
+        if (found == KV_LOG_ERROR) {
+            strcpy(response, "ERROR log write failed");
+        } else {
+            snprintf(response, BUFFER_SIZE, "%d", found);
+        }
+    }
+}
 
 /*
- * function that handles each client connection
- * this function runs in a separate thread for each client
- * the arg parameter contains the client's socket file descriptor
+ * function that runs one command against the hash table
+ * line holds the null-terminated command text (like "SET name Hong"), which
+ * is split up in place, and the reply is written into response, which must
+ * hold BUFFER_SIZE bytes
+ * this is shared by every server mode so they all speak the same protocol
  */
-void* handle_client(void* arg) {
-    // extract the client socket file descriptor from the argument
-    // we passed a pointer to an int, so we need to dereference it
-    int client_fd = *(int*)arg;
-    char buffer[BUFFER_SIZE];      // buffer to read incoming commands from client
-    char response[BUFFER_SIZE];    // buffer to store response we'll send back
-    
+void process_command(char *line, char *response) {
     /*
-     * read the command from the client
-     * read() blocks (waits) until data arrives from the client
-     * BUFFER_SIZE - 1 leaves room for the null terminator '\0'
+     * parse the command string
+     * commands are space-delimited like "SET name Hong" or "GET name"
+     * the words are left where they are in line rather than copied out,
+     * so a multi-kilobyte value is never copied before the store copies it.
+     * parsed tells us how many words there were (extra words are ignored;
+     * the most any command takes is "SET key value EX seconds", apart from
+     * MGET, MSET and MDEL, which are handed to batch_command)
      */
-    ssize_t bytes_read = read(client_fd, buffer, BUFFER_SIZE - 1);
-    // if read failed or connection closed, clean up and exit this thread
-    if (bytes_read <= 0) {
-        close(client_fd);  // close the socket
-        free(arg);         // free the memory we allocated for the file descriptor
-        return NULL;       // exit this thread
+    char *words[5] = { NULL, NULL, NULL, NULL, NULL };
+    size_t lengths[5] = { 0, 0, 0, 0, 0 };
+    int parsed = 0;
+    while (parsed < 5 && (words[parsed] = next_word(&line, &lengths[parsed])) != NULL) {
+        parsed++;
+        // the batch commands take any number of words, so they split up the rest themselves
+        if (parsed == 1 && (strcmp(words[0], "MGET") == 0 || strcmp(words[0], "MSET") == 0 ||
+                            strcmp(words[0], "MDEL") == 0)) {
+            batch_command(words[0], line, response);
+            return;
+        }
     }
-    
-    // add null terminator to make it a proper c string
-    // this tells c where the string ends
-    buffer[bytes_read] = '\0';
-    
+    const char *cmd = parsed >= 1 ? words[0] : "";
+    const char *key = words[1], *value = words[2];
+
     /*
-     * parse the command string
-     * commands are space-delimited like "SET name Hong" or "GET name"
-     * sscanf reads formatted input from the buffer string
-     * %31s means read up to 31 characters (leaving room for null terminator)
-     * parsed tells us how many items were successfully read
+     * a key or value that is too long is refused outright - the store
+     * would have to cut it short, and then GET would hand back something
+     * other than what was SET
      */
-    char cmd[32], key[256], value[256];
-    int parsed = sscanf(buffer, "%31s %255s %255s", cmd, key, value);
+    if (parsed >= 2 && lengths[1] > KV_MAX_KEY) {
+        strcpy(response, "ERROR key too long");
+        return;
+    }
+    if (parsed >= 3 && lengths[2] > KV_MAX_VALUE) {
+        strcpy(response, "ERROR value too long");
+        return;
+    }
     
     /*
-     * MUTEX LOCK 
-     * lock the mutex before accessing the hash table
-     * this ensures only one thread can modify the hash table at a time
-     * if another thread already has the lock, this thread will wait here
+     * the store does its own locking (see kv_store.c), so nothing is
+     * locked here - only the shard that owns the key is locked, and only
+     * for the lookup itself, never while the response is being built
      */
-    pthread_mutex_lock(&kv_mutex);
     
     /*
      * handle SET command: store a key-value pair
@@ -89,30 +232,32 @@ void* handle_client(void* arg) {
      * parsed >= 3 means we got command, key, and value
      */
     if (strcmp(cmd, "SET") == 0 && parsed >= 3) {
-        kv_entry_t *entry;
-        // search the hash table to see if this key already exists
-        HASH_FIND_STR(kv_store, key, entry);
-        
-        if (entry) {
-            // key already exists, so update the existing value
-            // strncpy safely copies the value, limiting the size to prevent overflow
-            strncpy(entry->value, value, sizeof(entry->value) - 1);
-            // ensure null terminator is in place
-            entry->value[sizeof(entry->value) - 1] = '\0';
+        /*
+         * "SET name Hong EX 60" also gives the key 60 seconds to live
+         * (anything after the value other than EX seconds is an error)
+         */
+        long seconds = 0;
+        if (parsed > 3 && (parsed != 5 || strcmp(words[3], "EX") != 0)) {
+            strcpy(response, "ERROR");
+            return;
+        }
+        if (parsed == 5 && (seconds = parse_ttl(words[4])) <= 0) {
+            strcpy(response, "ERROR invalid expire time");
+            return;
+        }
+        int stored = seconds > 0 ? kv_set_expire(key, value, seconds) : kv_set(key, value);
+        if (stored == 0) {
+            strcpy(response, "OK");
+        } else if (stored == KV_UNSUPPORTED) {
+            strcpy(response, "ERROR unsupported");
+        } else if (stored > 0) {
+            // over the memory limit, and the key is asked for less than anything it could replace
+            strcpy(response, "NOT_STORED");
+        } else if (stored == KV_LOG_ERROR) {
+            strcpy(response, "ERROR log write failed");
         } else {
-            // key doesn't exist, so create a new entry
-            // allocate memory for the new entry
-            entry = (kv_entry_t*)malloc(sizeof(kv_entry_t));
-            // copy the key into the entry
-            strncpy(entry->key, key, sizeof(entry->key) - 1);
-            entry->key[sizeof(entry->key) - 1] = '\0';
-            // copy the value into the entry
-            strncpy(entry->value, value, sizeof(entry->value) - 1);
-            entry->value[sizeof(entry->value) - 1] = '\0';
-            // add the entry to the hash table
-            HASH_ADD_STR(kv_store, key, entry);
-        }
-        strcpy(response, "OK");
+            strcpy(response, "ERROR out of memory");
+        }
         
     /*
      * handle GET command: retrieve a value for a key
@@ -120,18 +265,58 @@ void* handle_client(void* arg) {
      * parsed >= 2 means we got command and key
      */
     } else if (strcmp(cmd, "GET") == 0 && parsed >= 2) {
-        kv_entry_t *entry;
-        // search the hash table for the key
-        HASH_FIND_STR(kv_store, key, entry);
-        
-        if (entry) {
-            // key found, copy the value to the response
-            strncpy(response, entry->value, sizeof(response) - 1);
-            response[sizeof(response) - 1] = '\0';
-        } else {
+        // the value is copied straight into the response
+        if (!kv_get(key, response, BUFFER_SIZE)) {
             // key not found in the hash table
             strcpy(response, "NOT_FOUND");
         }
+
+    /*
+     * handle GETS command: a GET that also replies with the value's version
+     * example: "GETS name" replies "7 Hong", and "CAS name 7 ..." then only
+     * stores its value if nobody has changed "name" since
+     */
+    } else if (strcmp(cmd, "GETS") == 0 && parsed >= 2) {
+        // the value is copied into the response past where the version will go, then moved up to meet it
+        char *text = response + KV_INT_CHARS;
+        uint64_t version;
+        if (!kv_gets(key, text, BUFFER_SIZE - KV_INT_CHARS, &version)) {
+            strcpy(response, "NOT_FOUND");
+        } else {
+            char prefix[KV_INT_CHARS + 1];
+            int len = snprintf(prefix, sizeof(prefix), "%llu ", (unsigned long long)version);
+            memmove(response + len, text, strlen(text) + 1);
+            memcpy(response, prefix, len);
+        }
+
+    /*
+     * handle CAS command: store a value only if the key is unchanged
+     * example: "CAS name 7 Hanna" replies OK if "name" still has version 7,
+     * CHANGED if it has been given another value since (GETS it again and
+     * retry), or NOT_FOUND if it isn't there. the key keeps its time to live
+     */
+    } else if (strcmp(cmd, "CAS") == 0 && parsed == 4) {
+        int64_t version;
+        if (lengths[3] > KV_MAX_VALUE) {
+            strcpy(response, "ERROR value too long");
+            return;
+        }
+        if (!kv_parse_int(words[2], lengths[2], &version) || version <= 0) {
+            strcpy(response, "ERROR invalid version");
+            return;
+        }
+        int stored = kv_cas(key, words[3], (uint64_t)version);
+        if (stored == 0) {
+            strcpy(response, "OK");
+        } else if (stored == KV_CHANGED) {
+            strcpy(response, "CHANGED");
+        } else if (stored == KV_NOT_FOUND) {
+            strcpy(response, "NOT_FOUND");
+        } else if (stored == KV_LOG_ERROR) {
+            strcpy(response, "ERROR log write failed");
+        } else {
+            strcpy(response, "ERROR out of memory");
+        }
         
     /*
      * handle DELETE command: remove a key-value pair
@@ -139,53 +324,885 @@ void* handle_client(void* arg) {
      * parsed >= 2 means we got command and key
      */
     } else if (strcmp(cmd, "DELETE") == 0 && parsed >= 2) {
-        kv_entry_t *entry;
-        // search the hash table for the key
-        HASH_FIND_STR(kv_store, key, entry);
-        
-        if (entry) {
-            // key found, remove it from the hash table
-            HASH_DEL(kv_store, entry);
-            // free the memory that was allocated for this entry
-            free(entry);
+        /*
+         * we return OK whether or not the key existed
+         * this is called "idempotent" - deleting something that doesn't exist
+         * is the same as deleting something that does exist (both result in it not existing)
+         * - unless the delete couldn't be logged, in which case it may not last
+         */
+        if (kv_delete(key) == KV_LOG_ERROR) {
+            strcpy(response, "ERROR log write failed");
+        } else {
             strcpy(response, "OK");
+        }
+        
+    /*
+     * handle INCR, DECR, INCRBY and DECRBY: add to a counter inside the store
+     * example: "INCR hits" adds 1, "DECRBY stock 5" takes 5 away
+     * a missing key starts at 0. replies with the new value
+     */
+    } else if ((strcmp(cmd, "INCR") == 0 || strcmp(cmd, "DECR") == 0) && parsed >= 2) {
+        counter_command(key, strcmp(cmd, "INCR") == 0 ? 1 : -1, response);
+    } else if ((strcmp(cmd, "INCRBY") == 0 || strcmp(cmd, "DECRBY") == 0) && parsed >= 3) {
+        int64_t delta;
+        if (!kv_parse_int(value, lengths[2], &delta)) {
+            strcpy(response, "ERROR value is not an integer");
+            return;
+        }
+        if (strcmp(cmd, "DECRBY") == 0) {
+            if (delta == INT64_MIN) {
+                strcpy(response, "ERROR increment or decrement would overflow");
+                return;
+            }
+            delta = -delta;
+        }
+        counter_command(key, delta, response);
+
+    /*
+     * handle EXPIRE command: give an existing key a time to live
+     * example: "EXPIRE name 60" makes "name" expire in 60 seconds
+     * (0 or less deletes it now). replies OK, or NOT_FOUND if there's no such key
+     */
+    } else if (strcmp(cmd, "EXPIRE") == 0 && parsed >= 3) {
+        char *end;
+        long seconds = strtol(value, &end, 10);
+        if (*end != '\0' || seconds > KV_MAX_TTL) {
+            strcpy(response, "ERROR invalid expire time");
+            return;
+        }
+        int found = kv_expire(key, seconds);
+        if (found == KV_UNSUPPORTED) {
+            strcpy(response, "ERROR unsupported");
+        } else if (found == KV_LOG_ERROR) {
+            strcpy(response, "ERROR log write failed");
+        } else if (found < 0) {
+            strcpy(response, "ERROR out of memory");
+        } else {
+            strcpy(response, found ? "OK" : "NOT_FOUND");
+        }
+
+    /*
+     * handle TTL command: how long a key has left
+     * example: "TTL name" replies with the seconds left, -1 if "name"
+     * never expires, or -2 if there is no such key (the same as redis)
+     */
+    } else if (strcmp(cmd, "TTL") == 0 && parsed >= 2) {
+        long seconds;
+        int found = kv_ttl(key, &seconds);
+        if (found == KV_UNSUPPORTED) {
+            strcpy(response, "ERROR unsupported");
         } else {
-            // key doesn't exist, but we still return OK
-            // this is called "idempotent" - deleting something that doesn't exist
-            // is the same as deleting something that does exist (both result in it not existing)
+            snprintf(response, BUFFER_SIZE, "%ld", found ? seconds : -2L);
+        }
+
+    /*
+     * handle STATS command: report on the store's memory
+     * the reply is one line of name=value fields (see kv_stats)
+     */
+    } else if (strcmp(cmd, "STATS") == 0) {
+        kv_stats(response, BUFFER_SIZE);
+
+    /*
+     * handle SNAPSHOT command: write every key to the --snapshot file
+     * a forked child writes it in the background, so this replies as soon
+     * as the child is running (STATS shows when it is done)
+     */
+    } else if (strcmp(cmd, "SNAPSHOT") == 0) {
+        int started = kv_snapshot();
+        if (started == 0) {
             strcpy(response, "OK");
+        } else if (started == 1) {
+            strcpy(response, "ERROR snapshot already running");
+        } else if (started == KV_UNSUPPORTED) {
+            strcpy(response, "ERROR unsupported");
+        } else if (store_snapshot == NULL) {
+            strcpy(response, "ERROR no snapshot file (start the server with --snapshot)");
+        } else {
+            strcpy(response, "ERROR snapshot failed");
         }
         
     } else {
         // invalid command or wrong number of arguments
         strcpy(response, "ERROR");
     }
+}
+
+/*
+ * find the next complete command line in buf[start..len)
+ * commands are newline-terminated (a '\r' right before the '\n' is dropped too,
+ * so telnet-style clients work). on success the line is null-terminated in
+ * place, *line points at it, and the offset just past the newline is returned.
+ * returns 0 if there is no complete line yet
+ */
+size_t next_line(char *buf, size_t start, size_t len, char **line) {
+    char *newline = memchr(buf + start, '\n', len - start);
+    if (newline == NULL) {
+        return 0;
+    }
+    *newline = '\0';
+    if (newline > buf + start && newline[-1] == '\r') {
+        newline[-1] = '\0';
+    }
+    *line = buf + start;
+    return (size_t)(newline - buf) + 1;
+}
+
+/*
+ * REPLY BATCHES
+ * a client may pipeline many commands - send them back-to-back without
+ * waiting for each reply. we run every complete command we have in order,
+ * gather the replies here, and send the whole batch with a single writev()
+ * instead of paying for one write() system call per reply.
+ * each reply takes two iovecs: its text in data, and a shared "\n"
+ */
+typedef struct {
+    char data[BATCH_BYTES];                  // reply texts, one after another
+    size_t used;                             // bytes of data in use
+    struct iovec iov[2 * BATCH_REPLIES];     // what writev() will send
+    int iov_count;                           // how many iovecs are filled in
+} reply_batch_t;
+
+// empty the batch so it can be filled again
+void batch_reset(reply_batch_t *batch) {
+    batch->used = 0;
+    batch->iov_count = 0;
+}
+
+/*
+ * run the complete commands in buf[start..len) in order, adding each reply
+ * to the batch, until we run out of commands or the batch is full
+ * returns the offset of the first command that was not run
+ */
+size_t batch_run(reply_batch_t *batch, char *buf, size_t start, size_t len) {
+    static char newline[] = "\n";
+
+    // every reply needs up to BUFFER_SIZE bytes of room, like process_command expects
+    while (batch->used + BUFFER_SIZE <= BATCH_BYTES &&
+           batch->iov_count < 2 * BATCH_REPLIES) {
+        char *line;
+        size_t next = next_line(buf, start, len, &line);
+        if (next == 0) {
+            break;  // the rest (if any) is an unfinished command
+        }
+        char *response = batch->data + batch->used;
+        process_command(line, response);
+        size_t reply_len = strlen(response);
+        batch->used += reply_len;
+        batch->iov[batch->iov_count].iov_base = response;
+        batch->iov[batch->iov_count].iov_len = reply_len;
+        batch->iov[batch->iov_count + 1].iov_base = newline;
+        batch->iov[batch->iov_count + 1].iov_len = 1;
+        batch->iov_count += 2;
+        start = next;
+    }
+    return start;
+}
+
+/*
+ * step past n bytes that writev() already sent
+ * whole iovecs are skipped and a partly-sent one is trimmed
+ */
+void advance_iov(struct iovec **iov, int *count, size_t n) {
+    while (*count > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*count)--;
+    }
+    if (*count > 0) {
+        (*iov)->iov_base = (char*)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/*
+ * send a whole batch to a blocking socket
+ * writev() may send less than we asked for, so keep going until it's all out
+ * returns 0 on success, -1 if the client went away
+ */
+int send_batch(int fd, reply_batch_t *batch) {
+    struct iovec *iov = batch->iov;
+    int count = batch->iov_count;
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        advance_iov(&iov, &count, n);
+    }
+    return 0;
+}
+
+/*
+ * function that serves one client connection from start to finish
+ * runs every command the client sends until it hangs up, then closes the socket
+ * it blocks while waiting for the client, so it needs a thread of its own -
+ * either a fresh one (handle_client) or a worker from the thread pool
+ */
+void serve_client(int client_fd) {
+    char buffer[READ_BUFFER_SIZE]; // buffer to read incoming commands from client
+    size_t in_len = 0;             // how many unprocessed bytes are in buffer
+    reply_batch_t batch;           // replies waiting to be sent back
+    int done = 0;                  // set once we should hang up
     
     /*
-     * MUTEX UNLOCK 
-     * unlock the mutex after we're done with the hash table
-     * this allows other waiting threads to now access the hash table
-     */
-    pthread_mutex_unlock(&kv_mutex);
-    
-    /*
-     * send the response back to the client
-     * write() sends data over the socket to the client
+     * CONNECTION LOOP
+     * the connection stays open and the client can send as many commands
+     * as it likes, one per line. we keep serving it until it hangs up
      */
-    write(client_fd, response, strlen(response));
+    while (!done) {
+        /*
+         * read more of the client's commands
+         * read() blocks (waits) until data arrives from the client
+         * the last byte of the buffer is kept free so a final command
+         * without a newline can still be terminated below
+         */
+        ssize_t bytes_read = read(client_fd, buffer + in_len, READ_BUFFER_SIZE - 1 - in_len);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;  // interrupted by a signal, just try again
+        }
+        if (bytes_read > 0) {
+            in_len += bytes_read;
+        } else if (bytes_read == 0 && in_len > 0) {
+            // client hung up after a last command without a trailing newline - still answer it
+            buffer[in_len++] = '\n';
+            done = 1;
+        } else {
+            break;  // read failed or connection closed, we're done with this client
+        }
+        
+        // run every complete command that has arrived, one batch (one writev) at a time
+        size_t start = 0;
+        while (1) {
+            batch_reset(&batch);
+            start = batch_run(&batch, buffer, start, in_len);
+            if (batch.iov_count == 0) {
+                break;
+            }
+            if (send_batch(client_fd, &batch) < 0) {
+                done = 1;
+                break;
+            }
+        }
+        
+        // move the unfinished command (if any) to the front of the buffer
+        memmove(buffer, buffer + start, in_len - start);
+        in_len -= start;
+        
+        // a command this long without a newline can never be run
+        if (!done && in_len >= BUFFER_SIZE - 1) {
+            static char error[] = "ERROR line too long\n";
+            batch_reset(&batch);
+            batch.iov[0].iov_base = error;
+            batch.iov[0].iov_len = strlen(error);
+            batch.iov_count = 1;
+            send_batch(client_fd, &batch);  // we hang up either way, so a failed send needs nothing more
+            done = 1;
+        }
+    }
     
-    // clean up: close the socket and free the memory we allocated
+    // clean up: close the socket
     close(client_fd);
-    free(arg);
+}
+
+/*
+ * function that handles each client connection
+ * this function runs in a separate thread for each client
+ * the arg parameter contains the client's socket file descriptor
+ */
+void* handle_client(void* arg) {
+    // extract the client socket file descriptor from the argument
+    // we passed a pointer to an int, so we need to dereference it
+    int client_fd = *(int*)arg;
+    free(arg);  // free the memory we allocated for the file descriptor
+    
+    serve_client(client_fd);
     
     // return null to indicate this thread is done
     return NULL;
 }
 
-int main() {
-    int server_fd, client_fd;                    // file descriptors for server and client sockets
-    struct sockaddr_in server_addr, client_addr;  // structures to hold network addresses
-    socklen_t client_len = sizeof(client_addr);   // size of client address structure
+/*
+ * thread-per-connection mode (the default)
+ * this loop runs forever, accepting new client connections
+ * for each connection, we spawn a new thread to handle it
+ */
+void run_thread_loop(int server_fd) {
+    int client_fd;                               // file descriptor for the accepted client
+    struct sockaddr_in client_addr;              // structure to hold the client's address
+    socklen_t client_len = sizeof(client_addr);  // size of client address structure
+    
+    while (1) {
+        /*
+         * accept a new client connection
+         * accept() blocks (waits) until a client connects
+         * when a client connects, it returns a new file descriptor for that client
+         * the original server_fd continues listening for more connections
+         */
+        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+        if (client_fd < 0) {
+            perror("accept failed");
+            continue;  // if accept fails, just try again
+        }
+        
+        /*
+         * allocate memory to store the client file descriptor
+         * we need to pass this to the thread, but we can't just pass the value
+         * because the variable might change before the thread reads it
+         * so we allocate memory on the heap and pass a pointer to it
+         */
+        int *client_fd_ptr = malloc(sizeof(int));
+        *client_fd_ptr = client_fd;  // store the file descriptor in the allocated memory
+        
+        /*
+         * create a new thread to handle this client
+         * pthread_create spawns a new thread that runs the handle_client function
+         * the new thread runs independently, so the main thread can immediately
+         * go back to accepting more connections
+         */
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, handle_client, client_fd_ptr) != 0) {
+            perror("pthread_create failed");
+            close(client_fd);
+            free(client_fd_ptr);
+            continue;  // if thread creation fails, try accepting next connection
+        }
+        
+        /*
+         * detach the thread so it cleans up automatically when done
+         * without detaching, we'd need to call pthread_join() later to clean up
+         * detached threads clean themselves up automatically
+         */
+        pthread_detach(thread_id);
+    }
+}
+
+/*
+ * thread pool mode
+ * a fixed number of worker threads is started once, and this loop just
+ * queues each accepted connection for them. no thread is created per client,
+ * and when every worker is busy and the queue is full, threadpool_submit()
+ * blocks - we stop accepting and new clients wait in the kernel's backlog
+ * instead of the server spawning threads until it falls over
+ */
+void run_pool_loop(int server_fd, int num_workers, int queue_size) {
+    threadpool_t *pool = threadpool_create(num_workers, queue_size, serve_client);
+    if (pool == NULL) {
+        fprintf(stderr, "failed to start %d worker threads\n", num_workers);
+        exit(1);
+    }
+    
+    while (1) {
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd < 0) {
+            perror("accept failed");
+            continue;  // if accept fails, just try again
+        }
+        if (threadpool_submit(pool, client_fd) < 0) {
+            close(client_fd);
+        }
+    }
+}
+
+/*
+ * EPOLL EVENT LOOP
+ * instead of one thread per client, a single thread watches every socket
+ * with epoll and only touches a socket when the kernel says it is ready.
+ * sockets are non-blocking and registered edge-triggered (EPOLLET), so each
+ * time we are woken up we must keep reading/writing until the kernel says
+ * EAGAIN - otherwise we would never be told about the leftover data again.
+ */
+
+// what a connection is doing right now
+typedef enum {
+    CONN_READING,   // no replies pending, waiting for more commands to arrive
+    CONN_WRITING,   // replies are still being sent, new commands wait until they are out
+    CONN_CLOSING    // sending a final reply, then the connection is closed
+} conn_state_t;
+
+/*
+ * per-connection state for the epoll loop
+ * no thread owns the connection anymore, so everything that would have
+ * lived on handle_client's stack has to be kept here between events
+ */
+typedef struct {
+    int fd;                          // the client's socket
+    conn_state_t state;              // which step of the state machine we're on
+    int eof;                         // client has finished sending (read returned 0)
+    char buffer[READ_BUFFER_SIZE];   // command bytes received but not yet run
+    size_t in_len;                   // how many bytes are in buffer
+    char *out;                       // replies the socket couldn't take yet (malloc'd)
+    size_t out_len;                  // total length of out
+    size_t out_sent;                 // how much of out was already sent
+} conn_t;
+
+/*
+ * the epoll loop runs on one thread and handles one connection at a time,
+ * so a single batch is enough for everyone (and keeps conn_t small)
+ */
+static reply_batch_t epoll_batch;
+
+/*
+ * switch a socket to non-blocking mode
+ * read()/write()/accept() then return -1 with errno EAGAIN instead of
+ * waiting, which is what lets one thread juggle thousands of sockets
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * send a batch of replies with writev() on a non-blocking socket
+ * whatever the socket won't take right now is copied into conn->out
+ * and the connection switches to CONN_WRITING until it drains
+ * returns 0 on success, -1 if the connection should be closed
+ */
+int conn_send_batch(conn_t *conn, reply_batch_t *batch) {
+    struct iovec *iov = batch->iov;
+    int count = batch->iov_count;
+    while (count > 0) {
+        ssize_t n = writev(conn->fd, iov, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        advance_iov(&iov, &count, n);
+    }
+    if (count == 0) {
+        return 0;  // the usual case: the whole batch went out in one call
+    }
+
+    // socket buffer is full - keep the rest, the batch gets reused for the next client
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+    conn->out = malloc(total);
+    if (conn->out == NULL) {
+        return -1;
+    }
+    conn->out_len = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(conn->out + conn->out_len, iov[i].iov_base, iov[i].iov_len);
+        conn->out_len += iov[i].iov_len;
+    }
+    conn->out_sent = 0;
+    conn->state = CONN_WRITING;
+    return 0;
+}
+
+/*
+ * drive one connection's state machine as far as it can go
+ * called whenever epoll reports activity on the socket. it alternates between
+ * sending pending replies and running the buffered commands as a batch, and
+ * only reads more from the socket once both are done. since we're
+ * edge-triggered it only gives up when the kernel says EAGAIN
+ * returns 0 to wait for the next event, -1 when the connection should be closed
+ */
+int conn_handle(conn_t *conn) {
+    while (1) {
+        // 1. replies are pending - they have to go out before anything else
+        if (conn->state != CONN_READING) {
+            while (conn->out_sent < conn->out_len) {
+                ssize_t n = write(conn->fd, conn->out + conn->out_sent,
+                                  conn->out_len - conn->out_sent);
+                if (n > 0) {
+                    conn->out_sent += n;
+                } else if (n < 0 && errno == EINTR) {
+                    continue;  // interrupted by a signal, just try again
+                } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return 0;  // socket buffer is full, epoll will tell us when it drains
+                } else {
+                    return -1;  // the client went away
+                }
+            }
+            free(conn->out);
+            conn->out = NULL;
+            if (conn->state == CONN_CLOSING) {
+                return -1;
+            }
+            conn->state = CONN_READING;
+        }
+
+        // 2. run every complete command that's buffered as one batch
+        batch_reset(&epoll_batch);
+        size_t next = batch_run(&epoll_batch, conn->buffer, 0, conn->in_len);
+        if (epoll_batch.iov_count > 0) {
+            memmove(conn->buffer, conn->buffer + next, conn->in_len - next);
+            conn->in_len -= next;
+            if (conn_send_batch(conn, &epoll_batch) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        // a command this long without a newline can never be run
+        if (conn->in_len >= BUFFER_SIZE - 1) {
+            conn->out = strdup("ERROR line too long\n");
+            if (conn->out == NULL) {
+                return -1;
+            }
+            conn->out_len = strlen(conn->out);
+            conn->out_sent = 0;
+            conn->state = CONN_CLOSING;
+            continue;
+        }
+
+        // the client is done sending: answer a trailing unterminated command, then close
+        if (conn->eof) {
+            if (conn->in_len == 0) {
+                return -1;
+            }
+            conn->buffer[conn->in_len++] = '\n';
+            continue;
+        }
+
+        // 3. nothing left to do with what we have, so read more
+        ssize_t n = read(conn->fd, conn->buffer + conn->in_len,
+                         READ_BUFFER_SIZE - 1 - conn->in_len);
+        if (n > 0) {
+            conn->in_len += n;
+        } else if (n == 0) {
+            conn->eof = 1;     // client closed its side of the connection
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;          // drained everything that's available right now
+        } else {
+            return -1;
+        }
+    }
+}
+
+/*
+ * accept every pending connection on the (non-blocking) listening socket
+ * and register each new client with epoll
+ */
+void accept_pending(int epoll_fd, int server_fd) {
+    while (1) {
+        // accept4 hands us the client socket already in non-blocking mode
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept failed");
+            }
+            return;  // no more pending connections (or out of fds for now)
+        }
+
+        conn_t *conn = calloc(1, sizeof(conn_t));
+        if (conn == NULL) {
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->state = CONN_READING;
+
+        /*
+         * watch for both directions at once
+         * with edge triggering we only hear about changes, so registering
+         * EPOLLOUT up front saves an epoll_ctl() call when we start writing
+         */
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(client_fd);
+            free(conn);
+        }
+    }
+}
+
+/*
+ * epoll mode
+ * one thread, one epoll instance, every connection in it
+ * this runs forever, just like the threaded accept loop
+ */
+void run_epoll_loop(int server_fd) {
+    struct epoll_event events[MAX_EVENTS];
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        exit(1);
+    }
+
+    // the listening socket is registered with a null pointer so we can tell it apart
+    if (set_nonblocking(server_fd) < 0) {
+        perror("fcntl failed");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+
+    while (1) {
+        // wait until at least one socket is ready (-1 = no timeout)
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            exit(1);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            conn_t *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_pending(epoll_fd, server_fd);
+                continue;
+            }
+
+            /*
+             * run the connection's state machine for whatever the kernel reported
+             * closing the fd also removes it from the epoll set automatically
+             */
+            int result = -1;
+            if (!(events[i].events & EPOLLERR)) {
+                result = conn_handle(conn);
+            }
+            if (result < 0) {
+                close(conn->fd);
+                free(conn->out);
+                free(conn);
+            }
+        }
+    }
+}
+
+/*
+ * print the command-line options and exit
+ */
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  --mode threads|epoll|pool  how connections are served (default threads)\n");
+    fprintf(stderr, "  --workers N                worker threads in pool mode (default %d)\n", DEFAULT_WORKERS);
+    fprintf(stderr, "  --queue N                  connections that can wait for a worker (default %d)\n", DEFAULT_QUEUE_SIZE);
+    fprintf(stderr, "  --engine sharded|lockfree  how keys are stored (default sharded)\n");
+    fprintf(stderr, "  --shards N                 independently locked parts of the keyspace (default %d)\n", KV_DEFAULT_SHARDS);
+    fprintf(stderr, "  --lock mutex|rwlock        how each shard is locked (default mutex)\n");
+    fprintf(stderr, "  --rehash incremental|blocking  how a full shard grows (default incremental)\n");
+    fprintf(stderr, "  --hash wyhash|xxh64|crc32c how keys are hashed (default %s)\n", kv_hash_name(KV_DEFAULT_HASH));
+    fprintf(stderr, "  --maxmemory N[k|m|g]       evict keys past N bytes (default no limit)\n");
+    fprintf(stderr, "  --eviction lru|lfu         which keys --maxmemory evicts first (default lru)\n");
+    fprintf(stderr, "  --wal FILE                 log every change to FILE and replay it at startup (default no log)\n");
+    fprintf(stderr, "  --fsync always|no|MS       sync the log on every write, never, or every MS ms (default %d)\n",
+            KV_DEFAULT_FSYNC_MS);
+    fprintf(stderr, "  --snapshot FILE            load FILE at startup, and write it on SNAPSHOT (default none)\n");
+    fprintf(stderr, "  --snapshot-load map|copy   serve the snapshot from the mapped file, or copy it in (default map)\n");
+    fprintf(stderr, "  --recovery-threads N       threads that load the snapshot and replay the log (default one per cpu)\n");
+    exit(1);
+}
+
+/*
+ * read a positive whole number for a command-line option
+ * anything else (text, zero, negative) is an error
+ */
+int parse_positive(const char *prog, const char *option, const char *text) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (*end != '\0' || value <= 0 || value > 1000000) {
+        fprintf(stderr, "%s: bad value for %s: %s\n", prog, option, text);
+        usage(prog);
+    }
+    return (int)value;
+}
+
+/*
+ * read a size in bytes for a command-line option, with an optional k, m or g
+ * (binary multiples, so "64m" is 64 * 1024 * 1024)
+ */
+size_t parse_size(const char *prog, const char *option, const char *text) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    unsigned long long scale = 1;
+    if (*end == 'k' || *end == 'K') {
+        scale = 1024ULL;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        scale = 1024ULL * 1024;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        scale = 1024ULL * 1024 * 1024;
+        end++;
+    }
+    if (end == text || *end != '\0' || text[0] == '-' || value == 0 || value > SIZE_MAX / scale) {
+        fprintf(stderr, "%s: bad value for %s: %s\n", prog, option, text);
+        usage(prog);
+    }
+    return (size_t)(value * scale);
+}
+
+int main(int argc, char *argv[]) {
+    int server_fd;                       // file descriptor for the listening socket
+    struct sockaddr_in server_addr;      // structure to hold the server's network address
+    server_mode_t mode = MODE_THREADS;   // how connections get handed out
+    int num_workers = DEFAULT_WORKERS;   // pool mode: how many worker threads
+    int queue_size = DEFAULT_QUEUE_SIZE; // pool mode: how many connections can wait
+    kv_config_t store_config;            // how the key-value store is set up
+    kv_config_default(&store_config);
+    
+    /*
+     * read the options from the command line
+     * "./server" or "./server --mode threads" spawns a thread per connection
+     * "./server --mode epoll" runs every connection on a single event loop
+     * "./server --mode pool --workers 64" uses a pool of 64 worker threads
+     * "./server --shards 128" splits the keyspace across 128 locks
+     * "./server --lock rwlock" lets GETs share a shard (good for read-heavy traffic)
+     * "./server --engine lockfree" uses the table whose GETs never lock
+     * "./server --rehash blocking" grows a full shard in one go instead of a step at a time
+     * "./server --hash crc32c" hashes keys with the cpu's crc instruction
+     * "./server --maxmemory 512m" runs as a cache that evicts past 512 MB
+     * "./server --maxmemory 512m --eviction lfu" evicts the least often used keys instead
+     * "./server --wal kv.log" keeps the keys across restarts, losing at most about a second's worth in a crash
+     * "./server --wal kv.log --fsync always" only replies to a write once it is on disk
+     * "./server --wal kv.log --snapshot kv.snap" starts from the snapshot plus the log written since
+     * "./server --wal kv.log --snapshot kv.snap --snapshot-load copy" copies every key in before serving
+     */
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);  // every option takes a value
+        }
+        if (strcmp(argv[i], "--mode") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "threads") == 0) {
+                mode = MODE_THREADS;
+            } else if (strcmp(name, "epoll") == 0) {
+                mode = MODE_EPOLL;
+            } else if (strcmp(name, "pool") == 0) {
+                mode = MODE_POOL;
+            } else {
+                fprintf(stderr, "unknown mode: %s\n", name);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--workers") == 0) {
+            num_workers = parse_positive(argv[0], argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--queue") == 0) {
+            queue_size = parse_positive(argv[0], argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--engine") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "sharded") == 0) {
+                store_config.engine = KV_ENGINE_SHARDED;
+            } else if (strcmp(name, "lockfree") == 0) {
+                store_config.engine = KV_ENGINE_LOCKFREE;
+            } else {
+                fprintf(stderr, "unknown engine: %s\n", name);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            store_config.num_shards = parse_positive(argv[0], argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--lock") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "mutex") == 0) {
+                store_config.lock_mode = KV_LOCK_MUTEX;
+            } else if (strcmp(name, "rwlock") == 0) {
+                store_config.lock_mode = KV_LOCK_RWLOCK;
+            } else {
+                fprintf(stderr, "unknown lock: %s\n", name);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--rehash") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "incremental") == 0) {
+                store_config.rehash = KV_REHASH_INCREMENTAL;
+            } else if (strcmp(name, "blocking") == 0) {
+                store_config.rehash = KV_REHASH_BLOCKING;
+            } else {
+                fprintf(stderr, "unknown rehash mode: %s\n", name);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--hash") == 0) {
+            const char *name = argv[++i];
+            if (kv_hash_parse(name, &store_config.hash) < 0) {
+                fprintf(stderr, "unknown hash: %s\n", name);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--eviction") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "lru") == 0) {
+                store_config.eviction = KV_EVICT_LRU;
+            } else if (strcmp(name, "lfu") == 0) {
+                store_config.eviction = KV_EVICT_LFU;
+            } else {
+                fprintf(stderr, "unknown eviction policy: %s\n", name);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--maxmemory") == 0) {
+            store_config.max_memory = parse_size(argv[0], argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            store_config.log_path = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            store_config.snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-load") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "map") == 0) {
+                store_config.snapshot_copy = 0;
+            } else if (strcmp(name, "copy") == 0) {
+                store_config.snapshot_copy = 1;
+            } else {
+                fprintf(stderr, "unknown snapshot load mode: %s\n", name);
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--recovery-threads") == 0) {
+            store_config.recovery_threads = parse_positive(argv[0], argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--fsync") == 0) {
+            const char *name = argv[++i];
+            if (strcmp(name, "always") == 0) {
+                store_config.log_fsync = WAL_FSYNC_ALWAYS;
+            } else if (strcmp(name, "no") == 0) {
+                store_config.log_fsync = WAL_FSYNC_NO;
+            } else {
+                store_config.log_fsync = WAL_FSYNC_EVERY;
+                store_config.log_fsync_ms = parse_positive(argv[0], argv[i - 1], name);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    
+    if (store_config.max_memory != 0 && store_config.engine == KV_ENGINE_LOCKFREE) {
+        fprintf(stderr, "--maxmemory needs the sharded engine\n");
+        exit(1);
+    }
+    if (store_config.log_path != NULL && store_config.engine == KV_ENGINE_LOCKFREE) {
+        fprintf(stderr, "--wal needs the sharded engine\n");
+        exit(1);
+    }
+    if (store_config.snapshot_path != NULL && store_config.engine == KV_ENGINE_LOCKFREE) {
+        fprintf(stderr, "--snapshot needs the sharded engine\n");
+        exit(1);
+    }
+    store_snapshot = store_config.snapshot_path;
+
+    // set up the key-value store (empty, or as the log left it)
+    if (kv_store_init(&store_config) < 0) {
+        fprintf(stderr, "failed to set up the key-value store\n");
+        exit(1);
+    }
     
     /*
      * create a socket
@@ -230,62 +1247,29 @@ int main() {
     /*
      * start listening for incoming connections
      * the socket is now ready to accept connections
-     * 5 is the backlog - how many pending connections can queue up
+     * SOMAXCONN is the backlog - how many pending connections can queue up
+     * (the kernel's maximum, so bursts of new clients don't get refused)
      */
-    if (listen(server_fd, 5) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("listen failed");
         exit(1);
     }
     
-    printf("Server listening on port %d\n", PORT);
-    
     /*
      * MAIN ACCEPT LOOP
-     * this loop runs forever, accepting new client connections
-     * for each connection, we spawn a new thread to handle it
+     * hand the listening socket to whichever server mode was picked
+     * all of these loops run forever
      */
-    while (1) {
-        /*
-         * accept a new client connection
-         * accept() blocks (waits) until a client connects
-         * when a client connects, it returns a new file descriptor for that client
-         * the original server_fd continues listening for more connections
-         */
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_fd < 0) {
-            perror("accept failed");
-            continue;  // if accept fails, just try again
-        }
-        
-        /*
-         * allocate memory to store the client file descriptor
-         * we need to pass this to the thread, but we can't just pass the value
-         * because the variable might change before the thread reads it
-         * so we allocate memory on the heap and pass a pointer to it
-         */
-        int *client_fd_ptr = malloc(sizeof(int));
-        *client_fd_ptr = client_fd;  // store the file descriptor in the allocated memory
-        
-        /*
-         * create a new thread to handle this client
-         * pthread_create spawns a new thread that runs the handle_client function
-         * the new thread runs independently, so the main thread can immediately
-         * go back to accepting more connections
-         */
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client_fd_ptr) != 0) {
-            perror("pthread_create failed");
-            close(client_fd);
-            free(client_fd_ptr);
-            continue;  // if thread creation fails, try accepting next connection
-        }
-        
-        /*
-         * detach the thread so it cleans up automatically when done
-         * without detaching, we'd need to call pthread_join() later to clean up
-         * detached threads clean themselves up automatically
-         */
-        pthread_detach(thread_id);
+    if (mode == MODE_EPOLL) {
+        printf("Server listening on port %d (epoll mode)\n", PORT);
+        run_epoll_loop(server_fd);
+    } else if (mode == MODE_POOL) {
+        printf("Server listening on port %d (pool mode, %d workers, queue of %d)\n",
+               PORT, num_workers, queue_size);
+        run_pool_loop(server_fd, num_workers, queue_size);
+    } else {
+        printf("Server listening on port %d (threads mode)\n", PORT);
+        run_thread_loop(server_fd);
     }
     
     // this code never runs because of the infinite loop above
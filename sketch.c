@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include "sketch.h"
+
+// one odd constant per row, so each row spreads the same hash differently
+static const uint64_t row_seeds[SKETCH_DEPTH] = {
+    0xc3a5c85c97cb3127ull, 0xb492b66fbe98f273ull, 0x9ae16a3b2f90404full, 0xcbf29ce484222325ull
+};
+
+int sketch_init(sketch_t *sketch, size_t words) {
+    size_t size = 1;
+    while (size < words) {
+        size *= 2;
+    }
+    sketch->table = calloc(size, sizeof(sketch->table[0]));
+    if (sketch->table == NULL) {
+        return -1;
+    }
+    sketch->mask = size - 1;
+    atomic_init(&sketch->additions, 0);
+    sketch->sample_size = size * SKETCH_SAMPLE_FACTOR;
+    return 0;
+}
+
+void sketch_destroy(sketch_t *sketch) {
+    free(sketch->table);
+    sketch->table = NULL;
+}
+
+// the word holding row's counter for the hash
+static inline size_t word_of(const sketch_t *sketch, uint64_t hash, int row) {
+    uint64_t h = (hash + row_seeds[row]) * row_seeds[row];
+    h += h >> 32;
+    return h & sketch->mask;
+}
+
+/*
+ * the counter inside that word: the low two bits of the hash pick one of
+ * four groups of four counters, and each row takes a different one of the
+ * group, so the rows never share a counter even when they share a word
+ */
+static inline int shift_of(uint64_t hash, int row) {
+    return (int)(((hash & 3) << 2) + row) << 2;
+}
+
+// halve every counter (the aging step)
+static void halve(sketch_t *sketch) {
+    for (size_t i = 0; i <= sketch->mask; i++) {
+        uint64_t word = atomic_load_explicit(&sketch->table[i], memory_order_relaxed);
+        atomic_store_explicit(&sketch->table[i], (word >> 1) & 0x7777777777777777ull,
+                              memory_order_relaxed);
+    }
+}
+
+void sketch_increment(sketch_t *sketch, uint64_t hash) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        _Atomic uint64_t *word = &sketch->table[word_of(sketch, hash, row)];
+        int shift = shift_of(hash, row);
+        uint64_t old = atomic_load_explicit(word, memory_order_relaxed);
+        while (((old >> shift) & 0xF) != 0xF &&
+               !atomic_compare_exchange_weak_explicit(word, &old, old + (1ull << shift),
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+            // another thread changed the word - old was refreshed, try again
+        }
+    }
+    // exactly one thread sees the count reach sample_size, and that one does the halving
+    if (atomic_fetch_add_explicit(&sketch->additions, 1, memory_order_relaxed) + 1 == sketch->sample_size) {
+        halve(sketch);
+        atomic_fetch_sub_explicit(&sketch->additions, sketch->sample_size / 2, memory_order_relaxed);
+    }
+}
+
+int sketch_frequency(sketch_t *sketch, uint64_t hash) {
+    int frequency = 0xF;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint64_t word = atomic_load_explicit(&sketch->table[word_of(sketch, hash, row)], memory_order_relaxed);
+        int count = (int)((word >> shift_of(hash, row)) & 0xF);
+        if (count < frequency) {
+            frequency = count;
+        }
+    }
+    return frequency;
+}
@@ -0,0 +1,53 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * COUNT-MIN FREQUENCY SKETCH
+ * estimates how often each key has been seen recently, in a fixed amount of
+ * memory no matter how many distinct keys there are. every key bumps one
+ * small counter in each of SKETCH_DEPTH rows, picked by a different mix of
+ * its hash; keys that collide share counters, so a key's estimate is the
+ * smallest of its counters - it can be too high, never too low.
+ * counters are 4 bits (16 to a 64-bit word) and stop at 15: the sketch only
+ * needs to tell popular keys from unpopular ones, not count exactly.
+ * AGING: after SKETCH_SAMPLE_FACTOR increments per counter word, every
+ * counter is halved, so keys that were popular long ago fade out and the
+ * sketch follows what is popular now.
+ * increments and halving are lock-free (compare-and-swap per word); a
+ * halving that races an increment may lose it, which only makes one
+ * estimate a little low
+ */
+
+#define SKETCH_DEPTH 4
+// the smallest sketch worth having
+#define SKETCH_MIN_WORDS 16
+// increments per word of counters before every counter is halved
+#define SKETCH_SAMPLE_FACTOR 10
+
+typedef struct {
+    _Atomic uint64_t *table;     // the counters, 16 per word
+    size_t mask;                 // words - 1 (words is a power of two)
+    _Atomic size_t additions;    // increments since the last halving
+    size_t sample_size;          // halve every counter after this many increments
+} sketch_t;
+
+/*
+ * set up a sketch of at least words 64-bit words (rounded up to a power of
+ * two), each counting about 4 keys well
+ * returns 0 on success, -1 if memory could not be allocated
+ */
+int sketch_init(sketch_t *sketch, size_t words);
+
+void sketch_destroy(sketch_t *sketch);
+
+// count one more sighting of the key with this hash
+void sketch_increment(sketch_t *sketch, uint64_t hash);
+
+// how often the key with this hash has been seen lately (0 to 15)
+int sketch_frequency(sketch_t *sketch, uint64_t hash);
+
+#endif
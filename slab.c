@@ -0,0 +1,310 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "slab.h"
+
+/*
+ * how it works
+ * a free item holds nothing anyone cares about, so its first word is used
+ * to link it into a free list - free items cost no extra memory.
+ * each class has a global free list and the unused tail of its newest page
+ * (items are carved from it only when they're first needed, so a fresh page
+ * costs nothing until it is used). both sit behind the class's mutex.
+ * each thread has a record with a free list per class, plus its own count
+ * of the items and bytes it has handed out - the record is only ever
+ * written by its thread, so none of the fast path is shared. records work
+ * like the epoch records: kept on a list forever and reused by the next
+ * thread once their thread exits, so stats can always walk every record
+ */
+typedef struct free_item {
+    struct free_item *next;
+} free_item_t;
+
+// the start of every page, linking the class's pages together
+typedef struct page_header {
+    struct page_header *next;
+    char pad[8];                        // so the first item starts 16 bytes in, aligned like malloc's
+} page_header_t;
+
+typedef struct {
+    pthread_mutex_t lock;               // guards everything below
+    size_t item_size;                   // bytes per item, a multiple of 8
+    free_item_t *free_list;             // items given back by threads
+    page_header_t *pages;               // every page of this class, newest first
+    size_t page_count;
+    size_t items;                       // items carved out so far
+    char *carve;                        // next uncarved item in the newest page
+    size_t carve_left;                  // items still uncarved in the newest page
+} __attribute__((aligned(64))) slab_class_t;
+
+typedef struct slab_cache {
+    struct slab_cache *next;            // next record in the global list
+    atomic_int in_use;                  // owned by a live thread?
+    struct {
+        free_item_t *head;
+        int count;
+    } free[SLAB_MAX_CLASSES];           // this thread's free items, per class
+    _Atomic long used[SLAB_MAX_CLASSES];        // items handed out minus items given back
+    _Atomic long requested[SLAB_MAX_CLASSES];   // bytes asked for, same way
+} __attribute__((aligned(64))) slab_cache_t;
+
+static slab_class_t classes[SLAB_MAX_CLASSES];
+static int class_count = 0;
+// class for each size, indexed by the size in 8-byte steps (rounded up)
+static uint8_t class_of[SLAB_MAX_ITEM / 8 + 1];
+
+// every record ever created, newest first (never freed, see above)
+static _Atomic(slab_cache_t *) caches = NULL;
+static __thread slab_cache_t *my_cache = NULL;
+static pthread_key_t exit_key;                      // runs release_cache() at thread exit
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void release_cache(void *arg);
+
+/*
+ * work out the size classes, once
+ * each class is 1.25x the one before, rounded up to a multiple of 8, and the
+ * last one is exactly SLAB_MAX_ITEM so every slabbed size has a class
+ */
+static void init_classes(void) {
+    size_t size = SLAB_MIN_ITEM;
+    while (class_count < SLAB_MAX_CLASSES) {
+        if (size > SLAB_MAX_ITEM || class_count == SLAB_MAX_CLASSES - 1) {
+            size = SLAB_MAX_ITEM;
+        }
+        slab_class_t *class = &classes[class_count++];
+        pthread_mutex_init(&class->lock, NULL);
+        class->item_size = size;
+        if (size == SLAB_MAX_ITEM) {
+            break;
+        }
+        size_t next = (size + size / 4 + 7) & ~(size_t)7;
+        size = next > size ? next : size + 8;
+    }
+
+    int id = 0;
+    for (size_t steps = 0; steps <= SLAB_MAX_ITEM / 8; steps++) {
+        while (classes[id].item_size < steps * 8) {
+            id++;
+        }
+        class_of[steps] = (uint8_t)id;
+    }
+    pthread_key_create(&exit_key, release_cache);
+}
+
+/*
+ * find this thread a record: reuse one left behind by a finished thread,
+ * or push a new one onto the front of the list
+ */
+static slab_cache_t *register_thread(void) {
+    pthread_once(&init_once, init_classes);
+
+    slab_cache_t *cache;
+    for (cache = atomic_load(&caches); cache != NULL; cache = cache->next) {
+        int unused = 0;
+        if (atomic_load(&cache->in_use) == 0 &&
+            atomic_compare_exchange_strong(&cache->in_use, &unused, 1)) {
+            break;
+        }
+    }
+
+    if (cache == NULL) {
+        cache = aligned_alloc(64, sizeof(slab_cache_t));
+        if (cache == NULL) {
+            return NULL;
+        }
+        atomic_init(&cache->in_use, 1);
+        for (int i = 0; i < SLAB_MAX_CLASSES; i++) {
+            cache->free[i].head = NULL;
+            cache->free[i].count = 0;
+            atomic_init(&cache->used[i], 0);
+            atomic_init(&cache->requested[i], 0);
+        }
+        cache->next = atomic_load(&caches);
+        while (!atomic_compare_exchange_weak(&caches, &cache->next, cache)) {
+            // someone else pushed first - cache->next was refreshed, try again
+        }
+    }
+
+    pthread_setspecific(exit_key, cache);
+    my_cache = cache;
+    return cache;
+}
+
+/*
+ * move up to want items from the class into the thread's free list
+ * recycled items come first, then fresh ones from the newest page, and a
+ * new page is only allocated when both have run dry.
+ * returns how many items were moved (0 means out of memory)
+ */
+static int refill(slab_cache_t *cache, int id, int want) {
+    slab_class_t *class = &classes[id];
+    free_item_t *head = cache->free[id].head;
+    int got = 0;
+
+    pthread_mutex_lock(&class->lock);
+    while (got < want && class->free_list != NULL) {
+        free_item_t *item = class->free_list;
+        class->free_list = item->next;
+        item->next = head;
+        head = item;
+        got++;
+    }
+    while (got < want) {
+        if (class->carve_left == 0) {
+            page_header_t *page = malloc(SLAB_PAGE_SIZE);
+            if (page == NULL) {
+                break;
+            }
+            page->next = class->pages;
+            class->pages = page;
+            class->page_count++;
+            class->carve = (char *)(page + 1);
+            class->carve_left = (SLAB_PAGE_SIZE - sizeof(page_header_t)) / class->item_size;
+        }
+        free_item_t *item = (free_item_t *)class->carve;
+        class->carve += class->item_size;
+        class->carve_left--;
+        class->items++;
+        item->next = head;
+        head = item;
+        got++;
+    }
+    pthread_mutex_unlock(&class->lock);
+
+    cache->free[id].head = head;
+    cache->free[id].count += got;
+    return got;
+}
+
+// hand count items from the thread's free list back to the class
+static void drain(slab_cache_t *cache, int id, int count) {
+    free_item_t *first = cache->free[id].head;
+    free_item_t *last = first;
+    for (int i = 1; i < count; i++) {
+        last = last->next;
+    }
+    cache->free[id].head = last->next;
+    cache->free[id].count -= count;
+
+    slab_class_t *class = &classes[id];
+    pthread_mutex_lock(&class->lock);
+    last->next = class->free_list;
+    class->free_list = first;
+    pthread_mutex_unlock(&class->lock);
+}
+
+/*
+ * called automatically when a registered thread exits
+ * every item the thread was holding goes back to its class. the counters
+ * stay on the record, so the totals still add up after the thread is gone
+ */
+static void release_cache(void *arg) {
+    slab_cache_t *cache = arg;
+    for (int id = 0; id < class_count; id++) {
+        if (cache->free[id].count > 0) {
+            drain(cache, id, cache->free[id].count);
+        }
+    }
+    // anything freed by later exit handlers must not land in a record we no longer own
+    my_cache = NULL;
+    atomic_store(&cache->in_use, 0);
+}
+
+// bump one of this thread's counters (only this thread writes it, so no read-modify-write needed)
+static inline void add_to(_Atomic long *counter, long delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX_ITEM) {
+        return malloc(size);
+    }
+    slab_cache_t *cache = my_cache;
+    if (cache == NULL && (cache = register_thread()) == NULL) {
+        return NULL;
+    }
+
+    int id = class_of[(size + 7) / 8];
+    if (cache->free[id].head == NULL && refill(cache, id, SLAB_CACHE_SIZE / 2) == 0) {
+        return NULL;
+    }
+    free_item_t *item = cache->free[id].head;
+    cache->free[id].head = item->next;
+    cache->free[id].count--;
+    add_to(&cache->used[id], 1);
+    add_to(&cache->requested[id], (long)size);
+    return item;
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size > SLAB_MAX_ITEM) {
+        free(ptr);
+        return;
+    }
+    slab_cache_t *cache = my_cache;
+    if (cache == NULL && (cache = register_thread()) == NULL) {
+        /*
+         * no record for this thread (out of memory): put the item straight
+         * back on its class's list. its counts were made by another thread
+         * and stay a little high, which is better than losing the item
+         */
+        slab_class_t *class = &classes[class_of[(size + 7) / 8]];
+        free_item_t *item = ptr;
+        pthread_mutex_lock(&class->lock);
+        item->next = class->free_list;
+        class->free_list = item;
+        pthread_mutex_unlock(&class->lock);
+        return;
+    }
+
+    int id = class_of[(size + 7) / 8];
+    free_item_t *item = ptr;
+    item->next = cache->free[id].head;
+    cache->free[id].head = item;
+    add_to(&cache->used[id], -1);
+    add_to(&cache->requested[id], -(long)size);
+
+    // keep the thread's share bounded, so one thread's frees can feed another's allocations
+    if (++cache->free[id].count > SLAB_CACHE_SIZE) {
+        drain(cache, id, SLAB_CACHE_SIZE / 2);
+    }
+}
+
+size_t slab_item_size(size_t size) {
+    if (size > SLAB_MAX_ITEM) {
+        return size;
+    }
+    pthread_once(&init_once, init_classes);
+    return classes[class_of[(size + 7) / 8]].item_size;
+}
+
+int slab_class_count(void) {
+    pthread_once(&init_once, init_classes);
+    return class_count;
+}
+
+void slab_class_stats(int class_id, slab_class_stats_t *stats) {
+    pthread_once(&init_once, init_classes);
+    slab_class_t *class = &classes[class_id];
+
+    pthread_mutex_lock(&class->lock);
+    stats->item_size = class->item_size;
+    stats->pages = class->page_count;
+    stats->items = class->items;
+    pthread_mutex_unlock(&class->lock);
+
+    // an item can be allocated by one thread and freed by another, so only the sum means anything
+    long used = 0, requested = 0;
+    for (slab_cache_t *cache = atomic_load(&caches); cache != NULL; cache = cache->next) {
+        used += atomic_load_explicit(&cache->used[class_id], memory_order_relaxed);
+        requested += atomic_load_explicit(&cache->requested[class_id], memory_order_relaxed);
+    }
+    stats->used = used > 0 ? (size_t)used : 0;
+    stats->requested = requested > 0 ? (size_t)requested : 0;
+}
@@ -0,0 +1,72 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/*
+ * SLAB ALLOCATOR
+ * entries and values are small and come and go all the time, so instead of
+ * asking malloc for each one we carve them out of big pages. every size is
+ * rounded up to one of a fixed set of size classes (each about 1.25x the one
+ * before, like memcached's), and each class hands out items from its own
+ * pages. a freed item goes back to its class and is reused by the next
+ * allocation of about the same size, so the heap doesn't fragment and the
+ * pages stay densely packed.
+ * each thread keeps a small cache of free items per class, so most
+ * allocations and frees touch no lock and no shared cache line at all;
+ * the class's own free list (behind a mutex) is only visited to refill or
+ * drain a thread's cache, SLAB_CACHE_SIZE / 2 items at a time.
+ * pages are never given back to the system - memory freed by a DELETE stays
+ * in its class, ready for the next SET
+ */
+
+// size of one slab page; every class grows a page at a time
+#define SLAB_PAGE_SIZE (1024 * 1024)
+// smallest size class (every class size is a multiple of 8)
+#define SLAB_MIN_ITEM 32
+// anything bigger than this isn't worth slabbing and goes straight to malloc
+#define SLAB_MAX_ITEM (SLAB_PAGE_SIZE / 16)
+// free items a thread may keep per class before handing half of them back
+#define SLAB_CACHE_SIZE 64
+// room for every class the 1.25x growth can produce between the two limits
+#define SLAB_MAX_CLASSES 64
+
+/*
+ * allocate size bytes (8-byte aligned)
+ * returns NULL if no memory could be found
+ */
+void *slab_alloc(size_t size);
+
+/*
+ * give back memory from slab_alloc
+ * size must be the size that was asked for when it was allocated, which is
+ * how the class is found without a header on every item. ptr may be NULL
+ */
+void slab_free(void *ptr, size_t size);
+
+/*
+ * bytes an allocation of size really takes: its class's item size, or size
+ * itself once it is past SLAB_MAX_ITEM and goes to malloc
+ */
+size_t slab_item_size(size_t size);
+
+// how one size class is doing
+typedef struct {
+    size_t item_size;        // bytes each item in the class takes
+    size_t pages;            // pages the class owns
+    size_t items;            // items carved out of those pages so far
+    size_t used;             // items currently handed out
+    size_t requested;        // bytes asked for by the items handed out (<= used * item_size)
+} slab_class_stats_t;
+
+// how many size classes there are (stats are numbered 0 .. slab_class_count() - 1)
+int slab_class_count(void);
+
+/*
+ * fill stats for one class
+ * the counts are summed from every thread without stopping them, so under
+ * load they are a close snapshot rather than an exact one
+ */
+void slab_class_stats(int class_id, slab_class_stats_t *stats);
+
+#endif
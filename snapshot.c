@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kv_hash.h"
+#include "snapshot.h"
+
+// records are gathered into a buffer this big and written out a buffer at a time
+#define SNAPSHOT_BUFFER (1024 * 1024)
+// an index slot: the top 16 bits of the hash over the record's heap offset / 8 + 1
+#define SLOT_TAG_SHIFT 48
+#define SLOT_OFFSET_MASK ((UINT64_C(1) << SLOT_TAG_SHIFT) - 1)
+
+static const char snapshot_magic[8] = { 'K', 'V', 'S', 'N', 'A', 'P', '0', '2' };
+
+typedef struct {
+    char magic[8];
+    uint32_t hash;              // a kv_hash_t
+    uint32_t unused;
+    uint64_t hash_seed;
+    uint64_t log_offset;
+    uint64_t count;
+    uint64_t heap_bytes;        // the heap starts straight after the header
+    uint64_t index_offset;      // where the index starts (straight after the heap)
+    uint64_t index_slots;
+    uint32_t crc;               // of the header, with this field 0
+    uint32_t unused2;
+    uint64_t chunk_offset;      // where the chunk list starts (straight after the index), 0 = no list
+    uint64_t chunk_count;
+    uint64_t chunk_records;
+    char reserved[SNAPSHOT_HEADER - 96];
+} snapshot_header_t;
+
+_Static_assert(sizeof(snapshot_header_t) == SNAPSHOT_HEADER, "the header is SNAPSHOT_HEADER bytes");
+_Static_assert(sizeof(snapshot_record_t) == 24, "records keep their keys 8-byte aligned");
+
+static uint32_t header_crc(const snapshot_header_t *header) {
+    snapshot_header_t copy = *header;
+    copy.crc = 0;
+    return (uint32_t)kv_hash_crc32c(&copy, sizeof(copy), 0);
+}
+
+// how much heap a record takes: itself, key, null, value, null, rounded up to 8
+static uint64_t record_size(size_t key_len, size_t value_len) {
+    return (sizeof(snapshot_record_t) + key_len + 1 + value_len + 1 + 7) & ~(uint64_t)7;
+}
+
+// write all len bytes, however many calls it takes
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// write out whatever is buffered
+static int flush(snapshot_writer_t *writer) {
+    if (!writer->failed && write_all(writer->fd, writer->buf, writer->len) < 0) {
+        writer->failed = 1;
+    }
+    writer->bytes += writer->len;
+    writer->len = 0;
+    return writer->failed ? -1 : 0;
+}
+
+static void writer_free(snapshot_writer_t *writer) {
+    free(writer->tmp_path);
+    free(writer->buf);
+    free(writer->index);
+    free(writer->chunks);
+}
+
+int snapshot_begin(snapshot_writer_t *writer, const char *path, uint64_t max_keys) {
+    memset(writer, 0, sizeof(*writer));
+    // at most 3/4 full, so probes stay short
+    uint64_t slots = 8;
+    while (slots / 4 * 3 < max_keys) {
+        slots *= 2;
+    }
+    size_t tmp_size = strlen(path) + sizeof(".tmp");
+    writer->tmp_path = malloc(tmp_size);
+    writer->buf = malloc(SNAPSHOT_BUFFER);
+    writer->index = calloc(slots, sizeof(uint64_t));
+    writer->index_mask = slots - 1;
+    writer->chunks = malloc((slots / 4 * 3 / SNAPSHOT_CHUNK_RECORDS + 1) * sizeof(uint64_t));
+    if (writer->tmp_path == NULL || writer->buf == NULL || writer->index == NULL || writer->chunks == NULL) {
+        writer_free(writer);
+        return -1;
+    }
+    snprintf(writer->tmp_path, tmp_size, "%s.tmp", path);
+    writer->fd = open(writer->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        writer_free(writer);
+        return -1;
+    }
+    // room for the header, which is only known (and written) at the end
+    memset(writer->buf, 0, SNAPSHOT_HEADER);
+    writer->len = SNAPSHOT_HEADER;
+    return 0;
+}
+
+int snapshot_add(snapshot_writer_t *writer, uint64_t hash, const char *key, size_t key_len,
+                 const char *value, size_t value_len, uint64_t expires) {
+    if (writer->count >= (writer->index_mask + 1) / 4 * 3) {
+        writer->failed = 1;   // more keys than snapshot_begin was told about
+    }
+    if (writer->failed) {
+        return -1;
+    }
+    uint64_t size = record_size(key_len, value_len);
+    if (writer->len + size > SNAPSHOT_BUFFER && flush(writer) < 0) {
+        return -1;
+    }
+
+    char *at = writer->buf + writer->len;
+    snapshot_record_t record = { hash, expires, (uint32_t)writer->count, (uint16_t)value_len, (uint8_t)key_len, 0 };
+    memset(at, 0, size);
+    memcpy(at, &record, sizeof(record));
+    memcpy(at + sizeof(record), key, key_len);
+    memcpy(at + sizeof(record) + key_len + 1, value, value_len);
+
+    if (writer->count % SNAPSHOT_CHUNK_RECORDS == 0) {
+        writer->chunks[writer->count / SNAPSHOT_CHUNK_RECORDS] = writer->heap_bytes;
+    }
+    uint64_t i = hash & writer->index_mask;
+    while (writer->index[i] != 0) {
+        i = (i + 1) & writer->index_mask;
+    }
+    writer->index[i] = (hash >> SLOT_TAG_SHIFT) << SLOT_TAG_SHIFT | (writer->heap_bytes / 8 + 1);
+
+    writer->len += size;
+    writer->heap_bytes += size;
+    writer->count++;
+    return 0;
+}
+
+int snapshot_commit(snapshot_writer_t *writer, const char *path, kv_hash_t hash, uint64_t hash_seed,
+                    uint64_t log_offset) {
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+    header.hash = (uint32_t)hash;
+    header.hash_seed = hash_seed;
+    header.log_offset = log_offset;
+    header.count = writer->count;
+    header.heap_bytes = writer->heap_bytes;
+    header.index_offset = SNAPSHOT_HEADER + writer->heap_bytes;
+    header.index_slots = writer->index_mask + 1;
+    header.chunk_offset = header.index_offset + header.index_slots * sizeof(uint64_t);
+    header.chunk_count = (writer->count + SNAPSHOT_CHUNK_RECORDS - 1) / SNAPSHOT_CHUNK_RECORDS;
+    header.chunk_records = SNAPSHOT_CHUNK_RECORDS;
+    header.crc = header_crc(&header);
+
+    size_t index_len = (size_t)header.index_slots * sizeof(uint64_t);
+    size_t chunks_len = (size_t)header.chunk_count * sizeof(uint64_t);
+    if (flush(writer) < 0 || write_all(writer->fd, (const char *)writer->index, index_len) < 0 ||
+        write_all(writer->fd, (const char *)writer->chunks, chunks_len) < 0 ||
+        pwrite(writer->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        fdatasync(writer->fd) < 0) {
+        snapshot_abort(writer);
+        return -1;
+    }
+    writer->bytes += index_len + chunks_len;
+    close(writer->fd);
+    int result = rename(writer->tmp_path, path) < 0 ? -1 : 0;
+    if (result < 0) {
+        unlink(writer->tmp_path);
+    }
+    writer_free(writer);
+    return result;
+}
+
+void snapshot_abort(snapshot_writer_t *writer) {
+    close(writer->fd);
+    unlink(writer->tmp_path);
+    writer_free(writer);
+}
+
+int snapshot_map(snapshot_t *snapshot, const char *path) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 1 : -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < SNAPSHOT_HEADER) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    // nothing past the header is followed until the header says where it all is, and that adds up
+    snapshot_header_t header;
+    memcpy(&header, map, sizeof(header));
+    uint64_t size = (uint64_t)st.st_size, slots = header.index_slots;
+    // the file ends with the chunk list, or the index if there isn't one
+    uint64_t index_end = header.chunk_offset != 0 ? header.chunk_offset : size;
+    int chunks_ok = header.chunk_offset == 0 ||
+        (header.chunk_records != 0 && header.chunk_offset <= size &&
+         header.chunk_count == (header.count + header.chunk_records - 1) / header.chunk_records &&
+         (size - header.chunk_offset) / sizeof(uint64_t) == header.chunk_count &&
+         (size - header.chunk_offset) % sizeof(uint64_t) == 0);
+    if (memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0 || header_crc(&header) != header.crc ||
+        header.hash > KV_HASH_CRC32C || header.heap_bytes % 8 != 0 ||
+        header.index_offset != SNAPSHOT_HEADER + header.heap_bytes || header.index_offset > index_end ||
+        slots == 0 || (slots & (slots - 1)) != 0 || (index_end - header.index_offset) / sizeof(uint64_t) != slots ||
+        (index_end - header.index_offset) % sizeof(uint64_t) != 0 || header.count > slots ||
+        header.count > UINT32_MAX || !chunks_ok) {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    // lookups land all over the file: read ahead of them only wastes the disk's time
+    madvise(map, (size_t)st.st_size, MADV_RANDOM);
+
+    snapshot->map = map;
+    snapshot->size = (size_t)st.st_size;
+    snapshot->hash = (kv_hash_t)header.hash;
+    snapshot->hash_seed = header.hash_seed;
+    snapshot->log_offset = header.log_offset;
+    snapshot->count = header.count;
+    snapshot->heap = (const char *)map + SNAPSHOT_HEADER;
+    snapshot->heap_bytes = header.heap_bytes;
+    snapshot->index = (const uint64_t *)((const char *)map + header.index_offset);
+    snapshot->index_mask = slots - 1;
+    if (header.chunk_offset != 0) {
+        snapshot->chunks = (const uint64_t *)((const char *)map + header.chunk_offset);
+        snapshot->chunk_count = header.chunk_count;
+        snapshot->chunk_records = header.chunk_records;
+    }
+    return 0;
+}
+
+void snapshot_unmap(snapshot_t *snapshot) {
+    if (snapshot->map != NULL) {
+        munmap(snapshot->map, snapshot->size);
+    }
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+// the record at offset into the heap, or null if it doesn't fit there
+static const snapshot_record_t *record_at(const snapshot_t *snapshot, uint64_t offset) {
+    if (offset % 8 != 0 || offset >= snapshot->heap_bytes ||
+        snapshot->heap_bytes - offset < sizeof(snapshot_record_t)) {
+        return NULL;
+    }
+    const snapshot_record_t *record = (const snapshot_record_t *)(snapshot->heap + offset);
+    if (snapshot->heap_bytes - offset < record_size(record->key_len, record->value_len) ||
+        record->number >= snapshot->count) {
+        return NULL;
+    }
+    return record;
+}
+
+const snapshot_record_t *snapshot_find(const snapshot_t *snapshot, uint64_t hash, const char *key, size_t key_len) {
+    uint64_t tag = hash >> SLOT_TAG_SHIFT;
+    uint64_t i = hash & snapshot->index_mask;
+    for (uint64_t probes = 0; probes <= snapshot->index_mask; probes++) {
+        uint64_t slot = snapshot->index[i];
+        if (slot == 0) {
+            return NULL;
+        }
+        if (slot >> SLOT_TAG_SHIFT == tag) {
+            const snapshot_record_t *record = record_at(snapshot, ((slot & SLOT_OFFSET_MASK) - 1) * 8);
+            if (record != NULL && record->hash == hash && record->key_len == key_len &&
+                memcmp(snapshot_record_key(record), key, key_len) == 0) {
+                return record;
+            }
+        }
+        i = (i + 1) & snapshot->index_mask;
+    }
+    return NULL;
+}
+
+const snapshot_record_t *snapshot_next(const snapshot_t *snapshot, const snapshot_record_t *record) {
+    uint64_t offset = 0;
+    if (record != NULL) {
+        offset = (uint64_t)((const char *)record - snapshot->heap) + record_size(record->key_len, record->value_len);
+    }
+    return record_at(snapshot, offset);
+}
+
+uint64_t snapshot_chunk_count(const snapshot_t *snapshot) {
+    return snapshot->chunks != NULL ? snapshot->chunk_count : 1;
+}
+
+const snapshot_record_t *snapshot_chunk(const snapshot_t *snapshot, uint64_t chunk) {
+    if (snapshot->chunks == NULL) {
+        return chunk == 0 ? record_at(snapshot, 0) : NULL;
+    }
+    const snapshot_record_t *record = chunk < snapshot->chunk_count ? record_at(snapshot, snapshot->chunks[chunk]) : NULL;
+    return record != NULL && record->number == chunk * snapshot->chunk_records ? record : NULL;
+}
+
+uint64_t snapshot_chunk_end(const snapshot_t *snapshot, uint64_t chunk) {
+    if (snapshot->chunks == NULL) {
+        return snapshot->count;
+    }
+    uint64_t end = (chunk + 1) * snapshot->chunk_records;
+    return end < snapshot->count ? end : snapshot->count;
+}
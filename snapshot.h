@@ -0,0 +1,157 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kv_hash.h"
+
+/*
+ * SNAPSHOT FILES
+ * a snapshot is every key in the store at one moment, written to a file so
+ * a restart can start from it instead of replaying the whole write-ahead
+ * log. kv_snapshot (kv_store.c) forks to take one, and the child writes the
+ * file with the functions here while the parent goes on serving (see
+ * SNAPSHOTS in kv_store.h). the file is written as path.tmp and renamed
+ * over path once it is complete and synced, so path always holds a whole
+ * snapshot.
+ *
+ * the file is laid out to be used where it lies, mmap()ed, rather than
+ * read in: a restart maps it and looks keys up in it straight away, and
+ * only the pages that are actually asked for are ever read from disk.
+ * there are no pointers in it, only offsets, so it works wherever it is
+ * mapped. (all numbers are in the machine's byte order.)
+ *   header (SNAPSHOT_HEADER bytes): magic "KVSNAP02", which hash and seed
+ *     the keys were hashed with, the log offset, how many keys there are,
+ *     and where the heap, the index and the chunk list are
+ *   heap: the records, one per key, each 8-byte aligned: a
+ *     snapshot_record_t, then the key and the value, each followed by a null
+ *   index: a power-of-two array of 8-byte slots, at most 3/4 full, probed
+ *     linearly from hash & (slots - 1). a slot is 0 if empty, or else holds
+ *     the top 16 bits of the key's hash over (the record's heap offset / 8
+ *     + 1) - so most slots that hold another key are passed over without
+ *     touching its record
+ *   chunks: the heap offset of every SNAPSHOT_CHUNK_RECORDS-th record, so
+ *     the heap can be split into chunks that are walked independently -
+ *     one per thread when the keys are copied in at startup
+ * the log offset is how far into the write-ahead log the snapshot reaches:
+ * everything logged before it is in the snapshot, so only the log from
+ * there on needs replaying.
+ * the header is checksummed and every offset is checked before it is
+ * followed, but the records themselves are not checksummed - checking them
+ * would mean reading the whole file at startup, which is what the layout
+ * is for avoiding. a file only ever appears at path whole and synced
+ */
+
+#define SNAPSHOT_HEADER 128
+// records per chunk of the heap
+#define SNAPSHOT_CHUNK_RECORDS 65536
+
+// one key's record in the heap (its key and value follow it)
+typedef struct {
+    uint64_t hash;              // the key's hash, with the hash and seed in the header
+    uint64_t expires;           // unix milliseconds, 0 = never
+    uint32_t number;            // the record's place in the heap, 0 .. count - 1
+    uint16_t value_len;
+    uint8_t key_len;
+    uint8_t unused;
+} snapshot_record_t;
+
+static inline const char *snapshot_record_key(const snapshot_record_t *record) {
+    return (const char *)(record + 1);
+}
+
+static inline const char *snapshot_record_value(const snapshot_record_t *record) {
+    return snapshot_record_key(record) + record->key_len + 1;
+}
+
+// a snapshot file, mapped
+typedef struct {
+    void *map;
+    size_t size;
+    kv_hash_t hash;             // how the keys were hashed
+    uint64_t hash_seed;
+    uint64_t log_offset;
+    uint64_t count;             // keys in the snapshot
+    const char *heap;
+    uint64_t heap_bytes;
+    const uint64_t *index;
+    uint64_t index_mask;        // slots - 1
+    const uint64_t *chunks;     // where each chunk starts in the heap (null: the file has no chunk list)
+    uint64_t chunk_count;
+    uint64_t chunk_records;     // records per chunk
+} snapshot_t;
+
+typedef struct {
+    int fd;                     // path.tmp, being written
+    char *tmp_path;
+    char *buf;                  // records not yet written out
+    size_t len;
+    uint64_t *index;            // built in memory, written after the heap
+    uint64_t index_mask;
+    uint64_t *chunks;           // likewise, written after the index
+    uint64_t count;             // records added
+    uint64_t heap_bytes;
+    uint64_t bytes;             // bytes of file written so far
+    int failed;                 // something failed: the snapshot can only be aborted
+} snapshot_writer_t;
+
+/*
+ * start writing a snapshot that will end up at path, of at most max_keys
+ * keys (the index is sized for that many)
+ * returns 0 on success, -1 if the file couldn't be created or memory ran out
+ */
+int snapshot_begin(snapshot_writer_t *writer, const char *path, uint64_t max_keys);
+
+/*
+ * add one key (hash is its hash, as the store worked it out)
+ * returns 0 on success, -1 if writing failed (keep going; commit will fail)
+ */
+int snapshot_add(snapshot_writer_t *writer, uint64_t hash, const char *key, size_t key_len,
+                 const char *value, size_t value_len, uint64_t expires);
+
+/*
+ * write the index, the chunk list and the header, sync the file and rename
+ * it over path
+ * returns 0 on success, -1 on failure (path is left as it was)
+ */
+int snapshot_commit(snapshot_writer_t *writer, const char *path, kv_hash_t hash, uint64_t hash_seed,
+                    uint64_t log_offset);
+
+// give up on a snapshot that won't be committed, removing path.tmp
+void snapshot_abort(snapshot_writer_t *writer);
+
+/*
+ * map the snapshot at path, read-only, and check its header
+ * returns 0 on success, 1 if there is no file, -1 if it can't be mapped or
+ * isn't a snapshot this version can use
+ */
+int snapshot_map(snapshot_t *snapshot, const char *path);
+
+void snapshot_unmap(snapshot_t *snapshot);
+
+/*
+ * find key (key_len bytes, with the given hash) in the index
+ * returns its record, or null if it isn't in the snapshot
+ */
+const snapshot_record_t *snapshot_find(const snapshot_t *snapshot, uint64_t hash, const char *key, size_t key_len);
+
+/*
+ * walk the heap in order: the record after record (null for the first one)
+ * returns null at the end
+ */
+const snapshot_record_t *snapshot_next(const snapshot_t *snapshot, const snapshot_record_t *record);
+
+// how many chunks the heap splits into (a file without a chunk list is one chunk)
+uint64_t snapshot_chunk_count(const snapshot_t *snapshot);
+
+/*
+ * walk one chunk: its first record, and then snapshot_next up to (not
+ * including) the first one whose number is snapshot_chunk_end
+ * returns null if the chunk is empty or its start is damaged
+ */
+const snapshot_record_t *snapshot_chunk(const snapshot_t *snapshot, uint64_t chunk);
+
+// the number of the record after the chunk's last one
+uint64_t snapshot_chunk_end(const snapshot_t *snapshot, uint64_t chunk);
+
+#endif
@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <string.h>
+#include "swisstable.h"
+
+/*
+ * control byte values
+ * a full slot's control byte is 7 bits of its entry's hash (h2), so the top
+ * bit is clear. empty and deleted both have the top bit set, which lets one
+ * instruction find every slot that can take a new entry
+ */
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+/*
+ * the hash is split in two: the low 7 bits (h2) go in the control byte,
+ * the rest (h1) picks the group where probing starts
+ */
+static inline size_t hash_h1(uint64_t hash) {
+    return (size_t)(hash >> 7);
+}
+
+static inline uint8_t hash_h2(uint64_t hash) {
+    return (uint8_t)(hash & 0x7F);
+}
+
+/*
+ * GROUP SCANS
+ * each returns a bitmask with bit i set when control byte i of the group
+ * matches. with SSE2 a whole group is one 16-byte load and one compare;
+ * without it the same thing is done a byte at a time
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// slots in the group whose control byte is exactly value
+static inline uint32_t group_match(const uint8_t *group, uint8_t value) {
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)value)));
+}
+
+// slots that are empty or deleted (top bit set) - movemask reads exactly those bits
+static inline uint32_t group_match_free(const uint8_t *group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+}
+#else
+static inline uint32_t group_match(const uint8_t *group, uint8_t value) {
+    uint32_t mask = 0;
+    for (int i = 0; i < SWISS_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] == value) << i;
+    }
+    return mask;
+}
+
+static inline uint32_t group_match_free(const uint8_t *group) {
+    uint32_t mask = 0;
+    for (int i = 0; i < SWISS_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+}
+#endif
+
+// keep the table at most 7/8 full so probe sequences stay short
+static size_t max_entries(size_t capacity) {
+    return capacity - capacity / 8;
+}
+
+/*
+ * allocate arrays for capacity slots, every slot empty
+ * the control bytes are 16-byte aligned so each group is one aligned load
+ */
+static int alloc_arrays(swiss_table_t *table, size_t capacity) {
+    uint8_t *ctrl = aligned_alloc(SWISS_GROUP_WIDTH, capacity);
+    kv_entry_t **slots = malloc(sizeof(kv_entry_t *) * capacity);
+    if (ctrl == NULL || slots == NULL) {
+        free(ctrl);
+        free(slots);
+        return -1;
+    }
+    memset(ctrl, CTRL_EMPTY, capacity);
+    table->ctrl = ctrl;
+    table->slots = slots;
+    table->capacity = capacity;
+    table->size = 0;
+    table->growth_left = max_entries(capacity);
+    table->old_ctrl = NULL;
+    table->old_slots = NULL;
+    table->old_capacity = 0;
+    table->migrate_group = 0;
+    return 0;
+}
+
+/*
+ * the old arrays of an incremental rehash, dressed up as a table of their
+ * own so the probing functions below can search them too
+ */
+static swiss_table_t old_arrays(const swiss_table_t *table) {
+    swiss_table_t old = *table;
+    old.ctrl = table->old_ctrl;
+    old.slots = table->old_slots;
+    old.capacity = table->old_capacity;
+    return old;
+}
+
+/*
+ * PROBING
+ * start at group h1 and, if that group doesn't settle the question, move on
+ * 1, then 2, then 3... groups further (wrapping around). with a power-of-two
+ * number of groups this visits every group exactly once
+ */
+
+// slot of the first empty or deleted slot along key's probe sequence
+static size_t find_free_slot(const swiss_table_t *table, uint64_t hash) {
+    size_t group_mask = table->capacity / SWISS_GROUP_WIDTH - 1;
+    size_t group = hash_h1(hash) & group_mask;
+    for (size_t step = 1; ; step++) {
+        uint32_t free_slots = group_match_free(table->ctrl + group * SWISS_GROUP_WIDTH);
+        if (free_slots != 0) {
+            return group * SWISS_GROUP_WIDTH + __builtin_ctz(free_slots);
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+// slot holding key, or table->capacity if it isn't there
+static size_t find_slot(const swiss_table_t *table, uint64_t hash, const kv_key_t *probe) {
+    size_t group_mask = table->capacity / SWISS_GROUP_WIDTH - 1;
+    size_t group = hash_h1(hash) & group_mask;
+    uint8_t h2 = hash_h2(hash);
+    for (size_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t *ctrl = table->ctrl + group * SWISS_GROUP_WIDTH;
+        // only slots whose 7 hash bits match are worth comparing (~1 in 128 false hits)
+        uint32_t candidates = group_match(ctrl, h2);
+        while (candidates != 0) {
+            size_t slot = group * SWISS_GROUP_WIDTH + __builtin_ctz(candidates);
+            kv_entry_t *entry = table->slots[slot];
+            if (entry->hash == hash && kv_key_matches(entry, probe)) {
+                return slot;
+            }
+            candidates &= candidates - 1;   // drop the lowest bit, try the next one
+        }
+        // an empty slot means the key was never pushed past this group
+        if (group_match(ctrl, CTRL_EMPTY) != 0) {
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+    return table->capacity;
+}
+
+// slot of the first entry with exactly this hash that match() accepts, or table->capacity
+static size_t find_hash_slot(const swiss_table_t *table, uint64_t hash,
+                             int (*match)(const kv_entry_t *entry, void *arg), void *arg) {
+    size_t group_mask = table->capacity / SWISS_GROUP_WIDTH - 1;
+    size_t group = hash_h1(hash) & group_mask;
+    uint8_t h2 = hash_h2(hash);
+    for (size_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t *ctrl = table->ctrl + group * SWISS_GROUP_WIDTH;
+        uint32_t candidates = group_match(ctrl, h2);
+        while (candidates != 0) {
+            size_t slot = group * SWISS_GROUP_WIDTH + __builtin_ctz(candidates);
+            kv_entry_t *entry = table->slots[slot];
+            if (entry->hash == hash && match(entry, arg)) {
+                return slot;
+            }
+            candidates &= candidates - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY) != 0) {
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+    return table->capacity;
+}
+
+// put an entry that is known not to be there into a free slot of the current arrays
+static void place(swiss_table_t *table, kv_entry_t *entry) {
+    size_t slot = find_free_slot(table, entry->hash);
+    // reusing a deleted slot doesn't use up any of the room that's left
+    if (table->ctrl[slot] == CTRL_EMPTY) {
+        table->growth_left--;
+    }
+    table->ctrl[slot] = hash_h2(entry->hash);
+    table->slots[slot] = entry;
+}
+
+/*
+ * move every entry into fresh arrays of new_capacity slots
+ * this also clears out all deleted markers
+ */
+static int rehash(swiss_table_t *table, size_t new_capacity) {
+    swiss_table_t bigger;
+    if (alloc_arrays(&bigger, new_capacity) < 0) {
+        return -1;
+    }
+    bigger.incremental = table->incremental;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if ((table->ctrl[i] & 0x80) == 0) {
+            place(&bigger, table->slots[i]);
+        }
+    }
+    bigger.size = table->size;
+    swiss_destroy(table);
+    *table = bigger;
+    return 0;
+}
+
+/*
+ * start an incremental rehash into fresh arrays of new_capacity slots
+ * the current arrays become the old ones; nothing is moved yet
+ */
+static int start_rehash(swiss_table_t *table, size_t new_capacity) {
+    swiss_table_t bigger;
+    if (alloc_arrays(&bigger, new_capacity) < 0) {
+        return -1;
+    }
+    table->old_ctrl = table->ctrl;
+    table->old_slots = table->slots;
+    table->old_capacity = table->capacity;
+    table->migrate_group = 0;
+    table->ctrl = bigger.ctrl;
+    table->slots = bigger.slots;
+    table->capacity = bigger.capacity;
+    table->growth_left = bigger.growth_left;
+    return 0;
+}
+
+int swiss_rehash_step(swiss_table_t *table, size_t groups) {
+    if (table->old_ctrl == NULL) {
+        return 0;
+    }
+    size_t old_groups = table->old_capacity / SWISS_GROUP_WIDTH;
+    for (; groups > 0 && table->migrate_group < old_groups; groups--) {
+        size_t first = table->migrate_group++ * SWISS_GROUP_WIDTH;
+        for (size_t i = first; i < first + SWISS_GROUP_WIDTH; i++) {
+            if ((table->old_ctrl[i] & 0x80) == 0) {
+                place(table, table->old_slots[i]);
+                /*
+                 * a deleted marker rather than empty: lookups in the old
+                 * arrays must still probe past this group to reach keys
+                 * that were pushed beyond it and haven't moved yet
+                 */
+                table->old_ctrl[i] = CTRL_DELETED;
+            }
+        }
+    }
+    if (table->migrate_group < old_groups) {
+        return 1;
+    }
+    free(table->old_ctrl);
+    free(table->old_slots);
+    table->old_ctrl = NULL;
+    table->old_slots = NULL;
+    table->old_capacity = 0;
+    return 0;
+}
+
+int swiss_rehashing(const swiss_table_t *table) {
+    return table->old_ctrl != NULL;
+}
+
+int swiss_init(swiss_table_t *table, size_t expected, int incremental) {
+    size_t capacity = SWISS_GROUP_WIDTH;
+    while (max_entries(capacity) < expected) {
+        capacity *= 2;
+    }
+    table->incremental = incremental;
+    return alloc_arrays(table, capacity);
+}
+
+void swiss_destroy(swiss_table_t *table) {
+    free(table->ctrl);
+    free(table->slots);
+    free(table->old_ctrl);
+    free(table->old_slots);
+    table->ctrl = NULL;
+    table->slots = NULL;
+    table->capacity = 0;
+    table->size = 0;
+    table->growth_left = 0;
+    table->old_ctrl = NULL;
+    table->old_slots = NULL;
+    table->old_capacity = 0;
+}
+
+kv_entry_t *swiss_find(const swiss_table_t *table, uint64_t hash, const char *key, size_t key_len) {
+    kv_key_t probe;
+    kv_key_init(&probe, key, key_len);
+    size_t slot = find_slot(table, hash, &probe);
+    if (slot != table->capacity) {
+        return table->slots[slot];
+    }
+    // mid-rehash, the key may not have been moved across yet
+    if (table->old_ctrl != NULL) {
+        swiss_table_t old = old_arrays(table);
+        slot = find_slot(&old, hash, &probe);
+        if (slot != old.capacity) {
+            return old.slots[slot];
+        }
+    }
+    return NULL;
+}
+
+kv_entry_t *swiss_find_hash(const swiss_table_t *table, uint64_t hash,
+                            int (*match)(const kv_entry_t *entry, void *arg), void *arg) {
+    size_t slot = find_hash_slot(table, hash, match, arg);
+    if (slot != table->capacity) {
+        return table->slots[slot];
+    }
+    if (table->old_ctrl != NULL) {
+        swiss_table_t old = old_arrays(table);
+        slot = find_hash_slot(&old, hash, match, arg);
+        if (slot != old.capacity) {
+            return old.slots[slot];
+        }
+    }
+    return NULL;
+}
+
+// the home group of hash: where its probe sequence starts
+static inline size_t home_group(const swiss_table_t *table, uint64_t hash) {
+    return hash_h1(hash) & (table->capacity / SWISS_GROUP_WIDTH - 1);
+}
+
+void swiss_prefetch(const swiss_table_t *table, uint64_t hash) {
+    size_t first = home_group(table, hash) * SWISS_GROUP_WIDTH;
+    __builtin_prefetch(table->ctrl + first);
+    // a group's slot pointers are 128 bytes, two cache lines
+    __builtin_prefetch(table->slots + first);
+    __builtin_prefetch(table->slots + first + SWISS_GROUP_WIDTH / 2);
+}
+
+void swiss_prefetch_entry(const swiss_table_t *table, uint64_t hash) {
+    size_t first = home_group(table, hash) * SWISS_GROUP_WIDTH;
+    uint32_t candidates = group_match(table->ctrl + first, hash_h2(hash));
+    if (candidates != 0) {
+        __builtin_prefetch(table->slots[first + __builtin_ctz(candidates)]);
+    }
+}
+
+int swiss_insert(swiss_table_t *table, kv_entry_t *entry) {
+    swiss_rehash_step(table, SWISS_REHASH_STEP);
+
+    if (table->growth_left == 0) {
+        /*
+         * out of room. if lots of the used-up room is deleted markers,
+         * rebuilding at the same size is enough; otherwise double.
+         * (an incremental rehash moves at least one group per insert, so it
+         * is always done long before the new arrays fill - finishing one
+         * here is only a safety net)
+         */
+        swiss_rehash_step(table, SIZE_MAX);
+        size_t capacity = table->capacity;
+        if (table->size >= max_entries(capacity) / 2) {
+            capacity *= 2;
+        }
+        if (table->incremental) {
+            if (start_rehash(table, capacity) < 0) {
+                return -1;
+            }
+            swiss_rehash_step(table, SWISS_REHASH_STEP);
+        } else if (rehash(table, capacity) < 0) {
+            return -1;
+        }
+    }
+
+    place(table, entry);
+    table->size++;
+    return 0;
+}
+
+kv_entry_t *swiss_remove(swiss_table_t *table, uint64_t hash, const char *key, size_t key_len) {
+    swiss_rehash_step(table, SWISS_REHASH_STEP);
+
+    kv_key_t probe;
+    kv_key_init(&probe, key, key_len);
+    size_t slot = find_slot(table, hash, &probe);
+    if (slot == table->capacity) {
+        // not in the new arrays, but it may still be waiting in the old ones
+        if (table->old_ctrl == NULL) {
+            return NULL;
+        }
+        swiss_table_t old = old_arrays(table);
+        slot = find_slot(&old, hash, &probe);
+        if (slot == old.capacity) {
+            return NULL;
+        }
+        // nothing is ever added to the old arrays, so a deleted marker is all it needs
+        table->old_ctrl[slot] = CTRL_DELETED;
+        table->size--;
+        return old.slots[slot];
+    }
+    kv_entry_t *entry = table->slots[slot];
+
+    /*
+     * if the group still has an empty slot, no lookup ever probed past it,
+     * so this slot can simply become empty again. otherwise some other key
+     * may have been pushed past this (full) group, and an empty slot here
+     * would make its lookups stop too early - so leave a deleted marker
+     */
+    const uint8_t *group = table->ctrl + (slot & ~(size_t)(SWISS_GROUP_WIDTH - 1));
+    if (group_match(group, CTRL_EMPTY) != 0) {
+        table->ctrl[slot] = CTRL_EMPTY;
+        table->growth_left++;
+    } else {
+        table->ctrl[slot] = CTRL_DELETED;
+    }
+    table->size--;
+    return entry;
+}
+
+// the first full slot at or after start (wrapping around), or null if there isn't one
+static kv_entry_t *first_full(const uint8_t *ctrl, kv_entry_t **slots, size_t capacity, size_t start) {
+    for (size_t n = 0; n < capacity; n++) {
+        size_t i = (start + n) & (capacity - 1);
+        if ((ctrl[i] & 0x80) == 0) {
+            return slots[i];
+        }
+    }
+    return NULL;
+}
+
+kv_entry_t *swiss_sample(const swiss_table_t *table, uint64_t r) {
+    if (table->size == 0) {
+        return NULL;
+    }
+    // mid-rehash the entries are split between both arrays, so the top bit of r picks which to try first
+    kv_entry_t *entry = NULL;
+    int old_first = table->old_ctrl != NULL && (r >> 63) != 0;
+    if (old_first) {
+        entry = first_full(table->old_ctrl, table->old_slots, table->old_capacity, r);
+    }
+    if (entry == NULL) {
+        entry = first_full(table->ctrl, table->slots, table->capacity, r);
+    }
+    if (entry == NULL && table->old_ctrl != NULL && !old_first) {
+        entry = first_full(table->old_ctrl, table->old_slots, table->old_capacity, r);
+    }
+    return entry;
+}
+
+kv_entry_t *swiss_slot(const swiss_table_t *table, size_t i) {
+    return (table->ctrl[i] & 0x80) == 0 ? table->slots[i] : NULL;
+}
+
+kv_entry_t *swiss_old_slot(const swiss_table_t *table, size_t i) {
+    return (table->old_ctrl[i] & 0x80) == 0 ? table->old_slots[i] : NULL;
+}
@@ -0,0 +1,131 @@
+#ifndef SWISSTABLE_H
+#define SWISSTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kv_entry.h"
+
+/*
+ * SWISS TABLE
+ * an open-addressing hash table: entries live directly in one flat array of
+ * slots instead of in linked chains, and next to the slots sits an array of
+ * one-byte "control" values - one per slot - that say whether the slot is
+ * empty, deleted, or full, and for full slots also hold 7 bits of the key's
+ * hash. the slots are looked at in groups of SWISS_GROUP_WIDTH: one SIMD
+ * compare checks a whole group's control bytes against the hash bits at
+ * once, so a lookup usually touches one control line and exactly one entry.
+ * the table stores pointers to entries; it does not own them
+ *
+ * INCREMENTAL REHASHING
+ * moving every entry into bigger arrays in one go stalls whoever triggered
+ * it (and everyone waiting on that shard's lock) for as long as it takes -
+ * hundreds of milliseconds once a table holds millions of keys. an
+ * incremental table instead allocates the bigger arrays and keeps the old
+ * ones alongside: lookups check both, new entries go into the new arrays,
+ * and every insert or remove moves the next SWISS_REHASH_STEP groups across.
+ * whoever owns the table can also call swiss_rehash_step() in the
+ * background to get it over with sooner
+ */
+
+#define SWISS_GROUP_WIDTH 16
+// groups of old slots each insert or remove moves across during an incremental rehash
+#define SWISS_REHASH_STEP 2
+
+typedef struct {
+    uint8_t *ctrl;          // one control byte per slot
+    kv_entry_t **slots;     // the entries themselves (valid where ctrl says full)
+    size_t capacity;        // number of slots (a power of two, at least one group)
+    size_t size;            // entries currently in the table (old arrays included)
+    size_t growth_left;     // inserts left before the table must grow
+    int incremental;        // rehash a step at a time instead of all at once?
+    uint8_t *old_ctrl;      // arrays still being moved out of (null when not rehashing)
+    kv_entry_t **old_slots;
+    size_t old_capacity;
+    size_t migrate_group;   // next group of the old arrays to move
+} swiss_table_t;
+
+/*
+ * set up an empty table with room for at least expected entries
+ * incremental picks how it grows (see above): a step at a time, or all at once
+ * returns 0 on success, -1 if memory could not be allocated
+ */
+int swiss_init(swiss_table_t *table, size_t expected, int incremental);
+
+// free the table's arrays, old ones included (the entries are left alone)
+void swiss_destroy(swiss_table_t *table);
+
+/*
+ * find the entry for key (key_len bytes, with the given hash)
+ * returns null if it isn't there
+ */
+kv_entry_t *swiss_find(const swiss_table_t *table, uint64_t hash, const char *key, size_t key_len);
+
+/*
+ * find an entry by its hash alone: the first one with exactly this hash
+ * that match(entry, arg) accepts (two keys can share a 64-bit hash, so the
+ * caller decides which one it wants). returns null if none is accepted
+ */
+kv_entry_t *swiss_find_hash(const swiss_table_t *table, uint64_t hash,
+                            int (*match)(const kv_entry_t *entry, void *arg), void *arg);
+
+/*
+ * PREFETCHING
+ * a lookup in a table too big for the cache usually misses twice: once on
+ * the home group's control bytes and slot pointers, and once on the entry
+ * they lead to. a batch of lookups done one after another pays for those
+ * misses one at a time. instead, the batch can tell the table about keys
+ * it will look up soon: swiss_prefetch starts loading a key's home group,
+ * and a little later, once that has arrived, swiss_prefetch_entry reads it
+ * and starts loading the entry most likely to hold the key. so while one
+ * key is being looked up, the next few are already on their way. neither
+ * waits for memory or changes anything, and both only look at the current
+ * arrays (mid-rehash, a key still in the old ones just isn't prefetched)
+ */
+void swiss_prefetch(const swiss_table_t *table, uint64_t hash);
+void swiss_prefetch_entry(const swiss_table_t *table, uint64_t hash);
+
+/*
+ * add an entry whose key is not in the table yet (entry->hash must be set)
+ * grows the table first if it's full
+ * returns 0 on success, -1 if the table needed to grow and couldn't
+ */
+int swiss_insert(swiss_table_t *table, kv_entry_t *entry);
+
+/*
+ * take the entry for key out of the table
+ * returns the entry (for the caller to free) or null if it wasn't there
+ */
+kv_entry_t *swiss_remove(swiss_table_t *table, uint64_t hash, const char *key, size_t key_len);
+
+/*
+ * move up to groups groups of the old arrays across (SIZE_MAX finishes the job)
+ * returns 1 if the rehash still isn't finished, 0 once it is (or if there
+ * wasn't one going). never allocates, so it can't fail
+ */
+int swiss_rehash_step(swiss_table_t *table, size_t groups);
+
+// is an incremental rehash in progress?
+int swiss_rehashing(const swiss_table_t *table);
+
+/*
+ * pick an entry roughly at random, for eviction: starting from a slot chosen
+ * by r, the first full slot on (old arrays included)
+ * returns null if the table is empty
+ */
+kv_entry_t *swiss_sample(const swiss_table_t *table, uint64_t r);
+
+/*
+ * walk the table: returns the entry in slot i, or null if slot i is not full
+ * visit slots 0 .. table->capacity - 1 to see every entry
+ * only the current arrays are walked, so finish any rehash first
+ */
+kv_entry_t *swiss_slot(const swiss_table_t *table, size_t i);
+
+/*
+ * the same for the old arrays of a rehash that isn't finished: slots
+ * 0 .. table->old_capacity - 1 (none when there's no rehash). walking
+ * both sees every entry exactly once, without moving anything
+ */
+kv_entry_t *swiss_old_slot(const swiss_table_t *table, size_t i);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+/*
+ * the queue is a ring buffer: items live in queue[head .. head + count),
+ * wrapping around at queue_size. one mutex protects everything, and two
+ * condition variables let threads sleep until there's something to do -
+ * workers wait on not_empty, submitters wait on not_full
+ */
+struct threadpool {
+    pthread_mutex_t lock;         // protects every field below
+    pthread_cond_t not_empty;     // signalled when work is added
+    pthread_cond_t not_full;      // signalled when a worker takes work
+    int *queue;                   // file descriptors waiting for a worker
+    int queue_size;               // capacity of queue
+    int head;                     // index of the oldest queued item
+    int count;                    // how many items are queued
+    int shutdown;                 // set by threadpool_destroy
+    pthread_t *workers;           // the worker threads
+    int num_workers;              // how many workers were started
+    void (*handler)(int fd);      // what each worker does with a descriptor
+};
+
+/*
+ * body of every worker thread
+ * take the oldest queued descriptor, run the handler on it, repeat
+ */
+static void *worker_main(void *arg) {
+    threadpool_t *pool = arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        // sleep until there's work (or we're told to stop)
+        while (pool->count == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->count == 0 && pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        int fd = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_size;
+        pool->count--;
+        // a spot just opened up, wake a submitter that may be waiting for it
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        // the actual work happens outside the lock so other workers keep going
+        pool->handler(fd);
+    }
+}
+
+threadpool_t *threadpool_create(int num_workers, int queue_size, void (*handler)(int fd)) {
+    if (num_workers <= 0 || queue_size <= 0) {
+        return NULL;
+    }
+
+    threadpool_t *pool = calloc(1, sizeof(threadpool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->queue = malloc(sizeof(int) * queue_size);
+    pool->workers = malloc(sizeof(pthread_t) * num_workers);
+    if (pool->queue == NULL || pool->workers == NULL) {
+        free(pool->queue);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pool->queue_size = queue_size;
+    pool->handler = handler;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    // start the workers - they'll block on the empty queue right away
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0) {
+            // couldn't start them all: stop the ones that did start
+            pool->num_workers = i;
+            threadpool_destroy(pool);
+            return NULL;
+        }
+    }
+    pool->num_workers = num_workers;
+    return pool;
+}
+
+int threadpool_submit(threadpool_t *pool, int fd) {
+    pthread_mutex_lock(&pool->lock);
+    // queue full: wait here until a worker takes something off it
+    while (pool->count == pool->queue_size && !pool->shutdown) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+    if (pool->shutdown) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    pool->queue[(pool->head + pool->count) % pool->queue_size] = fd;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void threadpool_destroy(threadpool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    // wake everyone: idle workers so they can exit, blocked submitters so they can fail
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    free(pool->queue);
+    free(pool->workers);
+    free(pool);
+}
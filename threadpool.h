@@ -0,0 +1,35 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/*
+ * fixed-size pool of worker threads fed from a bounded queue
+ * the workers are started once up front and then sit waiting for work,
+ * so handing off a client costs a queue push instead of a pthread_create.
+ * each piece of work is a client socket file descriptor; a worker pops one,
+ * calls the handler with it, and goes back for the next
+ */
+typedef struct threadpool threadpool_t;
+
+/*
+ * start num_workers threads that wait for work from a queue holding at most
+ * queue_size file descriptors. handler is called (on a worker thread) once
+ * for every descriptor that gets submitted
+ * returns null if the pool could not be created
+ */
+threadpool_t *threadpool_create(int num_workers, int queue_size, void (*handler)(int fd));
+
+/*
+ * hand a file descriptor to the pool
+ * if the queue is full this blocks until a worker frees up a spot - that's
+ * the backpressure: the caller stops accepting new work instead of piling it up
+ * returns 0 on success, -1 if the pool is shutting down
+ */
+int threadpool_submit(threadpool_t *pool, int fd);
+
+/*
+ * stop the pool: workers finish what's already queued, then exit
+ * waits for every worker to finish and frees the pool
+ */
+void threadpool_destroy(threadpool_t *pool);
+
+#endif
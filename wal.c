@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kv_hash.h"
+#include "wal.h"
+
+// room the record buffers start with (they double whenever a round's records don't fit)
+#define WAL_BUFFER_INITIAL (64 * 1024)
+// replay reads the file this much at a time
+#define WAL_READ_SIZE (1024 * 1024)
+
+typedef struct {
+    uint32_t crc;               // of the rest of the record, header included
+    uint8_t type;
+    uint8_t key_len;
+    uint16_t value_len;
+    uint64_t expires;
+} wal_header_t;
+
+_Static_assert(sizeof(wal_header_t) == 16, "the record header is 16 bytes");
+
+// the longest a record can be
+#define WAL_MAX_RECORD (sizeof(wal_header_t) + UINT8_MAX + UINT16_MAX)
+
+// checksum of a record, covering everything after the crc field itself
+static uint32_t record_crc(const char *record, size_t len) {
+    return (uint32_t)kv_hash_crc32c(record + sizeof(uint32_t), len - sizeof(uint32_t), 0);
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// wait on the log thread's condition for at most ms milliseconds (caller holds lock)
+static void wait_ms(wal_t *wal, uint64_t ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&wal->wake, &wal->lock, &until);
+}
+
+// write all len bytes, however many calls it takes
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * the log thread: each round takes every record logged since the last one,
+ * swaps in the spare buffer for the writers to carry on with, and writes
+ * the lot (and syncs it, if the policy says so) without holding the lock
+ */
+static void *log_thread(void *arg) {
+    wal_t *wal = arg;
+    uint64_t last_sync = monotonic_ms();
+
+    pthread_mutex_lock(&wal->lock);
+    for (;;) {
+        // wait for records, or (WAL_FSYNC_EVERY) for written ones to come due for a sync
+        int sync_due = 0;
+        while (wal->len == 0 && !wal->stop) {
+            if (wal->fsync == WAL_FSYNC_EVERY && wal->written > wal->durable) {
+                uint64_t now = monotonic_ms(), due = last_sync + (uint64_t)wal->fsync_ms;
+                if (now >= due) {
+                    sync_due = 1;
+                    break;
+                }
+                wait_ms(wal, due - now);
+            } else {
+                pthread_cond_wait(&wal->wake, &wal->lock);
+            }
+        }
+        if (wal->len == 0 && !sync_due) {
+            break;   // stopping, and everything has been written (wal_close syncs it)
+        }
+
+        char *buf = wal->buf;
+        size_t len = wal->len, cap = wal->cap;
+        uint64_t end = wal->appended;
+        wal->buf = wal->spare;
+        wal->cap = wal->spare_cap;
+        wal->len = 0;
+        pthread_mutex_unlock(&wal->lock);
+
+        int ok = write_all(wal->fd, buf, len) == 0;
+        uint64_t now = monotonic_ms();
+        int sync = ok && (wal->fsync == WAL_FSYNC_ALWAYS ||
+                          (wal->fsync == WAL_FSYNC_EVERY && now >= last_sync + (uint64_t)wal->fsync_ms));
+        if (sync) {
+            ok = fdatasync(wal->fd) == 0;
+            last_sync = now;
+        }
+
+        pthread_mutex_lock(&wal->lock);
+        wal->spare = buf;
+        wal->spare_cap = cap;
+        if (len > 0) {
+            wal->writes++;
+        }
+        wal->written = end;
+        if (sync && ok) {
+            wal->durable = end;
+            wal->syncs++;
+        }
+        if (!ok) {
+            wal->failed = 1;
+        }
+        pthread_cond_broadcast(&wal->synced);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+int wal_open(wal_t *wal, const char *path, wal_fsync_t fsync, int fsync_ms) {
+    memset(wal, 0, sizeof(*wal));
+    wal->fsync = fsync;
+    wal->fsync_ms = fsync_ms > 0 ? fsync_ms : 1;
+    wal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (wal->fd < 0) {
+        return -1;
+    }
+    if (fstat(wal->fd, &st) < 0) {
+        close(wal->fd);
+        return -1;
+    }
+    wal->base = (uint64_t)st.st_size;
+    wal->buf = malloc(WAL_BUFFER_INITIAL);
+    wal->spare = malloc(WAL_BUFFER_INITIAL);
+    if (wal->buf == NULL || wal->spare == NULL) {
+        goto fail;
+    }
+    wal->cap = wal->spare_cap = WAL_BUFFER_INITIAL;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->wake, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    if (pthread_create(&wal->thread, NULL, log_thread, wal) != 0) {
+        pthread_mutex_destroy(&wal->lock);
+        pthread_cond_destroy(&wal->wake);
+        pthread_cond_destroy(&wal->synced);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    free(wal->buf);
+    free(wal->spare);
+    close(wal->fd);
+    errno = ENOMEM;
+    return -1;
+}
+
+void wal_close(wal_t *wal) {
+    pthread_mutex_lock(&wal->lock);
+    wal->stop = 1;
+    pthread_cond_signal(&wal->wake);
+    pthread_mutex_unlock(&wal->lock);
+    pthread_join(wal->thread, NULL);
+
+    // a clean shutdown loses nothing, whatever the policy
+    fdatasync(wal->fd);
+    close(wal->fd);
+    free(wal->buf);
+    free(wal->spare);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->wake);
+    pthread_cond_destroy(&wal->synced);
+}
+
+int wal_log(wal_t *wal, int type, const char *key, size_t key_len,
+            const char *value, size_t value_len, uint64_t expires, uint64_t *lsn) {
+    if (type == WAL_DELETE) {
+        value_len = 0;
+    }
+    size_t len = sizeof(wal_header_t) + key_len + value_len;
+
+    pthread_mutex_lock(&wal->lock);
+    if (!wal->failed && wal->len + len > wal->cap) {
+        // the log thread is behind (or the records are big): grow rather than make the writer wait
+        size_t cap = wal->cap * 2;
+        while (cap < wal->len + len) {
+            cap *= 2;
+        }
+        char *buf = realloc(wal->buf, cap);
+        if (buf == NULL) {
+            wal->failed = 1;
+        } else {
+            wal->buf = buf;
+            wal->cap = cap;
+        }
+    }
+    if (wal->failed) {
+        pthread_mutex_unlock(&wal->lock);
+        return -1;
+    }
+
+    char *record = wal->buf + wal->len;
+    wal_header_t header = { 0, (uint8_t)type, (uint8_t)key_len, (uint16_t)value_len, expires };
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), key, key_len);
+    if (value_len > 0) {
+        memcpy(record + sizeof(header) + key_len, value, value_len);
+    }
+    header.crc = record_crc(record, len);
+    memcpy(record, &header.crc, sizeof(header.crc));
+
+    // the log thread only needs waking when the buffer was empty; otherwise it's already due a round
+    if (wal->len == 0) {
+        pthread_cond_signal(&wal->wake);
+    }
+    wal->len += len;
+    wal->appended += len;
+    wal->records++;
+    *lsn = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+    return 0;
+}
+
+int wal_sync(wal_t *wal, uint64_t lsn) {
+    if (wal->fsync != WAL_FSYNC_ALWAYS) {
+        return wal_failed(wal) ? -1 : 0;
+    }
+    pthread_mutex_lock(&wal->lock);
+    while (wal->durable < lsn && !wal->failed) {
+        pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+    int result = wal->durable >= lsn ? 0 : -1;
+    pthread_mutex_unlock(&wal->lock);
+    return result;
+}
+
+int wal_failed(wal_t *wal) {
+    pthread_mutex_lock(&wal->lock);
+    int failed = wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    return failed;
+}
+
+uint64_t wal_position(wal_t *wal) {
+    pthread_mutex_lock(&wal->lock);
+    uint64_t position = wal->base + wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+    return position;
+}
+
+void wal_stats(wal_t *wal, wal_stats_t *stats) {
+    pthread_mutex_lock(&wal->lock);
+    stats->records = wal->records;
+    stats->writes = wal->writes;
+    stats->syncs = wal->syncs;
+    stats->bytes = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+long wal_replay(const char *path, uint64_t from, void (*apply)(const wal_record_t *record, void *arg), void *arg) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (from > (uint64_t)st.st_size || lseek(fd, (off_t)from, SEEK_SET) < 0) {
+        from = 0;
+        lseek(fd, 0, SEEK_SET);
+    }
+    // the file is read through buf; each record's key and value are copied out with a null after them
+    char *buf = malloc(WAL_READ_SIZE);
+    char *text = malloc(UINT8_MAX + 1 + UINT16_MAX + 1);
+    if (buf == NULL || text == NULL) {
+        free(buf);
+        free(text);
+        close(fd);
+        return -1;
+    }
+
+    size_t len = 0, pos = 0;
+    off_t read_total = (off_t)from, good = (off_t)from;     // how far into the file the reads, and the good records, reach
+    int eof = 0;
+    long count = 0;
+    for (;;) {
+        // keep at least one whole record's worth in buf, until the file runs out
+        if (!eof && len - pos < WAL_MAX_RECORD) {
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+            ssize_t n = read(fd, buf + len, WAL_READ_SIZE - len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                count = -1;
+                break;
+            }
+            eof = n == 0;
+            len += (size_t)n;
+            read_total += n;
+            continue;
+        }
+
+        // from here on a short record can only mean the file ended in the middle of it
+        wal_header_t header;
+        if (len - pos < sizeof(header)) {
+            break;
+        }
+        memcpy(&header, buf + pos, sizeof(header));
+        size_t record_len = sizeof(header) + header.key_len + header.value_len;
+        if ((header.type != WAL_SET && header.type != WAL_DELETE) || len - pos < record_len ||
+            record_crc(buf + pos, record_len) != header.crc) {
+            break;
+        }
+
+        wal_record_t record;
+        record.type = header.type;
+        record.key = text;
+        record.key_len = header.key_len;
+        record.value = text + header.key_len + 1;
+        record.value_len = header.value_len;
+        record.expires = header.expires;
+        memcpy(text, buf + pos + sizeof(header), header.key_len);
+        text[header.key_len] = '\0';
+        memcpy(text + header.key_len + 1, buf + pos + sizeof(header) + header.key_len, header.value_len);
+        text[header.key_len + 1 + header.value_len] = '\0';
+        apply(&record, arg);
+
+        count++;
+        pos += record_len;
+        good += (off_t)record_len;
+    }
+
+    // drop a torn or damaged tail, so what's logged next follows on from a good record
+    if (count >= 0 && good < read_total && ftruncate(fd, good) < 0) {
+        count = -1;
+    }
+    free(buf);
+    free(text);
+    close(fd);
+    return count;
+}
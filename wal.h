@@ -0,0 +1,145 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * WRITE-AHEAD LOG
+ * an append-only file of every change made to the store, so the store can
+ * be rebuilt after a restart by replaying the file from the start. each
+ * record is the state a change left its key in - its whole value and
+ * expiry (WAL_SET) or that it is gone (WAL_DELETE) - so an INCR or an
+ * EXPIRE is logged as the SET it amounts to, and replay never has to know
+ * what the key held before.
+ *
+ * GROUP COMMIT
+ * writers never touch the file. wal_log copies a record into an in-memory
+ * buffer, under a mutex held for about as long as the copy takes, and a
+ * log thread of its own takes the whole buffer at once and writes it with
+ * one write() and, if the policy says so, one fdatasync(). while it is
+ * busy with the disk, the records that come in meanwhile pile up in a
+ * second buffer and go out together in the next round. so however many
+ * clients are writing at once, each trip to the disk carries all of them,
+ * and the cost of a sync is shared out instead of paid once per write.
+ *
+ * FSYNC POLICIES
+ * WAL_FSYNC_ALWAYS: every round is synced, and wal_sync waits for the sync
+ *                   that covers a record - nothing reported done can be lost
+ * WAL_FSYNC_EVERY:  the file is synced every fsync_ms milliseconds, so a
+ *                   crash of the machine loses at most about that much
+ * WAL_FSYNC_NO:     never synced here; the os writes the file back when it
+ *                   likes. survives the process dying, not the machine
+ *
+ * a record is a 16-byte header, the key, then the value (in the machine's
+ * byte order):
+ *   crc (4 bytes, of everything after it) | type (1) | key_len (1) | value_len (2) | expires (8)
+ * a crash can leave the last record half-written; replay stops at the
+ * first record that doesn't check out and cuts the file back to there
+ */
+
+typedef enum {
+    WAL_FSYNC_ALWAYS,
+    WAL_FSYNC_EVERY,
+    WAL_FSYNC_NO
+} wal_fsync_t;
+
+#define WAL_SET 1
+#define WAL_DELETE 2
+
+// a record as replay hands it back (key and value are null-terminated)
+typedef struct {
+    int type;                   // WAL_SET or WAL_DELETE
+    const char *key;
+    size_t key_len;
+    const char *value;          // WAL_SET only
+    size_t value_len;
+    uint64_t expires;           // WAL_SET: when the key expires, in unix milliseconds (0 = never)
+} wal_record_t;
+
+typedef struct {
+    int fd;                     // the log file, opened for appending
+    wal_fsync_t fsync;
+    int fsync_ms;               // WAL_FSYNC_EVERY: how often
+    pthread_t thread;           // the log thread
+    pthread_mutex_t lock;       // guards everything below
+    pthread_cond_t wake;        // signalled when records arrive (or it's time to stop)
+    pthread_cond_t synced;      // broadcast after every round, for wal_sync
+    char *buf;                  // records waiting for the log thread
+    size_t len;
+    size_t cap;
+    char *spare;                // the other buffer, which the log thread writes from
+    size_t spare_cap;
+    uint64_t base;              // how long the file was when it was opened
+    uint64_t appended;          // bytes logged since the file was opened (a record's lsn is where it ends)
+    uint64_t written;           // bytes handed to write() so far
+    uint64_t durable;           // bytes covered by an fdatasync() so far
+    size_t records;             // records logged
+    size_t writes;              // rounds of writing (each one write())
+    size_t syncs;               // fdatasync() calls
+    int failed;                 // a write or sync failed (or memory ran out): nothing logged since is safe
+    int stop;                   // set by wal_close
+} wal_t;
+
+/*
+ * open (or create) the log at path for appending and start its log thread
+ * returns 0 on success, -1 on failure (errno says why)
+ */
+int wal_open(wal_t *wal, const char *path, wal_fsync_t fsync, int fsync_ms);
+
+/*
+ * write out and sync everything logged, stop the log thread and close the file
+ * nothing else may be logging
+ */
+void wal_close(wal_t *wal);
+
+/*
+ * log a record (value is ignored for WAL_DELETE)
+ * callers that need records replayed in the order they happened must log
+ * them while holding whatever lock ordered the changes
+ * returns 0 and fills *lsn on success, -1 if the log has failed
+ */
+int wal_log(wal_t *wal, int type, const char *key, size_t key_len,
+            const char *value, size_t value_len, uint64_t expires, uint64_t *lsn);
+
+/*
+ * WAL_FSYNC_ALWAYS: wait until the record that ends at lsn is on disk
+ * (other policies return straight away)
+ * returns 0, or -1 if the log has failed
+ */
+int wal_sync(wal_t *wal, uint64_t lsn);
+
+// has anything gone wrong writing the log?
+int wal_failed(wal_t *wal);
+
+/*
+ * where in the file the next record will start, counting what is still
+ * waiting to be written (a snapshot notes this, to replay the log from)
+ * callers must hold whatever lock stops new records being logged
+ */
+uint64_t wal_position(wal_t *wal);
+
+// how the log is doing
+typedef struct {
+    size_t records;          // records logged since the file was opened
+    size_t writes;           // rounds of writing (records / writes is how many each trip to the disk carried)
+    size_t syncs;            // fdatasync() calls
+    uint64_t bytes;          // bytes logged
+} wal_stats_t;
+
+void wal_stats(wal_t *wal, wal_stats_t *stats);
+
+/*
+ * call apply for every record in the log at path, in order, starting at
+ * byte from (0 for the whole log, or a snapshot's log offset). a log
+ * shorter than from can't be the one the offset was taken from, so it is
+ * replayed whole
+ * a missing file is an empty log. a damaged record ends the log: the file
+ * is cut back to just before it, so new records follow on from the last
+ * good one
+ * returns how many records were replayed, or -1 if the file couldn't be read
+ */
+long wal_replay(const char *path, uint64_t from, void (*apply)(const wal_record_t *record, void *arg), void *arg);
+
+#endif
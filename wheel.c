@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include "wheel.h"
+
+// a slot that grew past this many timers gives its memory back once emptied
+#define WHEEL_KEEP 256
+
+void wheel_init(wheel_t *wheel, uint64_t now) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->tick = now / WHEEL_TICK_MS;
+    wheel->cascaded = 0;
+    wheel->count = 0;
+}
+
+void wheel_destroy(wheel_t *wheel) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            free(wheel->slots[level][i].timers);
+        }
+    }
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->count = 0;
+}
+
+static int slot_push(wheel_slot_t *slot, wheel_timer_t timer) {
+    if (slot->count == slot->capacity) {
+        size_t capacity = slot->capacity ? slot->capacity * 2 : 8;
+        wheel_timer_t *timers = realloc(slot->timers, capacity * sizeof(wheel_timer_t));
+        if (timers == NULL) {
+            return -1;
+        }
+        slot->timers = timers;
+        slot->capacity = capacity;
+    }
+    slot->timers[slot->count++] = timer;
+    return 0;
+}
+
+/*
+ * the slot a timer belongs in, as seen from the wheel's current tick
+ * the level is the lowest one whose turn reaches far enough ahead; overdue
+ * timers go in the very next tick, and ones beyond the top level wait in
+ * its furthest slot
+ */
+static wheel_slot_t *slot_for(wheel_t *wheel, uint64_t expires) {
+    uint64_t due = expires / WHEEL_TICK_MS;
+    if (due < wheel->tick) {
+        due = wheel->tick;
+    }
+    uint64_t delta = due - wheel->tick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1ull << (WHEEL_BITS * WHEEL_LEVELS))) {
+        due = wheel->tick + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    return &wheel->slots[level][(due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+}
+
+int wheel_add(wheel_t *wheel, uint64_t hash, uint64_t expires) {
+    wheel_timer_t timer = { hash, expires };
+    if (slot_push(slot_for(wheel, expires), timer) < 0) {
+        return -1;
+    }
+    wheel->count++;
+    return 0;
+}
+
+// an emptied slot keeps a small array for next time, but not a big one
+static void slot_emptied(wheel_slot_t *slot) {
+    slot->count = 0;
+    if (slot->capacity > WHEEL_KEEP) {
+        free(slot->timers);
+        slot->timers = NULL;
+        slot->capacity = 0;
+    }
+}
+
+/*
+ * at the start of a tick, empty out the slot of every level that has just
+ * gone round into the levels below. the top level goes first, so timers it
+ * drops into a lower slot that is also due now get moved on down too
+ */
+static void cascade(wheel_t *wheel) {
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+        uint64_t below = (1ull << (WHEEL_BITS * level)) - 1;
+        if ((wheel->tick & below) != 0) {
+            continue;
+        }
+        wheel_slot_t *slot = &wheel->slots[level][(wheel->tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+        // take the array out first: a timer may land right back in this same slot
+        wheel_slot_t moving = *slot;
+        memset(slot, 0, sizeof(*slot));
+        for (size_t i = 0; i < moving.count; i++) {
+            if (slot_push(slot_for(wheel, moving.timers[i].expires), moving.timers[i]) < 0) {
+                wheel->count--;   // out of memory: the key will still expire when it's next looked up
+            }
+        }
+        free(moving.timers);
+    }
+}
+
+int wheel_advance(wheel_t *wheel, uint64_t now, size_t budget,
+                  void (*fire)(uint64_t hash, void *arg), void *arg) {
+    uint64_t now_tick = now / WHEEL_TICK_MS;
+    if (wheel->count == 0) {
+        // nothing to run: just move the clock on
+        if (wheel->tick < now_tick) {
+            wheel->tick = now_tick;
+            wheel->cascaded = 0;
+        }
+        return 0;
+    }
+
+    size_t fired = 0;
+    while (wheel->tick < now_tick) {
+        if (!wheel->cascaded) {
+            cascade(wheel);
+            wheel->cascaded = 1;
+        }
+        wheel_slot_t *slot = &wheel->slots[0][wheel->tick & (WHEEL_SLOTS - 1)];
+        while (slot->count > 0) {
+            if (fired == budget) {
+                return 1;
+            }
+            // from the back, so stopping halfway leaves the slot consistent
+            wheel_timer_t timer = slot->timers[--slot->count];
+            wheel->count--;
+            fire(timer.hash, arg);
+            fired++;
+        }
+        slot_emptied(slot);
+        wheel->tick++;
+        wheel->cascaded = 0;
+    }
+    return 0;
+}
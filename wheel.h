@@ -0,0 +1,73 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * HIERARCHICAL TIMER WHEEL
+ * keeps track of when keys expire, so expired keys can be found without
+ * scanning the table. time is cut into ticks of WHEEL_TICK_MS, and the
+ * wheel has WHEEL_LEVELS rings of WHEEL_SLOTS slots each: a slot in level 0
+ * holds the timers due in one tick, a slot in level 1 the timers due in one
+ * whole turn of level 0 (WHEEL_SLOTS ticks), and so on up. adding a timer
+ * just appends it to the slot its due time falls in. every time level 0
+ * goes round, the next slot of level 1 is emptied out into level 0 (and the
+ * same one level up, when level 1 goes round), so a timer is only ever
+ * touched once per level on its way down - O(1) amortized, no matter how
+ * many timers there are. due times past the top level are parked in its
+ * furthest slot and placed again when it comes round.
+ *
+ * a timer is just a key's hash and the time it is due: it does not point
+ * at the entry, so an entry can be deleted, or its expiry moved, without
+ * finding its timer. whoever fires a timer checks the entries with that
+ * hash and only removes the ones that really have expired; a timer left
+ * over from an expiry that was moved finds nothing to do
+ */
+
+#define WHEEL_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+// 4 levels of 64 slots at 100 ms a tick reach about 19 days ahead
+#define WHEEL_LEVELS 4
+
+typedef struct {
+    uint64_t hash;          // the key's hash
+    uint64_t expires;       // when it is due, in milliseconds
+} wheel_timer_t;
+
+typedef struct {
+    wheel_timer_t *timers;  // the slot's timers, in no particular order
+    size_t count;
+    size_t capacity;
+} wheel_slot_t;
+
+typedef struct {
+    wheel_slot_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t tick;          // the next tick to run
+    int cascaded;           // have the levels above already been emptied down for tick?
+    size_t count;           // timers in the wheel
+} wheel_t;
+
+// set up an empty wheel whose clock starts at now (milliseconds)
+void wheel_init(wheel_t *wheel, uint64_t now);
+
+// free every slot (the timers in them are dropped)
+void wheel_destroy(wheel_t *wheel);
+
+/*
+ * add a timer for the key with this hash, due at expires (milliseconds)
+ * returns 0 on success, -1 if memory could not be allocated
+ */
+int wheel_add(wheel_t *wheel, uint64_t hash, uint64_t expires);
+
+/*
+ * run every tick that has fully passed by now, calling fire(hash, arg) for
+ * each timer that comes due. stops early once budget timers have fired, so
+ * the caller can let go of its lock in between
+ * returns 1 if it stopped early with timers still due, 0 once caught up
+ */
+int wheel_advance(wheel_t *wheel, uint64_t now, size_t budget,
+                  void (*fire)(uint64_t hash, void *arg), void *arg);
+
+#endif